@@ -79,6 +79,7 @@ struct wet_compositor {
 	struct wet_output_config *parsed_options;
 	struct wl_listener pending_output_listener;
 	bool drm_use_current_mode;
+	enum weston_headless_refresh_mode headless_refresh_mode;
 };
 
 static FILE *weston_logfile = NULL;
@@ -585,6 +586,9 @@ usage(int error_code)
 		"  --transform=TR\tThe output transformation, TR is one of:\n"
 		"\tnormal 90 180 270 flipped flipped-90 flipped-180 flipped-270\n"
 		"  --use-pixman\t\tUse the pixman (CPU) renderer (default: no rendering)\n"
+		"  --use-gl\t\tUse the GL renderer into offscreen buffers\n"
+		"  --refresh=MHZ\t\tRefresh rate in mHz (default: 60000)\n"
+		"  --refresh-mode=MODE\tfixed, variable or free-running\n"
 		"  --no-outputs\t\tDo not create any virtual outputs\n"
 		"\n");
 #endif
@@ -601,6 +605,8 @@ usage(int error_code)
 		"  --rdp4-key=FILE\tThe file containing the key for RDP4 encryption\n"
 		"  --rdp-tls-cert=FILE\tThe file containing the certificate for TLS encryption\n"
 		"  --rdp-tls-key=FILE\tThe file containing the private key for TLS encryption\n"
+		"  --rdp-encoder-threads=N\tEncode updates on N threads, 0 for the main thread\n"
+		"  --rdp-hash-tiles	Do not send damaged tiles whose content did not change\n"
 		"\n");
 #endif
 
@@ -886,6 +892,7 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	struct xkb_rule_names xkb_names;
 	struct weston_config_section *s;
 	int repaint_msec;
+	int repaint_adaptive;
 	int vt_switching;
 
 	s = weston_config_get_section(config, "keyboard", NULL, NULL);
@@ -924,9 +931,44 @@ weston_compositor_init_config(struct weston_compositor *ec,
 	weston_log("Output repaint window is %d ms maximum.\n",
 		   ec->repaint_msec);
 
+	weston_config_section_get_bool(s, "adaptive-repaint-window",
+				       &repaint_adaptive, false);
+	ec->repaint_adaptive = repaint_adaptive;
+	if (ec->repaint_adaptive)
+		weston_log("Output repaint window adapts to measured "
+			   "repaint times.\n");
+
+	weston_config_section_get_int(s, "renderer-threads",
+				      &ec->renderer_threads, 1);
+
 	return 0;
 }
 
+static void
+wet_init_frame_stats(struct weston_compositor *ec,
+		     struct weston_config_section *section)
+{
+	const char *dir = getenv("XDG_RUNTIME_DIR");
+	const char *display = getenv("WAYLAND_DISPLAY");
+	char *path;
+	int interval;
+
+	weston_config_section_get_int(section, "frame-stats-interval",
+				      &interval, 0);
+	if (interval <= 0 || !dir)
+		return;
+
+	if (asprintf(&path, "%s/weston-frame-stats-%s", dir,
+		     display ? display : "wayland-0") < 0)
+		return;
+
+	if (weston_compositor_set_frame_stats_file(ec, path, interval) < 0)
+		weston_log("Failed to set up frame statistics file '%s'\n",
+			   path);
+
+	free(path);
+}
+
 static char *
 weston_choose_default_backend(void)
 {
@@ -1166,6 +1208,7 @@ drm_backend_output_configure(struct wl_listener *listener, void *data)
 	char *modeline = NULL;
 	char *gbm_format = NULL;
 	char *seat = NULL;
+	char *group = NULL;
 
 	if (!api) {
 		weston_log("Cannot use weston_drm_output_api.\n");
@@ -1208,6 +1251,11 @@ drm_backend_output_configure(struct wl_listener *listener, void *data)
 	api->set_seat(output, seat);
 	free(seat);
 
+	weston_config_section_get_string(section, "group", &group, NULL);
+
+	api->set_group(output, group);
+	free(group);
+
 	weston_output_enable(output);
 }
 
@@ -1237,6 +1285,8 @@ load_drm_backend(struct weston_compositor *c,
 					 NULL);
 	weston_config_section_get_uint(section, "pageflip-timeout",
 	                               &config.pageflip_timeout, 0);
+	weston_config_section_get_uint(section, "pixman-buffers",
+				       &config.pixman_buffers, 0);
 
 	config.base.struct_version = WESTON_DRM_BACKEND_CONFIG_VERSION;
 	config.base.struct_size = sizeof(struct weston_drm_backend_config);
@@ -1253,16 +1303,59 @@ load_drm_backend(struct weston_compositor *c,
 	return ret;
 }
 
+static int
+parse_headless_refresh_mode(const char *s,
+			    enum weston_headless_refresh_mode *mode)
+{
+	if (strcmp(s, "fixed") == 0)
+		*mode = WESTON_HEADLESS_REFRESH_FIXED;
+	else if (strcmp(s, "variable") == 0)
+		*mode = WESTON_HEADLESS_REFRESH_VARIABLE;
+	else if (strcmp(s, "free-running") == 0)
+		*mode = WESTON_HEADLESS_REFRESH_FREE_RUNNING;
+	else
+		return -1;
+
+	return 0;
+}
+
 static void
 headless_backend_output_configure(struct wl_listener *listener, void *data)
 {
 	struct weston_output *output = data;
+	struct wet_compositor *wet = to_wet_compositor(output->compositor);
+	struct weston_config *wc = wet_get_config(output->compositor);
+	struct weston_config_section *section;
+	const struct weston_headless_output_api *api =
+		weston_headless_output_get_api(output->compositor);
+	enum weston_headless_refresh_mode mode = wet->headless_refresh_mode;
 	struct wet_output_config defaults = {
 		.width = 1024,
 		.height = 640,
 		.scale = 1,
 		.transform = WL_OUTPUT_TRANSFORM_NORMAL
 	};
+	char *refresh_mode;
+	int32_t refresh;
+
+	section = weston_config_get_section(wc, "output", "name", output->name);
+	weston_config_section_get_int(section, "refresh", &refresh, 0);
+	weston_config_section_get_string(section, "refresh-mode",
+					 &refresh_mode, NULL);
+
+	if (refresh_mode &&
+	    parse_headless_refresh_mode(refresh_mode, &mode) < 0) {
+		weston_log("Invalid refresh-mode \"%s\" for output %s\n",
+			   refresh_mode, output->name);
+		free(refresh_mode);
+		refresh_mode = NULL;
+	}
+
+	if ((refresh || refresh_mode) && api &&
+	    api->set_refresh(output, refresh, mode) < 0)
+		weston_log("Cannot set refresh rate of output \"%s\".\n",
+			   output->name);
+	free(refresh_mode);
 
 	if (wet_configure_windowed_output_from_config(output, &defaults) < 0)
 		weston_log("Cannot configure output \"%s\".\n", output->name);
@@ -1272,11 +1365,13 @@ static int
 load_headless_backend(struct weston_compositor *c,
 		      int *argc, char **argv, struct weston_config *wc)
 {
+	struct wet_compositor *wet = to_wet_compositor(c);
 	const struct weston_windowed_output_api *api;
 	struct weston_headless_backend_config config = {{ 0, }};
 	int no_outputs = 0;
 	int ret = 0;
 	char *transform = NULL;
+	char *refresh_mode = NULL;
 
 	struct wet_output_config *parsed_options = wet_init_parsed_options(c);
 	if (!parsed_options)
@@ -1286,12 +1381,24 @@ load_headless_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_INTEGER, "width", 0, &parsed_options->width },
 		{ WESTON_OPTION_INTEGER, "height", 0, &parsed_options->height },
 		{ WESTON_OPTION_BOOLEAN, "use-pixman", 0, &config.use_pixman },
+		{ WESTON_OPTION_BOOLEAN, "use-gl", 0, &config.use_gl },
 		{ WESTON_OPTION_STRING, "transform", 0, &transform },
 		{ WESTON_OPTION_BOOLEAN, "no-outputs", 0, &no_outputs },
+		{ WESTON_OPTION_INTEGER, "refresh", 0, &config.refresh },
+		{ WESTON_OPTION_STRING, "refresh-mode", 0, &refresh_mode },
 	};
 
 	parse_options(options, ARRAY_LENGTH(options), argc, argv);
 
+	if (refresh_mode) {
+		if (parse_headless_refresh_mode(refresh_mode,
+						&config.refresh_mode) < 0)
+			weston_log("Invalid refresh mode \"%s\"\n",
+				   refresh_mode);
+		free(refresh_mode);
+	}
+	wet->headless_refresh_mode = config.refresh_mode;
+
 	if (transform) {
 		if (weston_parse_transform(transform, &parsed_options->transform) < 0) {
 			weston_log("Invalid transform \"%s\"\n", transform);
@@ -1375,6 +1482,8 @@ weston_rdp_backend_config_init(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->encoder_threads = 2;
+	config->hash_tiles = 0;
 }
 
 static int
@@ -1399,7 +1508,9 @@ load_rdp_backend(struct weston_compositor *c,
 		{ WESTON_OPTION_BOOLEAN, "no-clients-resize", 0, &config.no_clients_resize },
 		{ WESTON_OPTION_STRING,  "rdp4-key", 0, &config.rdp_key },
 		{ WESTON_OPTION_STRING,  "rdp-tls-cert", 0, &config.server_cert },
-		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key }
+		{ WESTON_OPTION_STRING,  "rdp-tls-key", 0, &config.server_key },
+		{ WESTON_OPTION_INTEGER, "rdp-encoder-threads", 0, &config.encoder_threads },
+		{ WESTON_OPTION_BOOLEAN, "rdp-hash-tiles", 0, &config.hash_tiles }
 	};
 
 	parse_options(rdp_options, ARRAY_LENGTH(rdp_options), argc, argv);
@@ -1938,6 +2049,8 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	wet_init_frame_stats(ec, section);
+
 	if (!shell)
 		weston_config_section_get_string(section, "shell", &shell,
 						 "desktop-shell.so");
@@ -47,6 +47,10 @@
 #include "shared/timespec-util.h"
 #include "fullscreen-shell-unstable-v1-client-protocol.h"
 
+/* Number of repaints whose damage is remembered to bring a reused buffer
+ * up to date; buffers that missed more are read back in full. */
+#define SS_DAMAGE_HISTORY 4
+
 struct shared_output {
 	struct weston_output *output;
 	struct wl_listener output_destroyed;
@@ -56,6 +60,7 @@ struct shared_output {
 		struct wl_display *display;
 		struct wl_registry *registry;
 		struct wl_compositor *compositor;
+		uint32_t compositor_version;
 		struct wl_shm *shm;
 		uint32_t shm_formats;
 		struct zwp_fullscreen_shell_v1 *fshell;
@@ -63,6 +68,8 @@ struct shared_output {
 		struct wl_surface *surface;
 		struct wl_callback *frame_cb;
 		struct zwp_fullscreen_shell_mode_feedback_v1 *mode_feedback;
+		int32_t buffer_transform;
+		int32_t buffer_scale;
 	} parent;
 
 	struct wl_event_source *event_source;
@@ -73,12 +80,16 @@ struct shared_output {
 
 		struct wl_list buffers;
 		struct wl_list free_buffers;
+
+		/* Read back but not yet committed to the parent */
+		struct ss_shm_buffer *pending;
+
+		/* Damage of the last repaints, in buffer coordinates */
+		pixman_region32_t history[SS_DAMAGE_HISTORY];
 	} shm;
 
-	int cache_dirty;
-	pixman_image_t *cache_image;
-	uint32_t *tmp_data;
-	size_t tmp_data_size;
+	/* Damage since the last commit, in output coordinates */
+	pixman_region32_t damage;
 };
 
 struct ss_seat {
@@ -104,9 +115,9 @@ struct ss_shm_buffer {
 	struct wl_buffer *buffer;
 	void *data;
 	size_t size;
-	pixman_region32_t damage;
 
-	pixman_image_t *pm_image;
+	/* Number of repaints the content is behind, -1 if undefined */
+	int age;
 };
 
 struct screen_share {
@@ -393,13 +404,9 @@ ss_seat_destroy(struct ss_seat *seat)
 static void
 ss_shm_buffer_destroy(struct ss_shm_buffer *buffer)
 {
-	pixman_image_unref(buffer->pm_image);
-
 	wl_buffer_destroy(buffer->buffer);
 	munmap(buffer->data, buffer->size);
 
-	pixman_region32_fini(&buffer->damage);
-
 	wl_list_remove(&buffer->link);
 	wl_list_remove(&buffer->free_link);
 	free(buffer);
@@ -421,17 +428,21 @@ static const struct wl_buffer_listener buffer_listener = {
 	buffer_release
 };
 
+/* Buffers are kept mapped and reused; the one freed by the parent that
+ * is the least behind the output is picked. The parent keeps hold of at
+ * most two, so the ring only grows past three if it is slow to release
+ * them. */
 static struct ss_shm_buffer *
 shared_output_get_shm_buffer(struct shared_output *so)
 {
-	struct ss_shm_buffer *sb, *bnext;
+	struct ss_shm_buffer *sb, *bnext, *best = NULL;
 	struct wl_shm_pool *pool;
 	int width, height, stride;
 	int fd;
 	unsigned char *data;
 
-	width = so->output->width;
-	height = so->output->height;
+	width = so->output->current_mode->width;
+	height = so->output->current_mode->height;
 	stride = width * 4;
 
 	/* If the size of the output changed, we free the old buffers and
@@ -443,21 +454,37 @@ shared_output_get_shm_buffer(struct shared_output *so)
 		wl_list_for_each_safe(sb, bnext, &so->shm.free_buffers, free_link)
 			ss_shm_buffer_destroy(sb);
 
+		if (so->shm.pending) {
+			ss_shm_buffer_destroy(so->shm.pending);
+			so->shm.pending = NULL;
+		}
+
 		/* Orphan in-use buffers so they get destroyed */
 		wl_list_for_each(sb, &so->shm.buffers, link)
 			sb->output = NULL;
 
 		so->shm.width = width;
 		so->shm.height = height;
+
+		pixman_region32_union_rect(&so->damage, &so->damage, 0, 0,
+					   so->output->width,
+					   so->output->height);
+	}
+
+	if (so->shm.pending)
+		return so->shm.pending;
+
+	wl_list_for_each(sb, &so->shm.free_buffers, free_link) {
+		if (!best || (sb->age >= 0 &&
+			      (best->age < 0 || sb->age < best->age)))
+			best = sb;
 	}
 
-	if (!wl_list_empty(&so->shm.free_buffers)) {
-		sb = container_of(so->shm.free_buffers.next,
-				  struct ss_shm_buffer, free_link);
-		wl_list_remove(&sb->free_link);
-		wl_list_init(&sb->free_link);
+	if (best) {
+		wl_list_remove(&best->free_link);
+		wl_list_init(&best->free_link);
 
-		return sb;
+		return best;
 	}
 
 	fd = os_create_anonymous_file(height * stride);
@@ -480,10 +507,9 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	wl_list_init(&sb->free_link);
 	wl_list_insert(&so->shm.buffers, &sb->link);
 
-	pixman_region32_init_rect(&sb->damage, 0, 0, width, height);
-
 	sb->data = data;
 	sb->size = height * stride;
+	sb->age = -1;
 
 	pool = wl_shm_create_pool(so->parent.shm, fd, sb->size);
 
@@ -493,116 +519,136 @@ shared_output_get_shm_buffer(struct shared_output *so)
 	wl_buffer_add_listener(sb->buffer, &buffer_listener, sb);
 	wl_shm_pool_destroy(pool);
 	close(fd);
-	fd = -1;
-
-	memset(data, 0, sb->size);
-
-	sb->pm_image =
-		pixman_image_create_bits(PIXMAN_a8r8g8b8, width, height,
-					 (uint32_t *)data, stride);
-	if (!sb->pm_image)
-		goto out_pixman_error;
 
 	return sb;
 
-out_pixman_error:
-	pixman_region32_fini(&sb->damage);
 out_unmap:
 	munmap(data, height * stride);
 out_close:
-	if (fd != -1)
-		close(fd);
+	close(fd);
 	return NULL;
 }
 
+/* The buffer transform to give the parent for a buffer holding the
+ * output's framebuffer upside down. A vertical flip is FLIPPED_180, and
+ * flipping after a transform reverses the direction of its rotation. */
+static int32_t
+flip_transform_vertically(int32_t transform)
+{
+	return ((6 - transform) & 3) | (~transform & 4);
+}
+
+/* Reverse the order of rows y1 to y2 of a buffer in place. */
 static void
-output_compute_transform(struct weston_output *output,
-			 pixman_transform_t *transform)
+flip_rows(uint8_t *data, int32_t stride, int y1, int y2, uint8_t *row)
 {
-	pixman_fixed_t fw, fh;
-
-	pixman_transform_init_identity(transform);
-
-	fw = pixman_int_to_fixed(output->width);
-	fh = pixman_int_to_fixed(output->height);
-
-	switch (output->transform) {
-	case WL_OUTPUT_TRANSFORM_FLIPPED:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_scale(transform, NULL,
-				       pixman_int_to_fixed (-1),
-				       pixman_int_to_fixed (1));
-		pixman_transform_translate(transform, NULL, fw, 0);
-	}
+	uint8_t *top = data + y1 * stride;
+	uint8_t *bottom = data + (y2 - 1) * stride;
 
-	switch (output->transform) {
-	default:
-	case WL_OUTPUT_TRANSFORM_NORMAL:
-	case WL_OUTPUT_TRANSFORM_FLIPPED:
-		break;
-	case WL_OUTPUT_TRANSFORM_90:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_90:
-		pixman_transform_rotate(transform, NULL, 0, pixman_fixed_1);
-		pixman_transform_translate(transform, NULL, fh, 0);
-		break;
-	case WL_OUTPUT_TRANSFORM_180:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_180:
-		pixman_transform_rotate(transform, NULL, -pixman_fixed_1, 0);
-		pixman_transform_translate(transform, NULL, fw, fh);
-		break;
-	case WL_OUTPUT_TRANSFORM_270:
-	case WL_OUTPUT_TRANSFORM_FLIPPED_270:
-		pixman_transform_rotate(transform, NULL, 0, -pixman_fixed_1);
-		pixman_transform_translate(transform, NULL, 0, fw);
-		break;
+	for (; top < bottom; top += stride, bottom -= stride) {
+		memcpy(row, top, stride);
+		memcpy(top, bottom, stride);
+		memcpy(bottom, row, stride);
 	}
-
-	pixman_transform_scale(transform, NULL,
-			       pixman_fixed_1 * output->current_scale,
-			       pixman_fixed_1 * output->current_scale);
 }
 
+/* Remember the damage of a repaint and age the buffers by one. */
 static void
-shared_output_destroy(struct shared_output *so);
+shared_output_push_damage(struct shared_output *so, pixman_region32_t *damage)
+{
+	struct ss_shm_buffer *sb;
+	int i;
+
+	for (i = SS_DAMAGE_HISTORY - 1; i > 0; i--)
+		pixman_region32_copy(&so->shm.history[i],
+				     &so->shm.history[i - 1]);
+	pixman_region32_copy(&so->shm.history[0], damage);
 
+	wl_list_for_each(sb, &so->shm.buffers, link) {
+		if (sb->age >= 0 && ++sb->age > SS_DAMAGE_HISTORY)
+			sb->age = -1;
+	}
+}
+
+/* Read what a buffer misses of the output straight into it. The buffer
+ * holds the framebuffer as is, bottom-up if the renderer reads it that
+ * way; the parent is told the transform. A parent without
+ * wl_surface.set_buffer_transform gets the bands flipped here instead.
+ * read_pixels() writes tightly packed rows, so damage is read in full
+ * width bands. On failure, the buffer is left to be read in full.
+ */
 static int
-shared_output_ensure_tmp_data(struct shared_output *so,
-			      pixman_region32_t *region)
+shared_output_read_pixels(struct shared_output *so, struct ss_shm_buffer *sb)
 {
-	pixman_box32_t *ext;
-	size_t size;
+	struct weston_output *output = so->output;
+	struct weston_renderer *renderer = output->compositor->renderer;
+	int32_t width = so->shm.width;
+	int32_t height = so->shm.height;
+	int32_t stride = width * 4;
+	pixman_region32_t missing, bands;
+	pixman_box32_t *r;
+	uint8_t *row = NULL;
+	int i, nrects, y, do_yflip;
+	int ret = -1;
 
-	if (!pixman_region32_not_empty(region))
-		return 0;
+	pixman_region32_init(&missing);
+	if (sb->age < 0) {
+		pixman_region32_init_rect(&bands, 0, 0, width, height);
+	} else {
+		for (i = 0; i < sb->age; i++)
+			pixman_region32_union(&missing, &missing,
+					      &so->shm.history[i]);
+
+		pixman_region32_init(&bands);
+		r = pixman_region32_rectangles(&missing, &nrects);
+		for (i = 0; i < nrects; i++)
+			pixman_region32_union_rect(&bands, &bands,
+						   0, r[i].y1, width,
+						   r[i].y2 - r[i].y1);
+		pixman_region32_intersect_rect(&bands, &bands,
+					       0, 0, width, height);
+	}
 
-	ext = pixman_region32_extents(region);
+	do_yflip = !!(output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
+	if (do_yflip && so->parent.compositor_version < 3) {
+		row = malloc(stride);
+		if (!row) {
+			sb->age = -1;
+			goto out;
+		}
+	}
 
-	/* Damage is in output coordinates.
-	 *
-	 * We are multiplying by 4 because the temporary data needs to be able
-	 * to store an 32 bit-per-pixel buffer.
-	 */
-	size = 4 * (ext->x2 - ext->x1) * (ext->y2 - ext->y1)
-		 * so->output->current_scale * so->output->current_scale;
+	r = pixman_region32_rectangles(&bands, &nrects);
+	for (i = 0; i < nrects; i++) {
+		y = do_yflip ? height - r[i].y2 : r[i].y1;
 
-	if (so->tmp_data != NULL && size <= so->tmp_data_size)
-		return 0;
+		if (row) {
+			renderer->read_pixels(output, PIXMAN_a8r8g8b8,
+					      (uint8_t *)sb->data + r[i].y1 * stride,
+					      0, y, width, r[i].y2 - r[i].y1);
+			flip_rows(sb->data, stride, r[i].y1, r[i].y2, row);
+			continue;
+		}
 
-	free(so->tmp_data);
-	so->tmp_data = malloc(size);
-	if (so->tmp_data == NULL) {
-		so->tmp_data_size = 0;
-		errno = ENOMEM;
-		return -1;
+		renderer->read_pixels(output, PIXMAN_a8r8g8b8,
+				      (uint8_t *)sb->data + y * stride,
+				      0, y, width, r[i].y2 - r[i].y1);
 	}
 
-	so->tmp_data_size = size;
+	free(row);
+	sb->age = 0;
+	ret = 0;
 
-	return 0;
+out:
+	pixman_region32_fini(&bands);
+	pixman_region32_fini(&missing);
+
+	return ret;
 }
 
+static void
+shared_output_destroy(struct shared_output *so);
+
 static void
 shared_output_update(struct shared_output *so);
 
@@ -627,48 +673,36 @@ static const struct wl_callback_listener shared_output_frame_listener = {
 static void
 shared_output_update(struct shared_output *so)
 {
-	struct ss_shm_buffer *sb;
+	struct ss_shm_buffer *sb = so->shm.pending;
 	pixman_box32_t *r;
 	int i, nrects;
-	pixman_transform_t transform;
+	int32_t transform;
 
 	/* Only update if we need to */
-	if (!so->cache_dirty || so->parent.frame_cb)
+	if (!sb || so->parent.frame_cb)
 		return;
 
-	sb = shared_output_get_shm_buffer(so);
-	if (sb == NULL) {
-		shared_output_destroy(so);
-		return;
-	}
-
-	output_compute_transform(so->output, &transform);
-	pixman_image_set_transform(so->cache_image, &transform);
-
-	pixman_image_set_clip_region32(sb->pm_image, &sb->damage);
+	/* Older parents get buffers the right way up, unscaled. */
+	if (so->parent.compositor_version >= 3) {
+		transform = so->output->transform;
+		if (so->output->compositor->capabilities &
+		    WESTON_CAP_CAPTURE_YFLIP)
+			transform = flip_transform_vertically(transform);
+
+		if (so->parent.buffer_transform != transform) {
+			wl_surface_set_buffer_transform(so->parent.surface,
+							transform);
+			so->parent.buffer_transform = transform;
+		}
 
-	if (so->output->current_scale == 1) {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_NEAREST, NULL, 0);
-	} else {
-		pixman_image_set_filter(so->cache_image,
-					PIXMAN_FILTER_BILINEAR, NULL, 0);
+		if (so->parent.buffer_scale != so->output->current_scale) {
+			wl_surface_set_buffer_scale(so->parent.surface,
+						    so->output->current_scale);
+			so->parent.buffer_scale = so->output->current_scale;
+		}
 	}
 
-	pixman_image_composite32(PIXMAN_OP_SRC,
-				 so->cache_image, /* src */
-				 NULL, /* mask */
-				 sb->pm_image, /* dest */
-				 0, 0, /* src_x, src_y */
-				 0, 0, /* mask_x, mask_y */
-				 0, 0, /* dest_x, dest_y */
-				 so->output->width, /* width */
-				 so->output->height /* height */);
-
-	pixman_image_set_transform(sb->pm_image, NULL);
-	pixman_image_set_clip_region32(sb->pm_image, NULL);
-
-	r = pixman_region32_rectangles(&sb->damage, &nrects);
+	r = pixman_region32_rectangles(&so->damage, &nrects);
 	for (i = 0; i < nrects; ++i)
 		wl_surface_damage(so->parent.surface, r[i].x1, r[i].y1,
 				  r[i].x2 - r[i].x1, r[i].y2 - r[i].y1);
@@ -683,9 +717,11 @@ shared_output_update(struct shared_output *so)
 	wl_callback_destroy(wl_display_sync(so->parent.display));
 	wl_display_flush(so->parent.display);
 
-	/* Clear the buffer damage */
-	pixman_region32_fini(&sb->damage);
-	pixman_region32_init(&sb->damage);
+	so->shm.pending = NULL;
+
+	/* Clear the surface damage */
+	pixman_region32_fini(&so->damage);
+	pixman_region32_init(&so->damage);
 }
 
 static void
@@ -707,9 +743,11 @@ registry_handle_global(void *data, struct wl_registry *registry,
 	struct shared_output *so = data;
 
 	if (strcmp(interface, "wl_compositor") == 0) {
+		so->parent.compositor_version = MIN(version, 3);
 		so->parent.compositor =
 			wl_registry_bind(registry,
-					 id, &wl_compositor_interface, 1);
+					 id, &wl_compositor_interface,
+					 so->parent.compositor_version);
 	} else if (strcmp(interface, "wl_output") == 0 && !so->parent.output) {
 		so->parent.output =
 			wl_registry_bind(registry,
@@ -807,10 +845,6 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 		container_of(listener, struct shared_output, frame_listener);
 	pixman_region32_t damage;
 	struct ss_shm_buffer *sb;
-	int32_t x, y, width, height, stride;
-	int i, nrects, do_yflip;
-	pixman_box32_t *r;
-	uint32_t *cache_data;
 
 	/* Damage in output coordinates */
 	pixman_region32_init(&damage);
@@ -818,9 +852,8 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 				  &so->output->previous_damage);
 	pixman_region32_translate(&damage, -so->output->x, -so->output->y);
 
-	/* Apply damage to all buffers */
-	wl_list_for_each(sb, &so->shm.buffers, link)
-		pixman_region32_union(&sb->damage, &sb->damage, &damage);
+	/* The parent surface is in output coordinates too */
+	pixman_region32_union(&so->damage, &so->damage, &damage);
 
 	/* Transform to buffer coordinates */
 	weston_transformed_region(so->output->width, so->output->height,
@@ -828,65 +861,23 @@ shared_output_repainted(struct wl_listener *listener, void *data)
 				  so->output->current_scale,
 				  &damage, &damage);
 
-	width = so->output->current_mode->width;
-	height = so->output->current_mode->height;
-	stride = width;
-
-	if (!so->cache_image ||
-	    pixman_image_get_width(so->cache_image) != width ||
-	    pixman_image_get_height(so->cache_image) != height) {
-		if (so->cache_image)
-			pixman_image_unref(so->cache_image);
-
-		so->cache_image =
-			pixman_image_create_bits(PIXMAN_a8r8g8b8,
-						 width, height, NULL,
-						 stride);
-		if (!so->cache_image) {
-			shared_output_destroy(so);
-			return;
-		}
-
+	sb = shared_output_get_shm_buffer(so);
+	if (sb == NULL) {
 		pixman_region32_fini(&damage);
-		pixman_region32_init_rect(&damage, 0, 0, width, height);
-	}
-
-	if (shared_output_ensure_tmp_data(so, &damage) < 0) {
 		shared_output_destroy(so);
 		return;
 	}
 
-	do_yflip = !!(so->output->compositor->capabilities & WESTON_CAP_CAPTURE_YFLIP);
-
-	cache_data = pixman_image_get_data(so->cache_image);
-	r = pixman_region32_rectangles(&damage, &nrects);
-	for (i = 0; i < nrects; ++i) {
-		x = r[i].x1;
-		y = r[i].y1;
-		width = r[i].x2 - r[i].x1;
-		height = r[i].y2 - r[i].y1;
-
-		if (do_yflip) {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, so->output->current_mode->height - r[i].y2,
-				width, height);
-
-			pixman_blt(so->tmp_data, cache_data, -width, stride,
-				   32, 32, 0, 1 - height, x, y, width, height);
-		} else {
-			so->output->compositor->renderer->read_pixels(
-				so->output, PIXMAN_a8r8g8b8, so->tmp_data,
-				x, y, width, height);
-
-			pixman_blt(so->tmp_data, cache_data, width, stride,
-				   32, 32, 0, 0, x, y, width, height);
-		}
-	}
-
+	shared_output_push_damage(so, &damage);
 	pixman_region32_fini(&damage);
 
-	so->cache_dirty = 1;
+	/* Keep the damage for the parent until a buffer could be read. */
+	if (shared_output_read_pixels(so, sb) < 0) {
+		so->shm.pending = NULL;
+		wl_list_insert(&so->shm.free_buffers, &sb->free_link);
+		return;
+	}
+	so->shm.pending = sb;
 
 	shared_output_update(so);
 }
@@ -898,6 +889,7 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	struct wl_event_loop *loop;
 	struct ss_seat *seat, *tmp;
 	int epoll_fd;
+	int i;
 
 	so = zalloc(sizeof *so);
 	if (so == NULL)
@@ -928,6 +920,13 @@ shared_output_create(struct weston_output *output, int parent_fd)
 		weston_log("Screen share failed: No wl_compositor found\n");
 		goto err_display;
 	}
+	if (so->parent.compositor_version < 3 &&
+	    (output->transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	     output->current_scale != 1)) {
+		weston_log("Screen share failed: wl_compositor version 3 "
+			   "needed for a transformed or scaled output\n");
+		goto err_display;
+	}
 
 	/* Get SHM formats */
 	wl_display_roundtrip(so->parent.display);
@@ -971,6 +970,11 @@ shared_output_create(struct weston_output *output, int parent_fd)
 	/* Ok, everything's created.  We should be good to go */
 	wl_list_init(&so->shm.buffers);
 	wl_list_init(&so->shm.free_buffers);
+	for (i = 0; i < SS_DAMAGE_HISTORY; i++)
+		pixman_region32_init(&so->shm.history[i]);
+	pixman_region32_init(&so->damage);
+	so->parent.buffer_transform = WL_OUTPUT_TRANSFORM_NORMAL;
+	so->parent.buffer_scale = 1;
 
 	so->output = output;
 	so->output_destroyed.notify = output_destroyed;
@@ -998,6 +1002,7 @@ static void
 shared_output_destroy(struct shared_output *so)
 {
 	struct ss_shm_buffer *buffer, *bnext;
+	int i;
 
 	so->output->disable_planes--;
 
@@ -1012,8 +1017,9 @@ shared_output_destroy(struct shared_output *so)
 	wl_list_remove(&so->output_destroyed.link);
 	wl_list_remove(&so->frame_listener.link);
 
-	pixman_image_unref(so->cache_image);
-	free(so->tmp_data);
+	for (i = 0; i < SS_DAMAGE_HISTORY; i++)
+		pixman_region32_fini(&so->shm.history[i]);
+	pixman_region32_fini(&so->damage);
 
 	free(so);
 }
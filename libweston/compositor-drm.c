@@ -56,6 +56,7 @@
 #include "pixman-renderer.h"
 #include "pixel-formats.h"
 #include "libbacklight.h"
+#include "drm-damage.h"
 #include "libinput-seat.h"
 #include "launcher-util.h"
 #include "vaapi-recorder.h"
@@ -71,6 +72,10 @@
 #define DRM_CLIENT_CAP_UNIVERSAL_PLANES 2
 #endif
 
+#ifndef DRM_CAP_CRTC_IN_VBLANK_EVENT
+#define DRM_CAP_CRTC_IN_VBLANK_EVENT 0x12
+#endif
+
 #ifndef DRM_CAP_CURSOR_WIDTH
 #define DRM_CAP_CURSOR_WIDTH 0x8
 #endif
@@ -88,6 +93,17 @@
  */
 enum wdrm_plane_property {
 	WDRM_PLANE_TYPE = 0,
+	WDRM_PLANE_SRC_X,
+	WDRM_PLANE_SRC_Y,
+	WDRM_PLANE_SRC_W,
+	WDRM_PLANE_SRC_H,
+	WDRM_PLANE_CRTC_X,
+	WDRM_PLANE_CRTC_Y,
+	WDRM_PLANE_CRTC_W,
+	WDRM_PLANE_CRTC_H,
+	WDRM_PLANE_FB_ID,
+	WDRM_PLANE_CRTC_ID,
+	WDRM_PLANE_FB_DAMAGE_CLIPS,
 	WDRM_PLANE__COUNT
 };
 
@@ -107,9 +123,19 @@ enum wdrm_plane_type {
 enum wdrm_connector_property {
 	WDRM_CONNECTOR_EDID = 0,
 	WDRM_CONNECTOR_DPMS,
+	WDRM_CONNECTOR_CRTC_ID,
 	WDRM_CONNECTOR__COUNT
 };
 
+/**
+ * List of properties attached to a DRM CRTC
+ */
+enum wdrm_crtc_property {
+	WDRM_CRTC_MODE_ID = 0,
+	WDRM_CRTC_ACTIVE,
+	WDRM_CRTC__COUNT
+};
+
 /**
  * Represents the values of an enum-type KMS property
  */
@@ -173,8 +199,11 @@ struct drm_backend {
 	void *repaint_data;
 
 	int cursors_are_broken;
+	int dirtyfb_unsupported;
 
 	bool universal_planes;
+	bool atomic_modeset;
+	bool crtc_in_vblank_event;
 
 	int use_pixman;
 
@@ -184,11 +213,18 @@ struct drm_backend {
 	int32_t cursor_height;
 
 	uint32_t pageflip_timeout;
+	uint32_t pixman_buffers;
+
+	/* Framebuffers of client buffers, reused across frames;
+	 * drm_fb::cache_link */
+	struct wl_list fb_cache_list;
+	uint32_t fb_cache_hits, fb_cache_misses;
 };
 
 struct drm_mode {
 	struct weston_mode base;
 	drmModeModeInfo mode_info;
+	uint32_t blob_id; /* for atomic modesetting, created on first use */
 };
 
 enum drm_fb_type {
@@ -216,6 +252,11 @@ struct drm_fb {
 
 	/* Used by dumb fbs */
 	void *map;
+
+	/* Used by client fbs kept for reuse while their buffer lives */
+	struct weston_buffer *cache_buffer;
+	struct wl_listener cache_buffer_destroy_listener;
+	struct wl_list cache_link; /* drm_backend::fb_cache_list */
 };
 
 struct drm_edid {
@@ -233,6 +274,100 @@ struct drm_edid {
  */
 struct drm_pending_state {
 	struct drm_backend *backend;
+
+	/* Outputs repainted but not committed yet, for atomic modesetting;
+	 * drm_output::pending_link */
+	struct wl_list output_list;
+};
+
+/**
+ * Outputs flipped by one atomic commit
+ *
+ * Their frames complete together, once every CRTC of the commit has
+ * flipped, so that the outputs keep being repainted and committed in
+ * the same cycle.
+ */
+struct drm_flip_group {
+	int pending; /**< outputs which have not flipped yet */
+	struct timespec ts; /**< latest flip of the group */
+	struct wl_list output_list; /**< drm_output::flip_group_link */
+};
+
+/* Cursor buffers per output; images shown recently are kept in them
+ * and reused without writing them again. */
+#define DRM_CURSOR_RING_SIZE 4
+
+/* Dumb buffers the pixman renderer may draw into, per output */
+#define DRM_PIXMAN_BUFFERS_DEFAULT 2
+#define DRM_PIXMAN_BUFFERS_MAX 4
+
+/* Views considered for the overlay and scanout planes of one output,
+ * and the number of kernel tests spent looking for an assignment. */
+#define DRM_PLANE_CANDIDATES_MAX 6
+#define DRM_PLANE_TESTS_MAX 8
+#define DRM_PLANE_CACHE_SIZE 4
+
+enum drm_plane_candidate_caps {
+	DRM_CANDIDATE_OVERLAY = (1 << 0),
+	DRM_CANDIDATE_SCANOUT = (1 << 1),
+};
+
+/**
+ * A view which could be taken off the primary plane
+ */
+struct drm_plane_candidate {
+	struct weston_view *view;
+	uint32_t caps; /**< enum drm_plane_candidate_caps */
+	uint32_t above_mask; /**< higher candidates overlapping this one */
+	uint64_t area; /**< output pixels covered by the view */
+};
+
+/**
+ * One way of placing candidate views onto planes
+ *
+ * Candidates in overlay_mask each get an overlay plane; the scanout
+ * candidate, if any, replaces the renderer's output on the primary plane.
+ * Every other candidate is composited by the renderer.
+ */
+struct drm_plane_assignment {
+	uint32_t overlay_mask;
+	int scanout; /**< candidate index, or -1 */
+	uint64_t saved; /**< pixels the renderer does not have to draw */
+};
+
+struct drm_plane_cache_entry;
+
+/**
+ * One candidate of a cached plane assignment
+ *
+ * The entry is dropped when the view is destroyed, so that a new view
+ * allocated at the same address cannot match it.
+ */
+struct drm_plane_cache_key {
+	struct drm_plane_cache_entry *entry;
+	struct weston_view *view;
+	struct wl_listener view_destroy_listener;
+	uint32_t generation;
+	int32_t buffer_width, buffer_height;
+	uint32_t format;
+	uint64_t modifier;
+};
+
+/**
+ * Assignment accepted by the kernel for a given set of candidates
+ *
+ * Candidates are matched by view, view geometry, and the size, format
+ * and modifier of the buffer. The entries only remember what the kernel
+ * accepted; whether the assignment still fits the stacking of the scene
+ * is checked again on every use, and the kernel is asked again before
+ * it is committed.
+ */
+struct drm_plane_cache_entry {
+	bool valid;
+	uint32_t last_used;
+	int count;
+	struct drm_plane_cache_key key[DRM_PLANE_CANDIDATES_MAX];
+	struct drm_plane_assignment assignment;
 };
 
 /**
@@ -277,7 +412,7 @@ struct drm_plane {
 
 	int32_t src_x, src_y;
 	uint32_t src_w, src_h;
-	uint32_t dest_x, dest_y;
+	int32_t dest_x, dest_y;
 	uint32_t dest_w, dest_h;
 
 	uint32_t formats[];
@@ -295,6 +430,24 @@ struct drm_output {
 
 	/* Holds the properties for the connector */
 	struct drm_property_info props_conn[WDRM_CONNECTOR__COUNT];
+	/* Holds the properties for the CRTC */
+	struct drm_property_info props_crtc[WDRM_CRTC__COUNT];
+
+	/* KMS planes driven through atomic commits; the cursor plane
+	 * may be missing, in which case the legacy cursor API is used. */
+	struct drm_plane *kms_primary_plane;
+	struct drm_plane *kms_cursor_plane;
+
+	struct wl_list pending_link; /* drm_pending_state::output_list */
+
+	/* Outputs of the same group are committed together */
+	char *group;
+	struct drm_flip_group *flip_group;
+	struct wl_list flip_group_link; /* drm_flip_group::output_list */
+
+	/* Plane assignments recently accepted by TEST_ONLY commits */
+	struct drm_plane_cache_entry plane_cache[DRM_PLANE_CACHE_SIZE];
+	uint32_t plane_cache_seq;
 
 	enum dpms_enum dpms;
 	struct backlight *backlight;
@@ -306,7 +459,9 @@ struct drm_output {
 	int destroy_pending;
 	int disable_pending;
 
-	struct drm_fb *gbm_cursor_fb[2];
+	struct drm_fb *gbm_cursor_fb[DRM_CURSOR_RING_SIZE];
+	/* Hash of the image in each cursor buffer, 0 while empty */
+	uint64_t gbm_cursor_hash[DRM_CURSOR_RING_SIZE];
 	struct weston_plane cursor_plane;
 	struct weston_view *cursor_view;
 	int current_cursor;
@@ -316,6 +471,9 @@ struct drm_output {
 
 	/* Plane for a fullscreen direct scanout view */
 	struct weston_plane scanout_plane;
+	/* Fullscreen shm view copied straight into the dumb buffers,
+	 * with the pixman renderer */
+	struct weston_view *shm_scanout_view;
 
 	/* The last framebuffer submitted to the kernel for this CRTC. */
 	struct drm_fb *fb_current;
@@ -326,10 +484,19 @@ struct drm_output {
 	 * repaint is flushed. */
 	struct drm_fb *fb_pending;
 
-	struct drm_fb *dumb[2];
-	pixman_image_t *image[2];
+	/* Swapchain of the pixman renderer; dumb_damage holds, in global
+	 * coordinates, what each buffer is missing from the latest frame */
+	struct drm_fb *dumb[DRM_PIXMAN_BUFFERS_MAX];
+	pixman_image_t *image[DRM_PIXMAN_BUFFERS_MAX];
+	pixman_region32_t dumb_damage[DRM_PIXMAN_BUFFERS_MAX];
+	int dumb_count;
 	int current_image;
-	pixman_region32_t previous_damage;
+
+	/* Area of fb_pending which differs from the frame on screen, in
+	 * framebuffer coordinates; passed on to the kernel for displays
+	 * which have to upload their updates */
+	pixman_region32_t fb_damage;
+	uint32_t fb_damage_blob_id;
 
 	struct vaapi_recorder *recorder;
 	struct wl_listener recorder_frame_listener;
@@ -597,6 +764,10 @@ drm_property_info_free(struct drm_property_info *info, int num_props)
 static void
 drm_output_set_cursor(struct drm_output *output);
 
+static void
+drm_output_update_cursor_image(struct drm_output *output,
+			       struct weston_view *ev);
+
 static void
 drm_output_update_msc(struct drm_output *output, unsigned int seq);
 
@@ -868,11 +1039,105 @@ err_free:
 static void
 drm_fb_set_buffer(struct drm_fb *fb, struct weston_buffer *buffer)
 {
-	assert(fb->buffer_ref.buffer == NULL);
 	assert(fb->type == BUFFER_CLIENT);
+
+	/* A cached framebuffer may still be on screen for the same buffer,
+	 * in which case it already holds the buffer busy. */
+	if (fb->buffer_ref.buffer == buffer)
+		return;
+
+	assert(fb->buffer_ref.buffer == NULL);
 	weston_buffer_reference(&fb->buffer_ref, buffer);
 }
 
+static void
+drm_fb_cache_remove(struct drm_fb *fb)
+{
+	wl_list_remove(&fb->cache_buffer_destroy_listener.link);
+	wl_list_remove(&fb->cache_link);
+	fb->cache_buffer = NULL;
+
+	/* Nothing displays it any more; destroying the bo destroys the fb. */
+	if (fb->refcnt == 0)
+		gbm_bo_destroy(fb->bo);
+}
+
+static void
+drm_fb_cache_handle_buffer_destroy(struct wl_listener *listener, void *data)
+{
+	struct drm_fb *fb = container_of(listener, struct drm_fb,
+					 cache_buffer_destroy_listener);
+
+	drm_fb_cache_remove(fb);
+}
+
+/**
+ * Find the framebuffer created for a client buffer in an earlier frame
+ *
+ * The framebuffer is returned without taking a reference; it may have
+ * been created with a different format than is needed now.
+ *
+ * @param buffer Client buffer to look up
+ * @returns The cached framebuffer, or NULL
+ */
+static struct drm_fb *
+drm_fb_cache_lookup(struct weston_buffer *buffer)
+{
+	struct wl_listener *listener;
+
+	listener = wl_signal_get(&buffer->destroy_signal,
+				 drm_fb_cache_handle_buffer_destroy);
+	if (!listener)
+		return NULL;
+
+	return container_of(listener, struct drm_fb,
+			    cache_buffer_destroy_listener);
+}
+
+/**
+ * Keep a client framebuffer around for as long as its buffer exists
+ *
+ * Clients cycle through a small set of buffers, so the framebuffer is
+ * likely to be needed again; keeping it saves importing the buffer and
+ * creating a KMS framebuffer every frame. Replaces any framebuffer
+ * cached for the buffer before.
+ *
+ * @param b DRM backend
+ * @param fb Framebuffer created from the buffer
+ * @param buffer Client buffer
+ */
+static void
+drm_fb_cache_add(struct drm_backend *b, struct drm_fb *fb,
+		 struct weston_buffer *buffer)
+{
+	struct drm_fb *old;
+
+	assert(fb->type == BUFFER_CLIENT);
+
+	if (fb->cache_buffer)
+		return;
+
+	old = drm_fb_cache_lookup(buffer);
+	if (old)
+		drm_fb_cache_remove(old);
+
+	fb->cache_buffer = buffer;
+	fb->cache_buffer_destroy_listener.notify =
+		drm_fb_cache_handle_buffer_destroy;
+	wl_signal_add(&buffer->destroy_signal,
+		      &fb->cache_buffer_destroy_listener);
+	wl_list_insert(&b->fb_cache_list, &fb->cache_link);
+}
+
+static void
+drm_fb_cache_flush(struct drm_backend *b)
+{
+	struct drm_fb *fb, *next;
+
+	wl_list_for_each_safe(fb, next, &b->fb_cache_list, cache_link)
+		drm_fb_cache_remove(fb);
+}
+
 static void
 drm_fb_unref(struct drm_fb *fb)
 {
@@ -883,6 +1148,13 @@ drm_fb_unref(struct drm_fb *fb)
 	if (--fb->refcnt > 0)
 		return;
 
+	/* Cached framebuffers stay alive, but must not keep the client's
+	 * buffer busy when they are not displayed. */
+	if (fb->cache_buffer) {
+		weston_buffer_reference(&fb->buffer_ref, NULL);
+		return;
+	}
+
 	switch (fb->type) {
 	case BUFFER_PIXMAN_DUMB:
 		drm_fb_destroy_dumb(fb);
@@ -926,6 +1198,7 @@ drm_pending_state_alloc(struct drm_backend *backend)
 		return NULL;
 
 	ret->backend = backend;
+	wl_list_init(&ret->output_list);
 
 	return ret;
 }
@@ -946,6 +1219,310 @@ drm_pending_state_free(struct drm_pending_state *pending_state)
 	free(pending_state);
 }
 
+/**
+ * Forget one cached plane assignment
+ *
+ * @param entry Cache entry to drop
+ */
+static void
+drm_plane_cache_entry_clear(struct drm_plane_cache_entry *entry)
+{
+	int i;
+
+	if (!entry->valid)
+		return;
+
+	for (i = 0; i < entry->count; i++)
+		wl_list_remove(&entry->key[i].view_destroy_listener.link);
+	entry->valid = false;
+}
+
+static void
+drm_plane_cache_view_destroyed(struct wl_listener *listener, void *data)
+{
+	struct drm_plane_cache_key *key =
+		container_of(listener, struct drm_plane_cache_key,
+			     view_destroy_listener);
+
+	drm_plane_cache_entry_clear(key->entry);
+}
+
+/**
+ * Forget the plane assignments the kernel accepted for an output
+ *
+ * Called when the output's state changed in a way that may invalidate
+ * earlier TEST_ONLY results.
+ *
+ * @param output Output to flush the cache of
+ */
+static void
+drm_output_plane_cache_flush(struct drm_output *output)
+{
+	int i;
+
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++)
+		drm_plane_cache_entry_clear(&output->plane_cache[i]);
+}
+
+#ifdef HAVE_DRM_ATOMIC
+static int
+plane_add_prop(drmModeAtomicReq *req, struct drm_plane *plane,
+	       enum wdrm_plane_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &plane->props[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, plane->plane_id, info->prop_id,
+				       val);
+	return (ret <= 0) ? -1 : 0;
+}
+
+static int
+crtc_add_prop(drmModeAtomicReq *req, struct drm_output *output,
+	      enum wdrm_crtc_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &output->props_crtc[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, output->crtc_id, info->prop_id,
+				       val);
+	return (ret <= 0) ? -1 : 0;
+}
+
+static int
+connector_add_prop(drmModeAtomicReq *req, struct drm_output *output,
+		   enum wdrm_connector_property prop, uint64_t val)
+{
+	struct drm_property_info *info = &output->props_conn[prop];
+	int ret;
+
+	if (info->prop_id == 0)
+		return -1;
+
+	ret = drmModeAtomicAddProperty(req, output->connector_id,
+				       info->prop_id, val);
+	return (ret <= 0) ? -1 : 0;
+}
+
+/**
+ * Add the state of one plane to an atomic request
+ *
+ * Shows the framebuffer on the output's CRTC, using the source and
+ * destination rectangles stored in the plane; a NULL framebuffer
+ * disables the plane.
+ */
+static int
+plane_add_state(drmModeAtomicReq *req, struct drm_plane *plane,
+		struct drm_output *output, struct drm_fb *fb)
+{
+	int ret = 0;
+
+	if (!fb) {
+		ret |= plane_add_prop(req, plane, WDRM_PLANE_FB_ID, 0);
+		ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_ID, 0);
+		return ret;
+	}
+
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_FB_ID, fb->fb_id);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_ID,
+			      output->crtc_id);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_SRC_X, plane->src_x);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_SRC_Y, plane->src_y);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_SRC_W, plane->src_w);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_SRC_H, plane->src_h);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_X,
+			      (int64_t) plane->dest_x);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_Y,
+			      (int64_t) plane->dest_y);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_W, plane->dest_w);
+	ret |= plane_add_prop(req, plane, WDRM_PLANE_CRTC_H, plane->dest_h);
+
+	return ret;
+}
+
+/**
+ * Tell the kernel which part of the primary plane changed
+ *
+ * Without FB_DAMAGE_CLIPS the property is left unset, which means the
+ * whole framebuffer is damaged. The blob is destroyed once the commit
+ * has been made.
+ */
+static int
+drm_output_add_fb_damage_clips(struct drm_output *output,
+			       drmModeAtomicReq *req)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *primary = output->kms_primary_plane;
+	const pixman_box32_t *rects;
+	int n_rects;
+
+	if (primary->props[WDRM_PLANE_FB_DAMAGE_CLIPS].prop_id == 0 ||
+	    output->state_invalid)
+		return 0;
+
+	rects = drm_damage_fb_clips(&output->fb_damage,
+				    output->fb_pending == output->fb_current,
+				    &n_rects);
+	if (!rects)
+		return 0;
+
+	assert(output->fb_damage_blob_id == 0);
+	if (drmModeCreatePropertyBlob(b->drm.fd, rects,
+				      sizeof(*rects) * n_rects,
+				      &output->fb_damage_blob_id) != 0)
+		return 0;
+
+	return plane_add_prop(req, primary, WDRM_PLANE_FB_DAMAGE_CLIPS,
+			      output->fb_damage_blob_id);
+}
+
+/**
+ * Add the complete state of an output to an atomic request
+ *
+ * Covers the mode if it needs to be (re)set, the primary plane showing
+ * scanout_fb, the overlay planes with their pending framebuffers, and
+ * the cursor plane showing cursor_fb.
+ *
+ * @param output Output to describe
+ * @param req Atomic request to add to
+ * @param scanout_fb Framebuffer for the primary plane
+ * @param cursor_fb Framebuffer for the cursor plane, or NULL to hide it
+ * @param flags Commit flags, updated if a modeset is required
+ * @returns 0 on success, -1 if the state cannot be expressed
+ */
+static int
+drm_output_add_atomic_state(struct drm_output *output,
+			    drmModeAtomicReq *req,
+			    struct drm_fb *scanout_fb,
+			    struct drm_fb *cursor_fb,
+			    uint32_t *flags)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *primary = output->kms_primary_plane;
+	struct drm_plane *cursor = output->kms_cursor_plane;
+	struct drm_mode *mode;
+	struct drm_plane *p;
+	int ret = 0;
+
+	mode = container_of(output->base.current_mode, struct drm_mode, base);
+
+	if (output->state_invalid) {
+		if (!mode->blob_id &&
+		    drmModeCreatePropertyBlob(b->drm.fd, &mode->mode_info,
+					      sizeof(mode->mode_info),
+					      &mode->blob_id) != 0) {
+			weston_log("atomic: failed to create mode blob: %m\n");
+			return -1;
+		}
+
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID,
+				     mode->blob_id);
+		ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 1);
+		ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID,
+					  output->crtc_id);
+		*flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+	}
+
+	/* A primary plane showing the same frame again can be left out,
+	 * provided the cursor plane keeps the CRTC in the commit. */
+	if (output->state_invalid || scanout_fb != output->fb_current ||
+	    !cursor) {
+		primary->src_x = 0;
+		primary->src_y = 0;
+		primary->src_w = scanout_fb->width << 16;
+		primary->src_h = scanout_fb->height << 16;
+		primary->dest_x = 0;
+		primary->dest_y = 0;
+		primary->dest_w = mode->mode_info.hdisplay;
+		primary->dest_h = mode->mode_info.vdisplay;
+		ret |= plane_add_state(req, primary, output, scanout_fb);
+
+		if (!(*flags & DRM_MODE_ATOMIC_TEST_ONLY) &&
+		    scanout_fb == output->fb_pending)
+			ret |= drm_output_add_fb_damage_clips(output, req);
+	}
+
+	wl_list_for_each(p, &b->plane_list, link) {
+		if (p->type != WDRM_PLANE_TYPE_OVERLAY || p->output != output)
+			continue;
+
+		if (p->fb_pending && !b->sprites_hidden)
+			ret |= plane_add_state(req, p, output, p->fb_pending);
+		else if (p->fb_pending || p->fb_current)
+			ret |= plane_add_state(req, p, output, NULL);
+	}
+
+	if (cursor) {
+		cursor->src_x = 0;
+		cursor->src_y = 0;
+		cursor->src_w = b->cursor_width << 16;
+		cursor->src_h = b->cursor_height << 16;
+		cursor->dest_x = (output->cursor_plane.x - output->base.x) *
+				 output->base.current_scale;
+		cursor->dest_y = (output->cursor_plane.y - output->base.y) *
+				 output->base.current_scale;
+		cursor->dest_w = b->cursor_width;
+		cursor->dest_h = b->cursor_height;
+		ret |= plane_add_state(req, cursor, output, cursor_fb);
+	}
+
+	return ret;
+}
+
+/**
+ * Check whether the kernel would accept the output's pending state
+ *
+ * Used while assigning views to planes: the primary plane shows the
+ * pending scanout buffer, or the last one as a stand-in for what the
+ * renderer is about to produce.
+ *
+ * @param output Output to test
+ * @returns 0 if a commit of the state would succeed, -1 otherwise
+ */
+static int
+drm_output_test_atomic(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_fb *scanout_fb, *cursor_fb = NULL;
+	uint32_t flags = DRM_MODE_ATOMIC_TEST_ONLY;
+	drmModeAtomicReq *req;
+	int ret;
+
+	scanout_fb = output->fb_pending ? output->fb_pending :
+					  output->fb_current;
+	if (!scanout_fb)
+		return -1;
+
+	if (output->cursor_view)
+		cursor_fb = output->gbm_cursor_fb[output->current_cursor];
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	ret = drm_output_add_atomic_state(output, req, scanout_fb, cursor_fb,
+					  &flags);
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, NULL);
+
+	drmModeAtomicFree(req);
+
+	return (ret == 0) ? 0 : -1;
+}
+#else
+static int
+drm_output_test_atomic(struct drm_output *output)
+{
+	return -1;
+}
+#endif
+
 static uint32_t
 drm_output_check_scanout_format(struct drm_output *output,
 				struct weston_surface *es, struct gbm_bo *bo)
@@ -976,51 +1553,82 @@ drm_output_check_scanout_format(struct drm_output *output,
 	return 0;
 }
 
-static struct weston_plane *
-drm_output_prepare_scanout_view(struct drm_output *output,
-				struct weston_view *ev)
+/**
+ * Check whether a view could be scanned out directly on the primary plane
+ *
+ * Only looks at the view itself; whether its buffer can be imported is
+ * found out by drm_output_prepare_scanout_view().
+ */
+static bool
+drm_view_is_scanout_capable(struct drm_output *output, struct weston_view *ev)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct gbm_bo *bo;
-	uint32_t format;
 
 	/* Don't import buffers which span multiple outputs. */
 	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
+		return false;
 
 	/* We use GBM to import buffers. */
 	if (b->gbm == NULL)
-		return NULL;
+		return false;
 
 	if (buffer == NULL)
-		return NULL;
+		return false;
 	if (wl_shm_buffer_get(buffer->resource))
-		return NULL;
+		return false;
 
 	/* Make sure our view is exactly compatible with the output. */
 	if (ev->geometry.x != output->base.x ||
 	    ev->geometry.y != output->base.y)
-		return NULL;
+		return false;
 	if (buffer->width != output->base.current_mode->width ||
 	    buffer->height != output->base.current_mode->height)
-		return NULL;
+		return false;
 
 	if (ev->transform.enabled)
-		return NULL;
+		return false;
 	if (ev->geometry.scissor_enabled)
-		return NULL;
+		return false;
 	if (viewport->buffer.transform != output->base.transform)
-		return NULL;
+		return false;
 	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
+		return false;
 	if (!drm_view_transform_supported(ev))
-		return NULL;
+		return false;
 
 	if (ev->alpha != 1.0f)
+		return false;
+
+	return true;
+}
+
+static struct weston_plane *
+drm_output_prepare_scanout_view(struct drm_output *output,
+				struct weston_view *ev)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct drm_fb *fb;
+	struct gbm_bo *bo;
+	uint32_t format;
+
+	if (!drm_view_is_scanout_capable(output, ev))
 		return NULL;
 
+	fb = drm_fb_cache_lookup(buffer);
+	if (fb && drm_output_check_scanout_format(output, ev->surface,
+						  fb->bo) ==
+		  fb->format->format) {
+		b->fb_cache_hits++;
+		output->fb_pending = drm_fb_ref(fb);
+		drm_fb_set_buffer(output->fb_pending, buffer);
+		return &output->scanout_plane;
+	}
+
+	b->fb_cache_misses++;
+
 	bo = gbm_bo_import(b->gbm, GBM_BO_IMPORT_WL_BUFFER,
 			   buffer->resource, GBM_BO_USE_SCANOUT);
 
@@ -1040,6 +1648,7 @@ drm_output_prepare_scanout_view(struct drm_output *output,
 		return NULL;
 	}
 
+	drm_fb_cache_add(b, output->fb_pending, buffer);
 	drm_fb_set_buffer(output->fb_pending, buffer);
 
 	return &output->scanout_plane;
@@ -1072,31 +1681,186 @@ drm_output_render_gl(struct drm_output *output, pixman_region32_t *damage)
 	return ret;
 }
 
+/**
+ * Pick the dumb buffer to draw the next frame into
+ *
+ * Buffers are used in turn, skipping those still held for scanout.
+ * The frame's damage is added to what every buffer is missing, and the
+ * picked buffer's share is handed over to be redrawn.
+ *
+ * @param output Output being repainted
+ * @param damage Damage of the new frame, in global coordinates
+ * @param total_damage Set to the area to redraw, in global coordinates
+ * @returns Index of the buffer, or -1 if all of them are busy
+ */
+static int
+drm_output_get_pixman_buffer(struct drm_output *output,
+			     pixman_region32_t *damage,
+			     pixman_region32_t *total_damage)
+{
+	int i, n;
+
+	for (n = 1; n <= output->dumb_count; n++) {
+		i = (output->current_image + n) % output->dumb_count;
+
+		/* Only our own reference left: not being scanned out. */
+		if (output->dumb[i]->refcnt == 1)
+			break;
+	}
+	if (n > output->dumb_count) {
+		weston_log("no free pixman buffer on output %s\n",
+			   output->base.name);
+		return -1;
+	}
+
+	for (n = 0; n < output->dumb_count; n++)
+		pixman_region32_union(&output->dumb_damage[n],
+				      &output->dumb_damage[n], damage);
+
+	pixman_region32_copy(total_damage, &output->dumb_damage[i]);
+	pixman_region32_clear(&output->dumb_damage[i]);
+	output->current_image = i;
+
+	return i;
+}
+
 static struct drm_fb *
 drm_output_render_pixman(struct drm_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *ec = output->base.compositor;
-	pixman_region32_t total_damage, previous_damage;
+	pixman_region32_t total_damage;
+	int i;
 
 	pixman_region32_init(&total_damage);
-	pixman_region32_init(&previous_damage);
 
-	pixman_region32_copy(&previous_damage, damage);
+	i = drm_output_get_pixman_buffer(output, damage, &total_damage);
+	if (i < 0) {
+		pixman_region32_fini(&total_damage);
+		return NULL;
+	}
+
+	pixman_renderer_output_set_buffer(&output->base, output->image[i]);
 
-	pixman_region32_union(&total_damage, damage, &output->previous_damage);
-	pixman_region32_copy(&output->previous_damage, &previous_damage);
+	ec->renderer->repaint_output(&output->base, &total_damage);
 
-	output->current_image ^= 1;
+	pixman_region32_fini(&total_damage);
 
-	pixman_renderer_output_set_buffer(&output->base,
-					  output->image[output->current_image]);
+	return drm_fb_ref(output->dumb[i]);
+}
 
-	ec->renderer->repaint_output(&output->base, &total_damage);
+/**
+ * Record the damage of the frame about to be shown
+ *
+ * @param output Output being repainted
+ * @param damage Changed area, in global coordinates
+ */
+static void
+drm_output_set_fb_damage(struct drm_output *output, pixman_region32_t *damage)
+{
+	struct weston_output *base = &output->base;
+
+	pixman_region32_intersect(&output->fb_damage, damage, &base->region);
+	pixman_region32_translate(&output->fb_damage, -base->x, -base->y);
+	weston_transformed_region(base->width, base->height,
+				  base->transform, base->current_scale,
+				  &output->fb_damage, &output->fb_damage);
+}
+
+/**
+ * Add damaged area to the frame about to be shown
+ *
+ * @param output Output being repainted
+ * @param damage Changed area, in global coordinates
+ */
+static void
+drm_output_add_fb_damage(struct drm_output *output, pixman_region32_t *damage)
+{
+	pixman_region32_t fb_damage;
+
+	pixman_region32_init(&fb_damage);
+	pixman_region32_copy(&fb_damage, &output->fb_damage);
+	drm_output_set_fb_damage(output, damage);
+	pixman_region32_union(&output->fb_damage, &output->fb_damage,
+			      &fb_damage);
+	pixman_region32_fini(&fb_damage);
+}
+
+static pixman_format_code_t
+drm_shm_format_to_pixman(uint32_t shm_format)
+{
+	switch (shm_format) {
+	case WL_SHM_FORMAT_XRGB8888:
+		return PIXMAN_x8r8g8b8;
+	case WL_SHM_FORMAT_ARGB8888:
+		return PIXMAN_a8r8g8b8;
+	case WL_SHM_FORMAT_RGB565:
+		return PIXMAN_r5g6b5;
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Copy the damage of a fullscreen shm view into the next dumb buffer
+ *
+ * Takes the place of composition for the view assigned by
+ * drm_assign_planes_pixman(): only the rectangles the client damaged,
+ * plus those the buffer is missing from earlier frames, are copied, and
+ * the renderer and its shadow image are left alone.
+ */
+static struct drm_fb *
+drm_output_render_shm_scanout(struct drm_output *output)
+{
+	struct weston_view *ev = output->shm_scanout_view;
+	struct wl_shm_buffer *shm_buffer =
+		ev->surface->buffer_ref.buffer->shm_buffer;
+	pixman_image_t *src;
+	pixman_region32_t damage, total_damage;
+	pixman_box32_t *rects;
+	int n_rects, i, buf;
+
+	pixman_region32_init(&damage);
+	pixman_region32_intersect(&damage, &output->scanout_plane.damage,
+				  &output->base.region);
+	pixman_region32_subtract(&output->scanout_plane.damage,
+				 &output->scanout_plane.damage, &damage);
+	drm_output_add_fb_damage(output, &damage);
+
+	pixman_region32_init(&total_damage);
+	buf = drm_output_get_pixman_buffer(output, &damage, &total_damage);
+	pixman_region32_fini(&damage);
+	if (buf < 0) {
+		pixman_region32_fini(&total_damage);
+		return NULL;
+	}
+	pixman_region32_translate(&total_damage,
+				  -output->base.x, -output->base.y);
+
+	src = pixman_image_create_bits(
+		drm_shm_format_to_pixman(wl_shm_buffer_get_format(shm_buffer)),
+		wl_shm_buffer_get_width(shm_buffer),
+		wl_shm_buffer_get_height(shm_buffer),
+		wl_shm_buffer_get_data(shm_buffer),
+		wl_shm_buffer_get_stride(shm_buffer));
+
+	if (src) {
+		wl_shm_buffer_begin_access(shm_buffer);
+		rects = pixman_region32_rectangles(&total_damage, &n_rects);
+		for (i = 0; i < n_rects; i++)
+			pixman_image_composite32(PIXMAN_OP_SRC, src, NULL,
+						 output->image[buf],
+						 rects[i].x1, rects[i].y1,
+						 0, 0,
+						 rects[i].x1, rects[i].y1,
+						 rects[i].x2 - rects[i].x1,
+						 rects[i].y2 - rects[i].y1);
+		wl_shm_buffer_end_access(shm_buffer);
+		pixman_image_unref(src);
+	}
 
 	pixman_region32_fini(&total_damage);
-	pixman_region32_fini(&previous_damage);
 
-	return drm_fb_ref(output->dumb[output->current_image]);
+	return drm_fb_ref(output->dumb[buf]);
 }
 
 static void
@@ -1107,11 +1871,21 @@ drm_output_render(struct drm_output *output, pixman_region32_t *damage)
 	struct drm_fb *fb;
 
 	/* If we already have a client buffer promoted to scanout, then we don't
-	 * want to render. */
-	if (output->fb_pending)
+	 * want to render. A different buffer may differ anywhere. */
+	if (output->fb_pending) {
+		if (output->fb_pending == output->fb_current)
+			pixman_region32_clear(&output->fb_damage);
+		else
+			drm_output_set_fb_damage(output,
+						 &output->base.region);
 		return;
+	}
 
-	if (b->use_pixman)
+	drm_output_set_fb_damage(output, damage);
+
+	if (output->shm_scanout_view)
+		fb = drm_output_render_shm_scanout(output);
+	else if (b->use_pixman)
 		fb = drm_output_render_pixman(output, damage);
 	else
 		fb = drm_output_render_gl(output, damage);
@@ -1171,6 +1945,283 @@ drm_waitvblank_pipe(struct drm_output *output)
 		return 0;
 }
 
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * Add the repainted state of an output to an atomic commit
+ *
+ * Updates the cursor image if it changed, then adds the pending
+ * framebuffers, overlays and cursor.
+ */
+static int
+drm_output_add_commit_state(struct drm_output *output, drmModeAtomicReq *req,
+			    uint32_t *flags)
+{
+	struct drm_fb *cursor_fb = NULL;
+	struct weston_view *ev = output->cursor_view;
+
+	if (output->kms_cursor_plane && ev) {
+		if (pixman_region32_not_empty(&output->cursor_plane.damage)) {
+			pixman_region32_fini(&output->cursor_plane.damage);
+			pixman_region32_init(&output->cursor_plane.damage);
+			drm_output_update_cursor_image(output, ev);
+		}
+		cursor_fb = output->gbm_cursor_fb[output->current_cursor];
+	}
+
+	return drm_output_add_atomic_state(output, req, output->fb_pending,
+					   cursor_fb, flags);
+}
+
+/**
+ * Account for an atomic commit the kernel accepted for an output
+ */
+static void
+drm_output_commit_done(struct drm_output *output, uint32_t flags)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *p;
+
+	if (flags & DRM_MODE_ATOMIC_ALLOW_MODESET)
+		output->dpms = WESTON_DPMS_ON;
+	output->state_invalid = false;
+
+	output->fb_last = output->fb_current;
+	output->fb_current = output->fb_pending;
+	output->fb_pending = NULL;
+
+	wl_list_for_each(p, &b->plane_list, link) {
+		if (p->type != WDRM_PLANE_TYPE_OVERLAY || p->output != output)
+			continue;
+
+		assert(!p->fb_last);
+		p->fb_last = p->fb_current;
+		p->fb_current = p->fb_pending;
+		p->fb_pending = NULL;
+	}
+
+	if (!output->kms_cursor_plane)
+		drm_output_set_cursor(output);
+
+	assert(!output->page_flip_pending);
+	output->page_flip_pending = 1;
+
+	if (output->pageflip_timer)
+		wl_event_source_timer_update(output->pageflip_timer,
+		                             b->pageflip_timeout);
+}
+
+/**
+ * Commit the pending state of a set of outputs
+ *
+ * Shows the outputs' pending framebuffers, overlays and cursors in a
+ * single non-blocking atomic commit. Completion is reported for each
+ * CRTC through page_flip_handler(), like a legacy page flip; when the
+ * commit covers more than one output, their frames are completed
+ * together through a drm_flip_group.
+ *
+ * @param b DRM backend
+ * @param outputs Outputs with a pending scanout framebuffer, linked
+ * through drm_output::pending_link
+ * @returns 0 on success, -1 if the kernel rejected the commit
+ */
+static int
+drm_outputs_apply_atomic(struct drm_backend *b, struct wl_list *outputs)
+{
+	uint32_t flags = DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT;
+	struct drm_flip_group *group = NULL;
+	struct drm_output *output, *first;
+	drmModeAtomicReq *req;
+	int count = 0;
+	int ret = 0;
+
+	first = container_of(outputs->next, struct drm_output, pending_link);
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	wl_list_for_each(output, outputs, pending_link) {
+		ret |= drm_output_add_commit_state(output, req, &flags);
+		count++;
+	}
+
+	if (count > 1) {
+		group = zalloc(sizeof *group);
+		if (!group)
+			ret = -1;
+	}
+
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req, flags, first);
+	if (ret != 0)
+		weston_log("atomic: couldn't commit new state for %s%s: %m\n",
+			   first->base.name, (count > 1) ? " and its group" : "");
+
+	drmModeAtomicFree(req);
+
+	wl_list_for_each(output, outputs, pending_link) {
+		if (output->fb_damage_blob_id == 0)
+			continue;
+		drmModeDestroyPropertyBlob(b->drm.fd,
+					   output->fb_damage_blob_id);
+		output->fb_damage_blob_id = 0;
+	}
+
+	if (ret != 0) {
+		wl_list_for_each(output, outputs, pending_link)
+			drm_output_plane_cache_flush(output);
+		free(group);
+		return -1;
+	}
+
+	if (group)
+		wl_list_init(&group->output_list);
+
+	wl_list_for_each(output, outputs, pending_link) {
+		drm_output_commit_done(output, flags);
+
+		if (group) {
+			group->pending++;
+			output->flip_group = group;
+			wl_list_insert(group->output_list.prev,
+				       &output->flip_group_link);
+		}
+	}
+
+	return 0;
+}
+
+static int
+drm_output_apply_atomic(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct wl_list outputs;
+	int ret;
+
+	wl_list_init(&outputs);
+	wl_list_insert(&outputs, &output->pending_link);
+	ret = drm_outputs_apply_atomic(b, &outputs);
+	wl_list_remove(&output->pending_link);
+
+	return ret;
+}
+#endif
+
+/**
+ * Release the pending framebuffers of an output and its overlay planes
+ *
+ * @param output Output to release the framebuffers of
+ */
+static void
+drm_output_release_pending(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *p;
+
+	drm_fb_unref(output->fb_pending);
+	output->fb_pending = NULL;
+
+	wl_list_for_each(p, &b->plane_list, link) {
+		if (p->type != WDRM_PLANE_TYPE_OVERLAY || p->output != output)
+			continue;
+
+		drm_fb_unref(p->fb_pending);
+		p->fb_pending = NULL;
+	}
+}
+
+/**
+ * Drop the state of an output repaint which will not be committed
+ *
+ * Releases the pending framebuffers and finishes the frame straight
+ * away, so the repaint loop carries on. The damage rendered into the
+ * dropped frame is lost, so the whole output is repainted next.
+ *
+ * @param output Output that was repainted
+ */
+static void
+drm_output_discard_pending(struct drm_output *output)
+{
+	drm_output_release_pending(output);
+	weston_output_damage(&output->base);
+
+	weston_output_finish_frame(&output->base, NULL,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
+}
+
+static bool
+drm_region_overlaps(pixman_region32_t *a, pixman_region32_t *b)
+{
+	pixman_region32_t r;
+	bool ret;
+
+	pixman_region32_init(&r);
+	pixman_region32_intersect(&r, a, b);
+	ret = pixman_region32_not_empty(&r);
+	pixman_region32_fini(&r);
+
+	return ret;
+}
+
+/**
+ * Check whether the last rendered frame can be scanned out again
+ *
+ * Needs a frame from the renderer, rather than a client buffer, and an
+ * output which does not need a modeset.
+ */
+static bool
+drm_output_can_reuse_fb(struct drm_output *output)
+{
+	if (!output->fb_current || output->state_invalid)
+		return false;
+
+	if (output->fb_current->type != BUFFER_GBM_SURFACE &&
+	    output->fb_current->type != BUFFER_PIXMAN_DUMB)
+		return false;
+
+	/* Screenshots and recorders disable planes and wait for the
+	 * renderer to signal a frame, even without damage. */
+	if (output->base.disable_planes)
+		return false;
+
+	/* A fullscreen shm view is updated outside of the primary plane. */
+	if (output->shm_scanout_view &&
+	    drm_region_overlaps(&output->scanout_plane.damage,
+				&output->base.region))
+		return false;
+
+	return true;
+}
+
+/**
+ * Tell the kernel which part of the newly shown framebuffer changed
+ *
+ * For the legacy API: drivers of displays which need their updates
+ * uploaded, such as USB ones, implement DIRTYFB and would otherwise
+ * only see a flip. The rest fail it with ENOSYS, after which it is not
+ * tried again. A reused frame has no damage, and so is not flushed.
+ */
+static void
+drm_output_dirty_fb(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	drmModeClip *clips;
+	int n_clips;
+
+	if (b->dirtyfb_unsupported)
+		return;
+
+	clips = drm_damage_dirty_clips(&output->fb_damage, &n_clips);
+	if (!clips)
+		return;
+
+	if (drmModeDirtyFB(b->drm.fd, output->fb_current->fb_id,
+			   clips, n_clips) == -ENOSYS)
+		b->dirtyfb_unsupported = 1;
+
+	free(clips);
+}
+
 static int
 drm_output_repaint(struct weston_output *output_base,
 		   pixman_region32_t *damage,
@@ -1196,12 +2247,38 @@ drm_output_repaint(struct weston_output *output_base,
 		output->cursor_view = NULL;
 		output->cursor_plane.x = INT32_MIN;
 		output->cursor_plane.y = INT32_MIN;
+		output->shm_scanout_view = NULL;
 	}
 
+	/* When nothing on the primary plane changed, as when only the
+	 * pointer moved, the last frame is shown again instead of
+	 * rendering an identical one. */
+	if (!output->fb_pending && !pixman_region32_not_empty(damage) &&
+	    drm_output_can_reuse_fb(output))
+		output->fb_pending = drm_fb_ref(output->fb_current);
+
 	drm_output_render(output, damage);
 	if (!output->fb_pending)
 		return -1;
 
+#ifdef HAVE_DRM_ATOMIC
+	if (backend->atomic_modeset) {
+		struct drm_pending_state *pending_state = repaint_data;
+
+		/* Committed by drm_repaint_flush(). */
+		if (pending_state) {
+			wl_list_insert(pending_state->output_list.prev,
+				       &output->pending_link);
+			return 0;
+		}
+
+		if (drm_output_apply_atomic(output) < 0)
+			goto err_pageflip;
+
+		return 0;
+	}
+#endif
+
 	mode = container_of(output->base.current_mode, struct drm_mode, base);
 	if (output->state_invalid || !output->fb_current ||
 	    output->fb_current->stride != output->fb_pending->stride) {
@@ -1229,6 +2306,8 @@ drm_output_repaint(struct weston_output *output_base,
 	output->fb_current = output->fb_pending;
 	output->fb_pending = NULL;
 
+	drm_output_dirty_fb(output);
+
 	assert(!output->page_flip_pending);
 	output->page_flip_pending = 1;
 
@@ -1430,42 +2509,143 @@ static void
 drm_output_destroy(struct weston_output *base);
 
 static void
-page_flip_handler(int fd, unsigned int frame,
-		  unsigned int sec, unsigned int usec, void *data)
+drm_output_finish_flip(struct drm_output *output, const struct timespec *ts)
 {
-	struct drm_output *output = data;
-	struct timespec ts;
 	uint32_t flags = WP_PRESENTATION_FEEDBACK_KIND_VSYNC |
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_COMPLETION |
 			 WP_PRESENTATION_FEEDBACK_KIND_HW_CLOCK;
 
-	drm_output_update_msc(output, frame);
-
-	assert(output->page_flip_pending);
-	output->page_flip_pending = 0;
+	weston_output_finish_frame(&output->base, ts, flags);
+
+	/* We can't call this from frame_notify, because the output's
+	 * repaint needed flag is cleared just after that */
+	if (output->recorder)
+		weston_output_schedule_repaint(&output->base);
+}
+
+/**
+ * Record the flip of one output of a flip group
+ *
+ * Once every output of the group has flipped, or gone away, all their
+ * frames are finished with the latest flip time of the group. This
+ * makes their next repaints fall into the same cycle, so they are
+ * committed together again.
+ *
+ * @param output Output which flipped
+ * @param ts Time of the flip, or NULL if the output is going away and
+ * leaves the group without finishing its frame
+ */
+static void
+drm_output_flip_group_done(struct drm_output *output,
+			   const struct timespec *ts)
+{
+	struct drm_flip_group *group = output->flip_group;
+	struct drm_output *o, *tmp;
+
+	if (!group)
+		return;
+
+	if (ts && timespec_sub_to_nsec(ts, &group->ts) > 0)
+		group->ts = *ts;
+
+	if (!ts) {
+		wl_list_remove(&output->flip_group_link);
+		output->flip_group = NULL;
+	}
+
+	if (--group->pending > 0)
+		return;
+
+	wl_list_for_each_safe(o, tmp, &group->output_list, flip_group_link) {
+		wl_list_remove(&o->flip_group_link);
+		o->flip_group = NULL;
+		drm_output_finish_flip(o, &group->ts);
+	}
+
+	free(group);
+}
+
+/**
+ * Take an output which has already flipped out of its flip group
+ */
+static void
+drm_output_flip_group_leave(struct drm_output *output)
+{
+	if (!output->flip_group)
+		return;
+
+	wl_list_remove(&output->flip_group_link);
+	output->flip_group = NULL;
+}
+
+static void
+page_flip_handler(int fd, unsigned int frame,
+		  unsigned int sec, unsigned int usec, void *data)
+{
+	struct drm_output *output = data;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *p;
+	struct timespec ts;
+
+	drm_output_update_msc(output, frame);
+
+	assert(output->page_flip_pending);
+	output->page_flip_pending = 0;
 
 	drm_fb_unref(output->fb_last);
 	output->fb_last = NULL;
 
-	if (output->destroy_pending)
+	/* Atomic commits replace the overlays along with the primary
+	 * plane, so there are no separate vblank events for them. */
+	if (b->atomic_modeset) {
+		wl_list_for_each(p, &b->plane_list, link) {
+			if (p->output != output)
+				continue;
+
+			drm_fb_unref(p->fb_last);
+			p->fb_last = NULL;
+		}
+	}
+
+	if (output->destroy_pending) {
+		drm_output_flip_group_done(output, NULL);
 		drm_output_destroy(&output->base);
-	else if (output->disable_pending)
+	} else if (output->disable_pending) {
+		drm_output_flip_group_done(output, NULL);
 		weston_output_disable(&output->base);
-	else if (!output->vblank_pending) {
+	} else if (!output->vblank_pending) {
 		/* Stop the pageflip timer instead of rearming it here */
 		if (output->pageflip_timer)
 			wl_event_source_timer_update(output->pageflip_timer, 0);
 
 		ts.tv_sec = sec;
 		ts.tv_nsec = usec * 1000;
-		weston_output_finish_frame(&output->base, &ts, flags);
+		if (output->flip_group)
+			drm_output_flip_group_done(output, &ts);
+		else
+			drm_output_finish_flip(output, &ts);
+	}
+}
 
-		/* We can't call this from frame_notify, because the output's
-		 * repaint needed flag is cleared just after that */
-		if (output->recorder)
-			weston_output_schedule_repaint(&output->base);
+#ifdef HAVE_DRM_ATOMIC
+static void
+page_flip_handler2(int fd, unsigned int frame,
+		   unsigned int sec, unsigned int usec,
+		   unsigned int crtc_id, void *data)
+{
+	struct drm_output *output = data;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+
+	/* A commit spanning several CRTCs sends one event for each, all
+	 * with the user data of the commit. */
+	if (crtc_id != 0) {
+		output = drm_output_find_by_crtc(b, crtc_id);
+		assert(output);
 	}
+
+	page_flip_handler(fd, frame, sec, usec, output);
 }
+#endif
 
 /**
  * Begin a new repaint cycle
@@ -1495,6 +2675,55 @@ drm_repaint_flush(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct drm_output *output, *tmp;
+#ifdef HAVE_DRM_ATOMIC
+	struct drm_output *first;
+	struct wl_list commit;
+#endif
+
+	if (!pending_state)
+		return;
+
+#ifdef HAVE_DRM_ATOMIC
+	/* Commit each output together with the other outputs of its
+	 * group which were repainted in this cycle. */
+	while (!wl_list_empty(&pending_state->output_list)) {
+		first = container_of(pending_state->output_list.next,
+				     struct drm_output, pending_link);
+		wl_list_init(&commit);
+
+		wl_list_for_each_safe(output, tmp, &pending_state->output_list,
+				      pending_link) {
+			if (output != first &&
+			    (!first->group || !output->group ||
+			     strcmp(first->group, output->group) != 0))
+				continue;
+
+			wl_list_remove(&output->pending_link);
+			wl_list_insert(commit.prev, &output->pending_link);
+		}
+
+		if (drm_outputs_apply_atomic(b, &commit) == 0) {
+			wl_list_for_each_safe(output, tmp, &commit,
+					      pending_link)
+				wl_list_remove(&output->pending_link);
+			continue;
+		}
+
+		/* Outputs whose commit fails still have to complete their
+		 * frame, or their repaint loop would stall. */
+		wl_list_for_each_safe(output, tmp, &commit, pending_link) {
+			wl_list_remove(&output->pending_link);
+			drm_output_discard_pending(output);
+		}
+	}
+#else
+	wl_list_for_each_safe(output, tmp, &pending_state->output_list,
+			      pending_link) {
+		wl_list_remove(&output->pending_link);
+		drm_output_discard_pending(output);
+	}
+#endif
 
 	drm_pending_state_free(pending_state);
 	b->repaint_data = NULL;
@@ -1511,6 +2740,16 @@ drm_repaint_cancel(struct weston_compositor *compositor, void *repaint_data)
 {
 	struct drm_backend *b = to_drm_backend(compositor);
 	struct drm_pending_state *pending_state = repaint_data;
+	struct drm_output *output, *tmp;
+
+	if (!pending_state)
+		return;
+
+	wl_list_for_each_safe(output, tmp, &pending_state->output_list,
+			      pending_link) {
+		wl_list_remove(&output->pending_link);
+		drm_output_discard_pending(output);
+	}
 
 	drm_pending_state_free(pending_state);
 	b->repaint_data = NULL;
@@ -1545,66 +2784,90 @@ drm_output_check_plane_format(struct drm_plane *p,
 	return 0;
 }
 
-static struct weston_plane *
-drm_output_prepare_overlay_view(struct drm_output *output,
-				struct weston_view *ev)
+/**
+ * Check whether a view could be shown on an overlay plane
+ *
+ * Only looks at the view itself; whether its buffer can be imported is
+ * found out by drm_output_prepare_overlay_view().
+ */
+static bool
+drm_view_is_overlay_capable(struct drm_output *output, struct weston_view *ev)
 {
-	struct weston_compositor *ec = output->base.compositor;
-	struct drm_backend *b = to_drm_backend(ec);
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
 	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct wl_resource *buffer_resource;
-	struct drm_plane *p;
-	struct linux_dmabuf_buffer *dmabuf;
-	int found = 0;
-	struct gbm_bo *bo;
-	pixman_region32_t dest_rect, src_rect;
-	pixman_box32_t *box, tbox;
-	uint32_t format;
-	wl_fixed_t sx1, sy1, sx2, sy2;
 
 	if (b->sprites_are_broken)
-		return NULL;
+		return false;
 
 	/* Don't import buffers which span multiple outputs. */
 	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
+		return false;
 
 	/* We can only import GBM buffers. */
 	if (b->gbm == NULL)
-		return NULL;
+		return false;
 
 	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-	buffer_resource = ev->surface->buffer_ref.buffer->resource;
-	if (wl_shm_buffer_get(buffer_resource))
-		return NULL;
+		return false;
+	if (wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource))
+		return false;
 
 	if (viewport->buffer.transform != output->base.transform)
-		return NULL;
+		return false;
 	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
+		return false;
 	if (!drm_view_transform_supported(ev))
-		return NULL;
+		return false;
 
 	if (ev->alpha != 1.0f)
-		return NULL;
+		return false;
 
-	wl_list_for_each(p, &b->plane_list, link) {
-		if (p->type != WDRM_PLANE_TYPE_OVERLAY)
-			continue;
+	return true;
+}
 
-		if (!drm_plane_crtc_supported(output, p))
-			continue;
+/**
+ * Check whether an overlay plane could be used by an output
+ *
+ * Disregards any framebuffer already pending on the plane.
+ */
+static bool
+drm_plane_is_available(struct drm_output *output, struct drm_plane *p)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
 
-		if (!p->fb_pending) {
-			found = 1;
-			break;
-		}
-	}
+	if (p->type != WDRM_PLANE_TYPE_OVERLAY)
+		return false;
 
-	/* No sprites available */
-	if (!found)
-		return NULL;
+	if (!drm_plane_crtc_supported(output, p))
+		return false;
+
+	/* With atomic commits, a plane stays with its output until
+	 * that output has turned it off. */
+	if (b->atomic_modeset && p->output && p->output != output &&
+	    (p->fb_current || p->fb_last))
+		return false;
+
+	return true;
+}
+
+/**
+ * Import a client buffer as a framebuffer for an overlay plane
+ *
+ * @param b DRM backend
+ * @param p Plane the framebuffer is for, which decides its format
+ * @param ev View showing the buffer
+ * @returns A new framebuffer, or NULL if the buffer cannot be used
+ */
+static struct drm_fb *
+drm_fb_import_for_plane(struct drm_backend *b, struct drm_plane *p,
+			struct weston_view *ev)
+{
+	struct wl_resource *buffer_resource =
+		ev->surface->buffer_ref.buffer->resource;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct drm_fb *fb;
+	struct gbm_bo *bo;
+	uint32_t format;
 
 	if ((dmabuf = linux_dmabuf_buffer_get(buffer_resource))) {
 #ifdef HAVE_GBM_FD_IMPORT
@@ -1655,13 +2918,62 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 		return NULL;
 	}
 
-	p->fb_pending = drm_fb_get_from_bo(bo, b, format, BUFFER_CLIENT);
-	if (!p->fb_pending) {
+	fb = drm_fb_get_from_bo(bo, b, format, BUFFER_CLIENT);
+	if (!fb) {
 		gbm_bo_destroy(bo);
 		return NULL;
 	}
 
-	drm_fb_set_buffer(p->fb_pending, ev->surface->buffer_ref.buffer);
+	return fb;
+}
+
+static struct weston_plane *
+drm_output_prepare_overlay_view(struct drm_output *output,
+				struct weston_view *ev)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	struct drm_backend *b = to_drm_backend(ec);
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct weston_buffer *buffer;
+	struct drm_plane *p;
+	struct drm_fb *fb;
+	int found = 0;
+	pixman_region32_t dest_rect, src_rect;
+	pixman_box32_t *box, tbox;
+	wl_fixed_t sx1, sy1, sx2, sy2;
+
+	if (!drm_view_is_overlay_capable(output, ev))
+		return NULL;
+
+	wl_list_for_each(p, &b->plane_list, link) {
+		if (!drm_plane_is_available(output, p))
+			continue;
+
+		if (!p->fb_pending) {
+			found = 1;
+			break;
+		}
+	}
+
+	/* No sprites available */
+	if (!found)
+		return NULL;
+
+	buffer = ev->surface->buffer_ref.buffer;
+	fb = drm_fb_cache_lookup(buffer);
+	if (fb && drm_output_check_plane_format(p, ev, fb->bo) ==
+		  fb->format->format) {
+		b->fb_cache_hits++;
+		p->fb_pending = drm_fb_ref(fb);
+	} else {
+		b->fb_cache_misses++;
+		p->fb_pending = drm_fb_import_for_plane(b, p, ev);
+		if (!p->fb_pending)
+			return NULL;
+		drm_fb_cache_add(b, p->fb_pending, buffer);
+	}
+
+	drm_fb_set_buffer(p->fb_pending, buffer);
 
 	box = pixman_region32_extents(&ev->transform.boundingbox);
 	p->base.x = box->x1;
@@ -1728,6 +3040,9 @@ drm_output_prepare_overlay_view(struct drm_output *output,
 	p->src_h = (tbox.y2 - tbox.y1) << 8;
 	pixman_region32_fini(&src_rect);
 
+	if (b->atomic_modeset)
+		p->output = output;
+
 	return &p->base;
 }
 
@@ -1736,128 +3051,767 @@ drm_output_prepare_cursor_view(struct drm_output *output,
 			       struct weston_view *ev)
 {
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
-	struct wl_shm_buffer *shmbuf;
-	float x, y;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	struct wl_shm_buffer *shmbuf;
+	float x, y;
+
+	if (b->cursors_are_broken)
+		return NULL;
+
+	if (output->cursor_view)
+		return NULL;
+
+	/* Don't import buffers which span multiple outputs. */
+	if (ev->output_mask != (1u << output->base.id))
+		return NULL;
+
+	/* We use GBM to import SHM buffers. */
+	if (b->gbm == NULL)
+		return NULL;
+
+	if (ev->surface->buffer_ref.buffer == NULL)
+		return NULL;
+	shmbuf = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
+	if (!shmbuf)
+		return NULL;
+	if (wl_shm_buffer_get_format(shmbuf) != WL_SHM_FORMAT_ARGB8888)
+		return NULL;
+
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return NULL;
+	if (ev->transform.enabled &&
+	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
+		return NULL;
+	if (viewport->buffer.scale != output->base.current_scale)
+		return NULL;
+	if (ev->geometry.scissor_enabled)
+		return NULL;
+
+	if (ev->surface->width > b->cursor_width ||
+	    ev->surface->height > b->cursor_height)
+		return NULL;
+
+	output->cursor_view = ev;
+	weston_view_to_global_float(ev, 0, 0, &x, &y);
+	output->cursor_plane.x = x;
+	output->cursor_plane.y = y;
+
+	return &output->cursor_plane;
+}
+
+/**
+ * Update the image for the current cursor surface
+ *
+ * @param b DRM backend structure
+ * @param bo GBM buffer object to write into
+ * @param ev View to use for cursor image
+ */
+static void
+cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
+		 struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	uint32_t buf[b->cursor_width * b->cursor_height];
+	int32_t width = ev->surface->width, height = ev->surface->height;
+	int32_t stride;
+	uint8_t *s;
+	int i;
+
+	assert(buffer && buffer->shm_buffer);
+	assert(buffer->shm_buffer == wl_shm_buffer_get(buffer->resource));
+	assert(width <= b->cursor_width);
+	assert(height <= b->cursor_height);
+
+	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
+	s = wl_shm_buffer_get_data(buffer->shm_buffer);
+
+	/* Only clear what the image does not cover. */
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+	for (i = 0; i < height; i++) {
+		memcpy(buf + i * b->cursor_width, s + i * stride, width * 4);
+		memset(buf + i * b->cursor_width + width, 0,
+		       (b->cursor_width - width) * 4);
+	}
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+	memset(buf + height * b->cursor_width, 0,
+	       (b->cursor_height - height) * b->cursor_width * 4);
+
+	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
+		weston_log("failed update cursor: %m\n");
+}
+
+/**
+ * Hash the image of a cursor view
+ *
+ * FNV-1a over the visible pixels and the size of the image.
+ */
+static uint64_t
+cursor_image_hash(struct weston_view *ev)
+{
+	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
+	struct wl_shm_buffer *shm_buffer = buffer->shm_buffer;
+	int32_t width = ev->surface->width, height = ev->surface->height;
+	uint64_t hash = 0xcbf29ce484222325ull;
+	int32_t stride, x, y;
+	uint8_t *s;
+
+	hash = (hash ^ (uint32_t) width) * 0x100000001b3ull;
+	hash = (hash ^ (uint32_t) height) * 0x100000001b3ull;
+
+	stride = wl_shm_buffer_get_stride(shm_buffer);
+	s = wl_shm_buffer_get_data(shm_buffer);
+
+	wl_shm_buffer_begin_access(shm_buffer);
+	for (y = 0; y < height; y++)
+		for (x = 0; x < width * 4; x++)
+			hash = (hash ^ s[y * stride + x]) * 0x100000001b3ull;
+	wl_shm_buffer_end_access(shm_buffer);
+
+	return hash ? hash : 1;
+}
+
+/**
+ * Make the current cursor buffer hold the image of the cursor view
+ *
+ * If one of the cursor buffers already holds the image, it is shown
+ * again as it is; animated cursors and switches between a few shapes
+ * then cost no writes once each image has been seen. Otherwise the
+ * image is written into the buffer after the current one.
+ *
+ * @param output Output showing the cursor
+ * @param ev Cursor view
+ */
+static void
+drm_output_update_cursor_image(struct drm_output *output,
+			       struct weston_view *ev)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	uint64_t hash = cursor_image_hash(ev);
+	int i;
+
+	for (i = 0; i < DRM_CURSOR_RING_SIZE; i++) {
+		if (output->gbm_cursor_hash[i] == hash) {
+			output->current_cursor = i;
+			return;
+		}
+	}
+
+	i = (output->current_cursor + 1) % DRM_CURSOR_RING_SIZE;
+	cursor_bo_update(b, output->gbm_cursor_fb[i]->bo, ev);
+	output->gbm_cursor_hash[i] = hash;
+	output->current_cursor = i;
+}
+
+static void
+drm_output_set_cursor(struct drm_output *output)
+{
+	struct weston_view *ev = output->cursor_view;
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	EGLint handle;
+	struct gbm_bo *bo;
+	float x, y;
+
+	if (ev == NULL) {
+		drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+		return;
+	}
+
+	if (pixman_region32_not_empty(&output->cursor_plane.damage)) {
+		pixman_region32_fini(&output->cursor_plane.damage);
+		pixman_region32_init(&output->cursor_plane.damage);
+		drm_output_update_cursor_image(output, ev);
+		bo = output->gbm_cursor_fb[output->current_cursor]->bo;
+
+		handle = gbm_bo_get_handle(bo).s32;
+		if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
+				b->cursor_width, b->cursor_height)) {
+			weston_log("failed to set cursor: %m\n");
+			b->cursors_are_broken = 1;
+		}
+	}
+
+	x = (output->cursor_plane.x - output->base.x) *
+		output->base.current_scale;
+	y = (output->cursor_plane.y - output->base.y) *
+		output->base.current_scale;
+
+	if (drmModeMoveCursor(b->drm.fd, output->crtc_id, x, y)) {
+		weston_log("failed to move cursor: %m\n");
+		b->cursors_are_broken = 1;
+	}
+}
+
+/**
+ * Decide whether a view's buffer must outlive its commit to the renderer
+ *
+ * Keep the buffer of views which could go into a plane: non-shm, or
+ * small enough to be a cursor.
+ *
+ * Also, keep a reference when using the pixman renderer. That makes it
+ * possible to do a seamless switch to the GL renderer and since the
+ * pixman renderer keeps a reference to the buffer anyway, there is no
+ * side effects.
+ */
+static void
+drm_view_update_keep_buffer(struct drm_backend *b, struct weston_view *ev)
+{
+	struct weston_surface *es = ev->surface;
+
+	if (b->use_pixman ||
+	    (es->buffer_ref.buffer &&
+	    (!wl_shm_buffer_get(es->buffer_ref.buffer->resource) ||
+	     (ev->surface->width <= b->cursor_width &&
+	      ev->surface->height <= b->cursor_height))))
+		es->keep_buffer = true;
+	else
+		es->keep_buffer = false;
+}
+
+static void
+drm_output_move_view_to_plane(struct drm_output *output,
+			      struct weston_view *ev,
+			      struct weston_plane *plane)
+{
+	struct weston_plane *primary = &output->base.compositor->primary_plane;
+
+	weston_view_move_to_plane(ev, plane);
+
+	if (plane == primary || plane == &output->cursor_plane) {
+		/* cursor plane involves a copy */
+		ev->psf_flags = 0;
+	} else {
+		/* All other planes are a direct scanout of a
+		 * single client buffer.
+		 */
+		ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
+	}
+}
+
+/**
+ * Check that an assignment respects the stacking of the candidates
+ *
+ * Overlay planes are shown above the primary plane, and their order
+ * relative to each other is unknown, so a view can only go on an
+ * overlay if no other candidate above it overlaps it. A view scanned
+ * out on the primary plane hides everything below it, and everything
+ * overlapping it from above has to be on an overlay.
+ */
+static bool
+drm_plane_assignment_is_valid(const struct drm_plane_candidate *cand,
+			      int count, int free_planes,
+			      const struct drm_plane_assignment *a)
+{
+	int i;
+
+	if (__builtin_popcount(a->overlay_mask) > free_planes)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		if (!(a->overlay_mask & (1u << i)))
+			continue;
+		if (!(cand[i].caps & DRM_CANDIDATE_OVERLAY))
+			return false;
+		if (cand[i].above_mask)
+			return false;
+		if (a->scanout >= 0 && i > a->scanout)
+			return false;
+	}
+
+	if (a->scanout < 0)
+		return true;
+
+	if (a->scanout >= count ||
+	    !(cand[a->scanout].caps & DRM_CANDIDATE_SCANOUT) ||
+	    (a->overlay_mask & (1u << a->scanout)))
+		return false;
+
+	return (cand[a->scanout].above_mask & ~a->overlay_mask) == 0;
+}
+
+static int
+drm_plane_assignment_compare(const void *pa, const void *pb)
+{
+	const struct drm_plane_assignment *a = pa, *b = pb;
+	int planes_a, planes_b;
+
+	if (a->saved != b->saved)
+		return (a->saved > b->saved) ? -1 : 1;
+
+	/* Fewer planes cost less scanout bandwidth. */
+	planes_a = __builtin_popcount(a->overlay_mask) + (a->scanout >= 0);
+	planes_b = __builtin_popcount(b->overlay_mask) + (b->scanout >= 0);
+
+	return planes_a - planes_b;
+}
+
+/**
+ * Place the candidate views onto planes as an assignment says
+ *
+ * Imports the buffers and fills in the pending state of the output and
+ * its overlay planes. On failure, the pending state is left partially
+ * filled and must be released by the caller.
+ *
+ * @param output Output to assign planes of
+ * @param cand Candidate views
+ * @param count Number of candidates
+ * @param a Assignment to apply
+ * @param planes Returns the plane of each candidate, NULL for primary
+ * @returns true if every view could be placed
+ */
+static bool
+drm_output_apply_plane_assignment(struct drm_output *output,
+				  const struct drm_plane_candidate *cand,
+				  int count,
+				  const struct drm_plane_assignment *a,
+				  struct weston_plane **planes)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		planes[i] = NULL;
+		if (!(a->overlay_mask & (1u << i)))
+			continue;
+
+		planes[i] = drm_output_prepare_overlay_view(output,
+							    cand[i].view);
+		if (!planes[i])
+			return false;
+	}
+
+	if (a->scanout >= 0) {
+		planes[a->scanout] =
+			drm_output_prepare_scanout_view(output,
+							cand[a->scanout].view);
+		if (!planes[a->scanout])
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * Get the format and modifier of a candidate's buffer without importing it
+ *
+ * They come from the dmabuf attributes, or else from the framebuffer
+ * cached for the buffer. A buffer known neither way gets format 0, and
+ * so only matches once its framebuffer was cached.
+ */
+static void
+drm_candidate_get_format(const struct drm_plane_candidate *cand,
+			 uint32_t *format, uint64_t *modifier)
+{
+	struct weston_buffer *buffer = cand->view->surface->buffer_ref.buffer;
+	struct linux_dmabuf_buffer *dmabuf;
+	struct drm_fb *fb;
+
+	*format = 0;
+	*modifier = DRM_FORMAT_MOD_INVALID;
+
+	dmabuf = linux_dmabuf_buffer_get(buffer->resource);
+	if (dmabuf) {
+		*format = dmabuf->attributes.format;
+		*modifier = dmabuf->attributes.modifier[0];
+		return;
+	}
+
+	fb = drm_fb_cache_lookup(buffer);
+	if (fb && fb->format)
+		*format = fb->format->format;
+}
+
+static struct drm_plane_cache_entry *
+drm_output_plane_cache_lookup(struct drm_output *output,
+			      const struct drm_plane_candidate *cand,
+			      int count)
+{
+	struct drm_plane_cache_entry *entry;
+	struct weston_buffer *buffer;
+	uint32_t format[DRM_PLANE_CANDIDATES_MAX];
+	uint64_t modifier[DRM_PLANE_CANDIDATES_MAX];
+	int i, j;
+
+	for (j = 0; j < count; j++)
+		drm_candidate_get_format(&cand[j], &format[j], &modifier[j]);
+
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++) {
+		entry = &output->plane_cache[i];
+		if (!entry->valid || entry->count != count)
+			continue;
+
+		for (j = 0; j < count; j++) {
+			buffer = cand[j].view->surface->buffer_ref.buffer;
+			if (entry->key[j].view != cand[j].view ||
+			    entry->key[j].generation !=
+			    cand[j].view->transform.generation ||
+			    entry->key[j].buffer_width != buffer->width ||
+			    entry->key[j].buffer_height != buffer->height ||
+			    entry->key[j].format != format[j] ||
+			    entry->key[j].modifier != modifier[j])
+				break;
+		}
+
+		if (j == count)
+			return entry;
+	}
+
+	return NULL;
+}
+
+static void
+drm_output_plane_cache_store(struct drm_output *output,
+			     const struct drm_plane_candidate *cand,
+			     int count,
+			     const struct drm_plane_assignment *a)
+{
+	struct drm_plane_cache_entry *entry = &output->plane_cache[0];
+	struct weston_buffer *buffer;
+	int i;
+
+	/* Replace an unused entry, or the least recently used one. */
+	for (i = 0; i < DRM_PLANE_CACHE_SIZE; i++) {
+		if (!output->plane_cache[i].valid) {
+			entry = &output->plane_cache[i];
+			break;
+		}
+		if (output->plane_cache[i].last_used < entry->last_used)
+			entry = &output->plane_cache[i];
+	}
+
+	drm_plane_cache_entry_clear(entry);
+
+	entry->valid = true;
+	entry->last_used = ++output->plane_cache_seq;
+	entry->count = count;
+	for (i = 0; i < count; i++) {
+		buffer = cand[i].view->surface->buffer_ref.buffer;
+		entry->key[i].entry = entry;
+		entry->key[i].view = cand[i].view;
+		entry->key[i].view_destroy_listener.notify =
+			drm_plane_cache_view_destroyed;
+		wl_signal_add(&cand[i].view->destroy_signal,
+			      &entry->key[i].view_destroy_listener);
+		entry->key[i].generation = cand[i].view->transform.generation;
+		entry->key[i].buffer_width = buffer->width;
+		entry->key[i].buffer_height = buffer->height;
+		drm_candidate_get_format(&cand[i], &entry->key[i].format,
+					 &entry->key[i].modifier);
+	}
+	entry->assignment = *a;
+}
+
+/**
+ * Find the cheapest plane assignment the kernel accepts
+ *
+ * Enumerates every assignment of the candidates which respects their
+ * stacking, and tries them in order of pixels saved from composition
+ * with TEST_ONLY commits. Composing everything is the fallback, and
+ * needs no test.
+ *
+ * @param output Output to assign planes of
+ * @param cand Candidate views
+ * @param count Number of candidates
+ * @param free_planes Number of overlay planes the output may use
+ * @param planes Returns the plane of each candidate, NULL for primary
+ * @param result Returns the assignment that was applied
+ * @returns true if the result was decided by the kernel, and so may be
+ * cached
+ */
+static bool
+drm_output_search_plane_assignment(struct drm_output *output,
+				   const struct drm_plane_candidate *cand,
+				   int count, int free_planes,
+				   struct weston_plane **planes,
+				   struct drm_plane_assignment *result)
+{
+	struct drm_plane_assignment
+		options[(1 << DRM_PLANE_CANDIDATES_MAX) *
+			(DRM_PLANE_CANDIDATES_MAX + 1)];
+	struct drm_plane_assignment a;
+	uint64_t output_area;
+	int n_options = 0, tests = 0;
+	bool tested = false;
+	int i;
+
+	output_area = (uint64_t) output->base.width * output->base.height;
+
+	for (a.scanout = -1; a.scanout < count; a.scanout++) {
+		for (a.overlay_mask = 0; a.overlay_mask < (1u << count);
+		     a.overlay_mask++) {
+			if ((a.overlay_mask == 0 && a.scanout < 0) ||
+			    !drm_plane_assignment_is_valid(cand, count,
+							   free_planes, &a))
+				continue;
+
+			a.saved = (a.scanout >= 0) ? output_area : 0;
+			for (i = 0; i < count; i++)
+				if (a.overlay_mask & (1u << i))
+					a.saved += cand[i].area;
+
+			options[n_options++] = a;
+		}
+	}
+
+	qsort(options, n_options, sizeof options[0],
+	      drm_plane_assignment_compare);
+
+	for (i = 0; i < n_options && tests < DRM_PLANE_TESTS_MAX; i++) {
+		tests++;
+
+		if (drm_output_apply_plane_assignment(output, cand, count,
+						      &options[i], planes)) {
+			tested = true;
+			if (drm_output_test_atomic(output) == 0) {
+				*result = options[i];
+				return true;
+			}
+		}
+
+		drm_output_release_pending(output);
+	}
+
+	result->overlay_mask = 0;
+	result->scanout = -1;
+	result->saved = 0;
+	for (i = 0; i < count; i++)
+		planes[i] = NULL;
+
+	/* Only remember that nothing fits when the kernel said so. */
+	return tested;
+}
+
+/**
+ * Assign views to planes, validated by the kernel
+ *
+ * Views which can only be composited go to the primary plane straight
+ * away; the cursor view goes to the cursor plane as usual. The
+ * remaining views are candidates for the overlay planes and for direct
+ * scanout, and the best combination the kernel accepts is searched for,
+ * unless the output has recently accepted one for the same candidates
+ * and a single TEST_ONLY commit confirms it still fits.
+ */
+static void
+drm_assign_planes_atomic(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_plane *primary = &ec->primary_plane;
+	struct drm_plane_candidate cand[DRM_PLANE_CANDIDATES_MAX];
+	struct weston_plane *planes[DRM_PLANE_CANDIDATES_MAX];
+	struct drm_plane_assignment result;
+	struct drm_plane_cache_entry *entry = NULL;
+	pixman_region32_t above, primary_above, on_output;
+	pixman_box32_t *box;
+	struct weston_view *ev, *other;
+	struct drm_plane *p;
+	bool use_cache, found = false;
+	int count = 0, free_planes = 0;
+	uint32_t caps;
+	int i;
 
-	if (b->cursors_are_broken)
-		return NULL;
+	wl_list_for_each(p, &b->plane_list, link)
+		if (drm_plane_is_available(output, p))
+			free_planes++;
+
+	/* Test results are only meaningful against a displayed mode. */
+	use_cache = !output->state_invalid && output->fb_current;
+	if (!use_cache)
+		drm_output_plane_cache_flush(output);
+
+	pixman_region32_init(&above);
+	pixman_region32_init(&primary_above);
+	pixman_region32_init(&on_output);
+
+	wl_list_for_each(ev, &ec->view_list, link) {
+		struct weston_plane *plane = NULL;
+
+		drm_view_update_keep_buffer(b, ev);
+
+		/* The cursor plane is above everything else. */
+		if (!drm_region_overlaps(&above, &ev->transform.boundingbox))
+			plane = drm_output_prepare_cursor_view(output, ev);
+
+		caps = 0;
+		if (!plane && count < DRM_PLANE_CANDIDATES_MAX &&
+		    !drm_region_overlaps(&primary_above,
+					 &ev->transform.boundingbox)) {
+			if (free_planes > 0 &&
+			    drm_view_is_overlay_capable(output, ev))
+				caps |= DRM_CANDIDATE_OVERLAY;
+			if (drm_view_is_scanout_capable(output, ev))
+				caps |= DRM_CANDIDATE_SCANOUT;
+		}
 
-	if (output->cursor_view)
-		return NULL;
+		if (caps) {
+			cand[count].view = ev;
+			cand[count].caps = caps;
+			cand[count].above_mask = 0;
+			for (i = 0; i < count; i++) {
+				other = cand[i].view;
+				if (drm_region_overlaps(&other->transform.boundingbox,
+							&ev->transform.boundingbox))
+					cand[count].above_mask |= 1u << i;
+			}
 
-	/* Don't import buffers which span multiple outputs. */
-	if (ev->output_mask != (1u << output->base.id))
-		return NULL;
+			pixman_region32_intersect(&on_output,
+						  &ev->transform.boundingbox,
+						  &output->base.region);
+			box = pixman_region32_extents(&on_output);
+			cand[count].area = (uint64_t) (box->x2 - box->x1) *
+					   (box->y2 - box->y1);
+			count++;
+		} else if (plane) {
+			drm_output_move_view_to_plane(output, ev, plane);
+		} else {
+			drm_output_move_view_to_plane(output, ev, primary);
+			pixman_region32_union(&primary_above, &primary_above,
+					      &ev->transform.boundingbox);
+		}
 
-	/* We use GBM to import SHM buffers. */
-	if (b->gbm == NULL)
-		return NULL;
+		pixman_region32_union(&above, &above,
+				      &ev->transform.boundingbox);
+	}
 
-	if (ev->surface->buffer_ref.buffer == NULL)
-		return NULL;
-	shmbuf = wl_shm_buffer_get(ev->surface->buffer_ref.buffer->resource);
-	if (!shmbuf)
-		return NULL;
-	if (wl_shm_buffer_get_format(shmbuf) != WL_SHM_FORMAT_ARGB8888)
-		return NULL;
+	pixman_region32_fini(&above);
+	pixman_region32_fini(&primary_above);
+	pixman_region32_fini(&on_output);
 
-	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL)
-		return NULL;
-	if (ev->transform.enabled &&
-	    (ev->transform.matrix.type > WESTON_MATRIX_TRANSFORM_TRANSLATE))
-		return NULL;
-	if (viewport->buffer.scale != output->base.current_scale)
-		return NULL;
-	if (ev->geometry.scissor_enabled)
-		return NULL;
+	if (count == 0)
+		return;
 
-	if (ev->surface->width > b->cursor_width ||
-	    ev->surface->height > b->cursor_height)
-		return NULL;
+	if (use_cache)
+		entry = drm_output_plane_cache_lookup(output, cand, count);
+	if (entry &&
+	    drm_plane_assignment_is_valid(cand, count, free_planes,
+					  &entry->assignment)) {
+		found = drm_output_apply_plane_assignment(output, cand, count,
+							  &entry->assignment,
+							  planes) &&
+			drm_output_test_atomic(output) == 0;
+		if (found) {
+			entry->last_used = ++output->plane_cache_seq;
+		} else {
+			drm_output_release_pending(output);
+			drm_plane_cache_entry_clear(entry);
+		}
+	}
 
-	output->cursor_view = ev;
-	weston_view_to_global_float(ev, 0, 0, &x, &y);
-	output->cursor_plane.x = x;
-	output->cursor_plane.y = y;
+	if (!found &&
+	    drm_output_search_plane_assignment(output, cand, count,
+					       free_planes, planes,
+					       &result) &&
+	    use_cache)
+		drm_output_plane_cache_store(output, cand, count, &result);
 
-	return &output->cursor_plane;
+	for (i = 0; i < count; i++)
+		drm_output_move_view_to_plane(output, cand[i].view,
+					      planes[i] ? planes[i] : primary);
 }
 
 /**
- * Update the image for the current cursor surface
+ * Check whether a shm view can be copied straight into the scanout buffer
  *
- * @param b DRM backend structure
- * @param bo GBM buffer object to write into
- * @param ev View to use for cursor image
+ * The view has to cover the output exactly, untransformed, unscaled and
+ * opaque, with a buffer in the output's pixel format.
  */
-static void
-cursor_bo_update(struct drm_backend *b, struct gbm_bo *bo,
-		 struct weston_view *ev)
+static bool
+drm_view_is_shm_scanout_capable(struct drm_output *output,
+				struct weston_view *ev)
 {
 	struct weston_buffer *buffer = ev->surface->buffer_ref.buffer;
-	uint32_t buf[b->cursor_width * b->cursor_height];
-	int32_t stride;
-	uint8_t *s;
-	int i;
+	struct weston_buffer_viewport *viewport = &ev->surface->buffer_viewport;
+	pixman_region32_t r;
+	uint32_t format;
+	bool opaque;
 
-	assert(buffer && buffer->shm_buffer);
-	assert(buffer->shm_buffer == wl_shm_buffer_get(buffer->resource));
-	assert(ev->surface->width <= b->cursor_width);
-	assert(ev->surface->height <= b->cursor_height);
+	if (ev->output_mask != (1u << output->base.id))
+		return false;
 
-	memset(buf, 0, sizeof buf);
-	stride = wl_shm_buffer_get_stride(buffer->shm_buffer);
-	s = wl_shm_buffer_get_data(buffer->shm_buffer);
+	if (buffer == NULL || !buffer->shm_buffer)
+		return false;
 
-	wl_shm_buffer_begin_access(buffer->shm_buffer);
-	for (i = 0; i < ev->surface->height; i++)
-		memcpy(buf + i * b->cursor_width,
-		       s + i * stride,
-		       ev->surface->width * 4);
-	wl_shm_buffer_end_access(buffer->shm_buffer);
+	if (ev->geometry.x != output->base.x ||
+	    ev->geometry.y != output->base.y)
+		return false;
+	if (buffer->width != output->base.current_mode->width ||
+	    buffer->height != output->base.current_mode->height)
+		return false;
+	if (ev->surface->width != output->base.width ||
+	    ev->surface->height != output->base.height)
+		return false;
 
-	if (gbm_bo_write(bo, buf, sizeof buf) < 0)
-		weston_log("failed update cursor: %m\n");
+	if (ev->transform.enabled)
+		return false;
+	if (ev->geometry.scissor_enabled)
+		return false;
+	if (output->base.transform != WL_OUTPUT_TRANSFORM_NORMAL ||
+	    viewport->buffer.transform != WL_OUTPUT_TRANSFORM_NORMAL)
+		return false;
+	/* Damage is copied as pixel rectangles in output coordinates. */
+	if (output->base.current_scale != 1 || viewport->buffer.scale != 1)
+		return false;
+
+	if (ev->alpha != 1.0f)
+		return false;
+
+	format = wl_shm_buffer_get_format(buffer->shm_buffer);
+	switch (output->gbm_format) {
+	case GBM_FORMAT_XRGB8888:
+		if (format == WL_SHM_FORMAT_XRGB8888)
+			return true;
+		if (format != WL_SHM_FORMAT_ARGB8888)
+			return false;
+
+		pixman_region32_init_rect(&r, 0, 0,
+					  ev->surface->width,
+					  ev->surface->height);
+		pixman_region32_subtract(&r, &r, &ev->surface->opaque);
+		opaque = !pixman_region32_not_empty(&r);
+		pixman_region32_fini(&r);
+
+		return opaque;
+	case GBM_FORMAT_RGB565:
+		return format == WL_SHM_FORMAT_RGB565;
+	default:
+		return false;
+	}
 }
 
+/**
+ * Assign views to planes with the pixman renderer
+ *
+ * There are no GBM buffers to put on hardware planes, but the topmost
+ * view can still skip composition: if it is a fullscreen opaque shm
+ * view, its damage is copied straight into the dumb scanout buffer and
+ * everything below it is hidden.
+ */
 static void
-drm_output_set_cursor(struct drm_output *output)
+drm_assign_planes_pixman(struct drm_output *output)
 {
-	struct weston_view *ev = output->cursor_view;
 	struct drm_backend *b = to_drm_backend(output->base.compositor);
-	EGLint handle;
-	struct gbm_bo *bo;
-	float x, y;
+	struct weston_compositor *ec = output->base.compositor;
+	struct weston_plane *primary = &ec->primary_plane;
+	struct weston_view *ev;
+	bool topmost = true;
 
-	if (ev == NULL) {
-		drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
-		return;
-	}
+	output->shm_scanout_view = NULL;
 
-	if (pixman_region32_not_empty(&output->cursor_plane.damage)) {
-		pixman_region32_fini(&output->cursor_plane.damage);
-		pixman_region32_init(&output->cursor_plane.damage);
-		output->current_cursor ^= 1;
-		bo = output->gbm_cursor_fb[output->current_cursor]->bo;
+	wl_list_for_each(ev, &ec->view_list, link) {
+		struct weston_plane *plane = primary;
 
-		cursor_bo_update(b, bo, ev);
-		handle = gbm_bo_get_handle(bo).s32;
-		if (drmModeSetCursor(b->drm.fd, output->crtc_id, handle,
-				b->cursor_width, b->cursor_height)) {
-			weston_log("failed to set cursor: %m\n");
-			b->cursors_are_broken = 1;
-		}
-	}
+		drm_view_update_keep_buffer(b, ev);
 
-	x = (output->cursor_plane.x - output->base.x) *
-		output->base.current_scale;
-	y = (output->cursor_plane.y - output->base.y) *
-		output->base.current_scale;
+		if (topmost && (ev->output_mask & (1u << output->base.id))) {
+			topmost = false;
+			if (!output->base.disable_planes &&
+			    drm_view_is_shm_scanout_capable(output, ev)) {
+				output->shm_scanout_view = ev;
+				plane = &output->scanout_plane;
+			}
+		}
 
-	if (drmModeMoveCursor(b->drm.fd, output->crtc_id, x, y)) {
-		weston_log("failed to move cursor: %m\n");
-		b->cursors_are_broken = 1;
+		/* The view is copied, so the update is not zero-copy. */
+		weston_view_move_to_plane(ev, plane);
+		ev->psf_flags = 0;
 	}
 }
 
@@ -1871,6 +3825,20 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	struct weston_plane *primary, *next_plane;
 	bool picked_scanout = false;
 
+	output->cursor_view = NULL;
+	output->cursor_plane.x = INT32_MIN;
+	output->cursor_plane.y = INT32_MIN;
+
+	if (b->use_pixman) {
+		drm_assign_planes_pixman(output);
+		return;
+	}
+
+	if (b->atomic_modeset) {
+		drm_assign_planes_atomic(output);
+		return;
+	}
+
 	/*
 	 * Find a surface for each sprite in the output using some heuristics:
 	 * 1) size
@@ -1887,29 +3855,8 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 	pixman_region32_init(&overlap);
 	primary = &output_base->compositor->primary_plane;
 
-	output->cursor_view = NULL;
-	output->cursor_plane.x = INT32_MIN;
-	output->cursor_plane.y = INT32_MIN;
-
 	wl_list_for_each_safe(ev, next, &output_base->compositor->view_list, link) {
-		struct weston_surface *es = ev->surface;
-
-		/* Test whether this buffer can ever go into a plane:
-		 * non-shm, or small enough to be a cursor.
-		 *
-		 * Also, keep a reference when using the pixman renderer.
-		 * That makes it possible to do a seamless switch to the GL
-		 * renderer and since the pixman renderer keeps a reference
-		 * to the buffer anyway, there is no side effects.
-		 */
-		if (b->use_pixman ||
-		    (es->buffer_ref.buffer &&
-		    (!wl_shm_buffer_get(es->buffer_ref.buffer->resource) ||
-		     (ev->surface->width <= b->cursor_width &&
-		      ev->surface->height <= b->cursor_height))))
-			es->keep_buffer = true;
-		else
-			es->keep_buffer = false;
+		drm_view_update_keep_buffer(b, ev);
 
 		pixman_region32_init(&surface_overlap);
 		pixman_region32_intersect(&surface_overlap, &overlap,
@@ -1936,23 +3883,12 @@ drm_assign_planes(struct weston_output *output_base, void *repaint_data)
 		if (next_plane == NULL)
 			next_plane = primary;
 
-		weston_view_move_to_plane(ev, next_plane);
+		drm_output_move_view_to_plane(output, ev, next_plane);
 
 		if (next_plane == primary)
 			pixman_region32_union(&overlap, &overlap,
 					      &ev->transform.boundingbox);
 
-		if (next_plane == primary ||
-		    next_plane == &output->cursor_plane) {
-			/* cursor plane involves a copy */
-			ev->psf_flags = 0;
-		} else {
-			/* All other planes are a direct scanout of a
-			 * single client buffer.
-			 */
-			ev->psf_flags = WP_PRESENTATION_FEEDBACK_KIND_ZERO_COPY;
-		}
-
 		pixman_region32_fini(&surface_overlap);
 	}
 	pixman_region32_fini(&overlap);
@@ -2048,6 +3984,7 @@ drm_output_switch_mode(struct weston_output *output_base, struct weston_mode *mo
 	assert(!output->fb_last);
 	assert(!output->fb_pending);
 	output->fb_last = output->fb_current = NULL;
+	output->state_invalid = true;
 
 	if (b->use_pixman) {
 		drm_output_fini_pixman(output);
@@ -2074,8 +4011,13 @@ on_drm_input(int fd, uint32_t mask, void *data)
 	drmEventContext evctx;
 
 	memset(&evctx, 0, sizeof evctx);
+#ifdef HAVE_DRM_ATOMIC
+	evctx.version = 3;
+	evctx.page_flip_handler2 = page_flip_handler2;
+#else
 	evctx.version = 2;
 	evctx.page_flip_handler = page_flip_handler;
+#endif
 	evctx.vblank_handler = vblank_handler;
 	drmHandleEvent(fd, &evctx);
 
@@ -2122,6 +4064,26 @@ init_kms_caps(struct drm_backend *b)
 	weston_log("DRM: %s universal planes\n",
 		   b->universal_planes ? "supports" : "does not support");
 
+#ifdef HAVE_DRM_ATOMIC
+	if (b->universal_planes && !getenv("WESTON_DISABLE_ATOMIC")) {
+		ret = drmSetClientCap(b->drm.fd, DRM_CLIENT_CAP_ATOMIC, 1);
+		b->atomic_modeset = (ret == 0);
+	}
+#endif
+	weston_log("DRM: %s atomic modesetting\n",
+		   b->atomic_modeset ? "supports" : "does not support");
+
+	/* Flip events of a commit spanning several CRTCs can only be told
+	 * apart by the CRTC they carry. */
+	ret = drmGetCap(b->drm.fd, DRM_CAP_CRTC_IN_VBLANK_EVENT, &cap);
+	b->crtc_in_vblank_event = (ret == 0 && cap == 1);
+
+	/* Overlay updates are only synchronised with the primary plane
+	 * when both go through one atomic commit; see
+	 * drm_backend_create(). */
+	if (b->atomic_modeset)
+		b->sprites_are_broken = 0;
+
 	return 0;
 }
 
@@ -2254,6 +4216,17 @@ drm_plane_create(struct drm_backend *b, const drmModePlane *kplane)
 			.enum_values = plane_type_enums,
 			.num_enum_values = WDRM_PLANE_TYPE__COUNT,
 		},
+		[WDRM_PLANE_SRC_X] = { .name = "SRC_X", },
+		[WDRM_PLANE_SRC_Y] = { .name = "SRC_Y", },
+		[WDRM_PLANE_SRC_W] = { .name = "SRC_W", },
+		[WDRM_PLANE_SRC_H] = { .name = "SRC_H", },
+		[WDRM_PLANE_CRTC_X] = { .name = "CRTC_X", },
+		[WDRM_PLANE_CRTC_Y] = { .name = "CRTC_Y", },
+		[WDRM_PLANE_CRTC_W] = { .name = "CRTC_W", },
+		[WDRM_PLANE_CRTC_H] = { .name = "CRTC_H", },
+		[WDRM_PLANE_FB_ID] = { .name = "FB_ID", },
+		[WDRM_PLANE_CRTC_ID] = { .name = "CRTC_ID", },
+		[WDRM_PLANE_FB_DAMAGE_CLIPS] = { .name = "FB_DAMAGE_CLIPS", },
 	};
 
 	plane = zalloc(sizeof(*plane) + ((sizeof(uint32_t)) *
@@ -2393,6 +4366,7 @@ drm_output_add_mode(struct drm_output *output, const drmModeModeInfo *info)
 		return NULL;
 
 	mode->base.flags = 0;
+	mode->blob_id = 0;
 	mode->base.width = info->hdisplay;
 	mode->base.height = info->vdisplay;
 
@@ -2600,6 +4574,7 @@ static void drm_output_fini_cursor_egl(struct drm_output *output)
 	for (i = 0; i < ARRAY_LENGTH(output->gbm_cursor_fb); i++) {
 		drm_fb_unref(output->gbm_cursor_fb[i]);
 		output->gbm_cursor_fb[i] = NULL;
+		output->gbm_cursor_hash[i] = 0;
 	}
 }
 
@@ -2689,7 +4664,7 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 	int h = output->base.current_mode->height;
 	uint32_t format = output->gbm_format;
 	uint32_t pixman_format;
-	unsigned int i;
+	int i;
 
 	switch (format) {
 		case GBM_FORMAT_XRGB8888:
@@ -2703,8 +4678,10 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 			return -1;
 	}
 
+	output->dumb_count = b->pixman_buffers;
+
 	/* FIXME error checking */
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		output->dumb[i] = drm_fb_create_dumb(b, w, h, format);
 		if (!output->dumb[i])
 			goto err;
@@ -2717,16 +4694,21 @@ drm_output_init_pixman(struct drm_output *output, struct drm_backend *b)
 			goto err;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0)
+	if (pixman_renderer_output_create(&output->base,
+					  PIXMAN_RENDERER_OUTPUT_USE_SHADOW) < 0)
 		goto err;
 
-	pixman_region32_init_rect(&output->previous_damage,
-				  output->base.x, output->base.y, output->base.width, output->base.height);
+	for (i = 0; i < output->dumb_count; i++)
+		pixman_region32_init_rect(&output->dumb_damage[i],
+					  output->base.x, output->base.y,
+					  output->base.width,
+					  output->base.height);
+	output->current_image = output->dumb_count - 1;
 
 	return 0;
 
 err:
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
 		if (output->dumb[i])
 			drm_fb_unref(output->dumb[i]);
 		if (output->image[i])
@@ -2742,12 +4724,12 @@ err:
 static void
 drm_output_fini_pixman(struct drm_output *output)
 {
-	unsigned int i;
+	int i;
 
 	pixman_renderer_output_destroy(&output->base);
-	pixman_region32_fini(&output->previous_damage);
 
-	for (i = 0; i < ARRAY_LENGTH(output->dumb); i++) {
+	for (i = 0; i < output->dumb_count; i++) {
+		pixman_region32_fini(&output->dumb_damage[i]);
 		pixman_image_unref(output->image[i]);
 		drm_fb_unref(output->dumb[i]);
 		output->dumb[i] = NULL;
@@ -3159,6 +5141,54 @@ drm_output_set_seat(struct weston_output *base,
 				     seat ? seat : "");
 }
 
+static void
+drm_output_set_group(struct weston_output *base,
+		     const char *group)
+{
+	struct drm_output *output = to_drm_output(base);
+	struct drm_backend *b = to_drm_backend(base->compositor);
+
+	free(output->group);
+	output->group = NULL;
+
+	if (!group || !*group)
+		return;
+
+	if (!b->atomic_modeset || !b->crtc_in_vblank_event) {
+		weston_log("Output %s: ignoring group \"%s\", synchronised "
+			   "flips need atomic modesetting\n",
+			   output->base.name, group);
+		return;
+	}
+
+	output->group = strdup(group);
+}
+
+/**
+ * Find a free KMS plane of the given type for an output's CRTC
+ *
+ * @param output Output to find a plane for
+ * @param type Type of the plane
+ * @returns The plane, or NULL if there is none
+ */
+static struct drm_plane *
+drm_output_find_kms_plane(struct drm_output *output,
+			  enum wdrm_plane_type type)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	struct drm_plane *p;
+
+	wl_list_for_each(p, &b->plane_list, link) {
+		if (p->type != type || p->output)
+			continue;
+
+		if (drm_plane_crtc_supported(output, p))
+			return p;
+	}
+
+	return NULL;
+}
+
 static int
 drm_output_enable(struct weston_output *base)
 {
@@ -3166,6 +5196,24 @@ drm_output_enable(struct weston_output *base)
 	struct drm_backend *b = to_drm_backend(base->compositor);
 	struct weston_mode *m;
 
+	if (b->atomic_modeset) {
+		output->kms_primary_plane =
+			drm_output_find_kms_plane(output,
+						  WDRM_PLANE_TYPE_PRIMARY);
+		if (!output->kms_primary_plane) {
+			weston_log("Failed to find a primary plane for "
+				   "output %s\n", output->base.name);
+			goto err;
+		}
+		output->kms_primary_plane->output = output;
+
+		output->kms_cursor_plane =
+			drm_output_find_kms_plane(output,
+						  WDRM_PLANE_TYPE_CURSOR);
+		if (output->kms_cursor_plane)
+			output->kms_cursor_plane->output = output;
+	}
+
 	if (b->pageflip_timeout)
 		drm_output_pageflip_timer_create(output);
 
@@ -3200,6 +5248,7 @@ drm_output_enable(struct weston_output *base)
 	weston_plane_init(&output->cursor_plane, b->compositor,
 			  INT32_MIN, INT32_MIN);
 	weston_plane_init(&output->scanout_plane, b->compositor, 0, 0);
+	pixman_region32_init(&output->fb_damage);
 
 	weston_compositor_stack_plane(b->compositor, &output->cursor_plane, NULL);
 	weston_compositor_stack_plane(b->compositor, &output->scanout_plane,
@@ -3245,9 +5294,29 @@ drm_output_deinit(struct weston_output *base)
 
 	weston_plane_release(&output->scanout_plane);
 	weston_plane_release(&output->cursor_plane);
+	pixman_region32_fini(&output->fb_damage);
+	drm_output_plane_cache_flush(output);
 
 	/* Turn off hardware cursor */
 	drmModeSetCursor(b->drm.fd, output->crtc_id, 0, 0, 0);
+
+	if (b->atomic_modeset) {
+		struct drm_plane *p;
+
+		wl_list_for_each(p, &b->plane_list, link) {
+			if (p->output != output)
+				continue;
+
+			assert(!p->fb_last);
+			assert(!p->fb_pending);
+			drm_fb_unref(p->fb_current);
+			p->fb_current = NULL;
+			p->output = NULL;
+		}
+
+		output->kms_primary_plane = NULL;
+		output->kms_cursor_plane = NULL;
+	}
 }
 
 static void
@@ -3264,12 +5333,19 @@ drm_output_destroy(struct weston_output *base)
 		return;
 	}
 
+	drm_output_flip_group_leave(output);
+
 	if (output->base.enabled)
 		drm_output_deinit(&output->base);
 
 	wl_list_for_each_safe(drm_mode, next, &output->base.mode_list,
 			      base.link) {
 		wl_list_remove(&drm_mode->base.link);
+#ifdef HAVE_DRM_ATOMIC
+		if (drm_mode->blob_id)
+			drmModeDestroyPropertyBlob(b->drm.fd,
+						   drm_mode->blob_id);
+#endif
 		free(drm_mode);
 	}
 
@@ -3287,34 +5363,86 @@ drm_output_destroy(struct weston_output *base)
 	weston_output_release(&output->base);
 
 	drm_property_info_free(output->props_conn, WDRM_CONNECTOR__COUNT);
+	drm_property_info_free(output->props_crtc, WDRM_CRTC__COUNT);
 
 	drmModeFreeConnector(output->connector);
 
 	if (output->backlight)
 		backlight_destroy(output->backlight);
 
+	free(output->group);
 	free(output);
 }
 
+#ifdef HAVE_DRM_ATOMIC
+/**
+ * Turn off an output's CRTC and all of its planes in one atomic commit
+ *
+ * @param output Enabled output to turn off
+ * @returns 0 on success, -1 on failure
+ */
+static int
+drm_output_disable_atomic(struct drm_output *output)
+{
+	struct drm_backend *b = to_drm_backend(output->base.compositor);
+	drmModeAtomicReq *req;
+	struct drm_plane *p;
+	int ret = 0;
+
+	req = drmModeAtomicAlloc();
+	if (!req)
+		return -1;
+
+	wl_list_for_each(p, &b->plane_list, link) {
+		if (p->output == output)
+			ret |= plane_add_state(req, p, output, NULL);
+	}
+
+	ret |= crtc_add_prop(req, output, WDRM_CRTC_ACTIVE, 0);
+	ret |= crtc_add_prop(req, output, WDRM_CRTC_MODE_ID, 0);
+	ret |= connector_add_prop(req, output, WDRM_CONNECTOR_CRTC_ID, 0);
+
+	if (ret == 0)
+		ret = drmModeAtomicCommit(b->drm.fd, req,
+					  DRM_MODE_ATOMIC_ALLOW_MODESET, NULL);
+	if (ret != 0)
+		weston_log("atomic: couldn't disable output %s: %m\n",
+			   output->base.name);
+
+	drmModeAtomicFree(req);
+
+	return (ret == 0) ? 0 : -1;
+}
+#endif
+
 static int
 drm_output_disable(struct weston_output *base)
 {
 	struct drm_output *output = to_drm_output(base);
 	struct drm_backend *b = to_drm_backend(base->compositor);
+	bool crtc_off = false;
 
 	if (output->page_flip_pending) {
 		output->disable_pending = 1;
 		return -1;
 	}
 
+	drm_output_flip_group_leave(output);
+
+#ifdef HAVE_DRM_ATOMIC
+	if (output->base.enabled && b->atomic_modeset)
+		crtc_off = (drm_output_disable_atomic(output) == 0);
+#endif
+
 	if (output->base.enabled)
 		drm_output_deinit(&output->base);
 
 	output->disable_pending = 0;
 
 	weston_log("Disabling output %s\n", output->base.name);
-	drmModeSetCrtc(b->drm.fd, output->crtc_id,
-		       0, 0, 0, 0, 0, NULL);
+	if (!crtc_off)
+		drmModeSetCrtc(b->drm.fd, output->crtc_id,
+			       0, 0, 0, 0, 0, NULL);
 
 	return 0;
 }
@@ -3350,6 +5478,11 @@ create_output_for_connector(struct drm_backend *b,
 	static const struct drm_property_info connector_props[] = {
 		[WDRM_CONNECTOR_EDID] = { .name = "EDID" },
 		[WDRM_CONNECTOR_DPMS] = { .name = "DPMS" },
+		[WDRM_CONNECTOR_CRTC_ID] = { .name = "CRTC_ID" },
+	};
+	static const struct drm_property_info crtc_props[] = {
+		[WDRM_CRTC_MODE_ID] = { .name = "MODE_ID" },
+		[WDRM_CRTC_ACTIVE] = { .name = "ACTIVE" },
 	};
 
 	i = find_crtc_for_connector(b, resources, connector);
@@ -3407,6 +5540,16 @@ create_output_for_connector(struct drm_backend *b,
 
 	drmModeFreeObjectProperties(props);
 
+	props = drmModeObjectGetProperties(b->drm.fd, output->crtc_id,
+					   DRM_MODE_OBJECT_CRTC);
+	if (!props) {
+		weston_log("failed to get CRTC properties\n");
+		goto err;
+	}
+	drm_property_info_populate(b, crtc_props, output->props_crtc,
+				   WDRM_CRTC__COUNT, props);
+	drmModeFreeObjectProperties(props);
+
 	for (i = 0; i < output->connector->count_modes; i++) {
 		drm_mode = drm_output_add_mode(output, &output->connector->modes[i]);
 		if (!drm_mode) {
@@ -3609,6 +5752,10 @@ drm_destroy(struct weston_compositor *ec)
 
 	weston_compositor_shutdown(ec);
 
+	weston_log("DRM: client framebuffers reused %u times, created %u\n",
+		   b->fb_cache_hits, b->fb_cache_misses);
+	drm_fb_cache_flush(b);
+
 	if (b->gbm)
 		gbm_device_destroy(b->gbm);
 
@@ -4002,6 +6149,7 @@ static const struct weston_drm_output_api api = {
 	drm_output_set_mode,
 	drm_output_set_gbm_format,
 	drm_output_set_seat,
+	drm_output_set_group,
 };
 
 static struct drm_backend *
@@ -4030,13 +6178,24 @@ drm_backend_create(struct weston_compositor *compositor,
 	 * to a fraction. For cursors, it's not so bad, so they are
 	 * enabled.
 	 *
-	 * These can be enabled again when nuclear/atomic support lands.
+	 * They are enabled again by init_kms_caps() when the kernel
+	 * supports atomic modesetting.
 	 */
 	b->sprites_are_broken = 1;
 	b->compositor = compositor;
 	b->use_pixman = config->use_pixman;
 	b->pageflip_timeout = config->pageflip_timeout;
 
+	b->pixman_buffers = config->pixman_buffers;
+	if (b->pixman_buffers == 0)
+		b->pixman_buffers = DRM_PIXMAN_BUFFERS_DEFAULT;
+	if (b->pixman_buffers < 2 ||
+	    b->pixman_buffers > DRM_PIXMAN_BUFFERS_MAX) {
+		weston_log("invalid number of pixman buffers %u, using %d\n",
+			   b->pixman_buffers, DRM_PIXMAN_BUFFERS_DEFAULT);
+		b->pixman_buffers = DRM_PIXMAN_BUFFERS_DEFAULT;
+	}
+
 	compositor->backend = &b->base;
 
 	if (parse_gbm_format(config->gbm_format, GBM_FORMAT_XRGB8888, &b->gbm_format) < 0)
@@ -4098,6 +6257,8 @@ drm_backend_create(struct weston_compositor *compositor,
 	wl_list_init(&b->plane_list);
 	create_sprites(b);
 
+	wl_list_init(&b->fb_cache_list);
+
 	if (udev_input_init(&b->input,
 			    compositor, b->udev, seat_id,
 			    config->configure_device) < 0) {
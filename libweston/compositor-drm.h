@@ -35,7 +35,7 @@
 extern "C" {
 #endif
 
-#define WESTON_DRM_BACKEND_CONFIG_VERSION 3
+#define WESTON_DRM_BACKEND_CONFIG_VERSION 4
 
 struct libinput_device;
 
@@ -52,7 +52,7 @@ enum weston_drm_backend_output_mode {
 	WESTON_DRM_BACKEND_OUTPUT_PREFERRED,
 };
 
-#define WESTON_DRM_OUTPUT_API_NAME "weston_drm_output_api_v1"
+#define WESTON_DRM_OUTPUT_API_NAME "weston_drm_output_api_v2"
 
 struct weston_drm_output_api {
 	/** The mode to be used by the output. Refer to the documentation
@@ -78,6 +78,16 @@ struct weston_drm_output_api {
 	 */
 	void (*set_seat)(struct weston_output *output,
 			 const char *seat);
+
+	/** The group of the output. Outputs of the same group are
+	 *  committed together and flip on the same refresh, which keeps
+	 *  the panels of a tiled display or video wall in step. Set to
+	 *  NULL to update the output on its own.
+	 *
+	 *  Groups are only honoured with atomic modesetting.
+	 */
+	void (*set_group)(struct weston_output *output,
+			  const char *group);
 };
 
 static inline const struct weston_drm_output_api *
@@ -139,6 +149,10 @@ struct weston_drm_backend_config {
 	 *
 	 * It is exprimed in milliseconds, 0 means disabled. */
 	uint32_t pageflip_timeout;
+
+	/** Number of buffers each output renders into with the pixman
+	 * renderer, between 2 and 4; 0 means the default of 2. */
+	uint32_t pixman_buffers;
 };
 
 #ifdef  __cplusplus
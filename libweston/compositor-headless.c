@@ -36,7 +36,10 @@
 #include "compositor.h"
 #include "compositor-headless.h"
 #include "shared/helpers.h"
+#include "shared/timespec-util.h"
 #include "pixman-renderer.h"
+#include "gl-renderer.h"
+#include "weston-egl-ext.h"
 #include "presentation-time-server-protocol.h"
 #include "windowed-output-api.h"
 
@@ -46,6 +49,10 @@ struct headless_backend {
 
 	struct weston_seat fake_seat;
 	bool use_pixman;
+	bool use_gl;
+
+	int refresh;
+	enum weston_headless_refresh_mode refresh_mode;
 };
 
 struct headless_output {
@@ -53,10 +60,20 @@ struct headless_output {
 
 	struct weston_mode mode;
 	struct wl_event_source *finish_frame_timer;
+	struct wl_event_source *finish_frame_idle;
+
+	int refresh;
+	enum weston_headless_refresh_mode refresh_mode;
+	struct timespec vblank_base; /* virtual vblank with msc 0 */
+	struct timespec frame_ts; /* when the pending frame is shown */
+	uint64_t frame_msc;
 	uint32_t *image_buf;
 	pixman_image_t *image;
+	uint32_t *row_buf; /* for flipping GL readbacks */
 };
 
+static struct gl_renderer_interface *gl_renderer;
+
 static inline struct headless_output *
 to_headless_output(struct weston_output *base)
 {
@@ -70,40 +87,190 @@ to_headless_backend(struct weston_compositor *base)
 }
 
 static void
-headless_output_start_repaint_loop(struct weston_output *output)
+headless_output_start_repaint_loop(struct weston_output *output_base)
+{
+	struct headless_output *output = to_headless_output(output_base);
+	struct timespec ts, earliest;
+	int64_t refresh_nsec, n;
+
+	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
+
+	switch (output->refresh_mode) {
+	case WESTON_HEADLESS_REFRESH_FIXED:
+		/* Report the latest virtual vblank, so repaints keep in
+		 * phase with them. */
+		refresh_nsec = millihz_to_nsec(output->mode.refresh);
+		n = timespec_sub_to_nsec(&ts, &output->vblank_base) /
+		    refresh_nsec;
+		timespec_add_nsec(&ts, &output->vblank_base, n * refresh_nsec);
+		output->base.msc = n;
+		break;
+	case WESTON_HEADLESS_REFRESH_VARIABLE:
+		/* A frame can be shown a refresh period after this one, so
+		 * pretend it came as late as the last real one allows. */
+		refresh_nsec = millihz_to_nsec(output->mode.refresh);
+		timespec_add_nsec(&earliest, &ts, -refresh_nsec);
+		if (timespec_sub_to_nsec(&output->base.frame_time,
+					 &earliest) > 0)
+			ts = output->base.frame_time;
+		else
+			ts = earliest;
+		break;
+	case WESTON_HEADLESS_REFRESH_FREE_RUNNING:
+		break;
+	}
+
+	weston_output_finish_frame(output_base, &ts,
+				   WP_PRESENTATION_FEEDBACK_INVALID);
+}
+
+static void
+headless_output_finish_frame(struct headless_output *output)
 {
-	struct timespec ts;
+	uint32_t flags = 0;
+
+	if (output->refresh_mode == WESTON_HEADLESS_REFRESH_FIXED)
+		flags |= WP_PRESENTATION_FEEDBACK_KIND_VSYNC;
 
-	weston_compositor_read_presentation_clock(output->compositor, &ts);
-	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
+	output->base.msc = output->frame_msc;
+	weston_output_finish_frame(&output->base, &output->frame_ts, flags);
 }
 
 static int
 finish_frame_handler(void *data)
 {
 	struct headless_output *output = data;
-	struct timespec ts;
 
-	weston_compositor_read_presentation_clock(output->base.compositor, &ts);
-	weston_output_finish_frame(&output->base, &ts, 0);
+	headless_output_finish_frame(output);
 
 	return 1;
 }
 
+static void
+finish_frame_idle_handler(void *data)
+{
+	struct headless_output *output = data;
+
+	output->finish_frame_idle = NULL;
+	headless_output_finish_frame(output);
+}
+
+/* Works out when the frame being repainted is shown, and completes it
+ * then. */
+static void
+headless_output_queue_frame(struct headless_output *output)
+{
+	struct wl_event_loop *loop;
+	struct timespec now, earliest;
+	int64_t refresh_nsec, n, delay_nsec;
+
+	weston_compositor_read_presentation_clock(output->base.compositor,
+						  &now);
+
+	output->frame_ts = now;
+	output->frame_msc = output->base.msc + 1;
+
+	switch (output->refresh_mode) {
+	case WESTON_HEADLESS_REFRESH_FIXED:
+		refresh_nsec = millihz_to_nsec(output->mode.refresh);
+		n = timespec_sub_to_nsec(&now, &output->vblank_base) /
+		    refresh_nsec + 1;
+		n = MAX(n, (int64_t) output->frame_msc);
+		timespec_add_nsec(&output->frame_ts, &output->vblank_base,
+				  n * refresh_nsec);
+		output->frame_msc = n;
+		break;
+	case WESTON_HEADLESS_REFRESH_VARIABLE:
+		refresh_nsec = millihz_to_nsec(output->mode.refresh);
+		timespec_add_nsec(&earliest, &output->base.frame_time,
+				  refresh_nsec);
+		if (timespec_sub_to_nsec(&earliest, &now) > 0)
+			output->frame_ts = earliest;
+		break;
+	case WESTON_HEADLESS_REFRESH_FREE_RUNNING:
+		break;
+	}
+
+	delay_nsec = timespec_sub_to_nsec(&output->frame_ts, &now);
+	if (delay_nsec > 0) {
+		/* Round up: the timer must not fire before the vblank. */
+		wl_event_source_timer_update(output->finish_frame_timer,
+					     (delay_nsec + 999999) / 1000000);
+		return;
+	}
+
+	loop = wl_display_get_event_loop(output->base.compositor->wl_display);
+	output->finish_frame_idle =
+		wl_event_loop_add_idle(loop, finish_frame_idle_handler,
+				       output);
+}
+
+/* Copies the rows of the frame rendered by gl-renderer which contain
+ * damage into the output image. */
+static void
+headless_output_read_back(struct headless_output *output,
+			  pixman_region32_t *damage)
+{
+	struct weston_compositor *ec = output->base.compositor;
+	int width = output->base.current_mode->width;
+	int height = output->base.current_mode->height;
+	int stride = width * 4;
+	pixman_region32_t buffer_damage;
+	pixman_box32_t *extents;
+	uint32_t *top, *bottom;
+	int y1, y2;
+
+	pixman_region32_init(&buffer_damage);
+	pixman_region32_intersect(&buffer_damage, damage,
+				  &output->base.region);
+	pixman_region32_translate(&buffer_damage,
+				  -output->base.x, -output->base.y);
+	weston_transformed_region(output->base.width, output->base.height,
+				  output->base.transform,
+				  output->base.current_scale,
+				  &buffer_damage, &buffer_damage);
+	extents = pixman_region32_extents(&buffer_damage);
+	y1 = MAX(extents->y1, 0);
+	y2 = MIN(extents->y2, height);
+	pixman_region32_fini(&buffer_damage);
+
+	if (y1 >= y2)
+		return;
+
+	/* Whole rows land in the image at its own stride in one read;
+	 * GL returns them bottom-up, so flip them in place. */
+	if (ec->renderer->read_pixels(&output->base, PIXMAN_a8r8g8b8,
+				      output->image_buf + y1 * width,
+				      0, height - y2, width, y2 - y1) < 0)
+		return;
+
+	top = output->image_buf + y1 * width;
+	bottom = output->image_buf + (y2 - 1) * width;
+	for (; top < bottom; top += width, bottom -= width) {
+		memcpy(output->row_buf, top, stride);
+		memcpy(top, bottom, stride);
+		memcpy(bottom, output->row_buf, stride);
+	}
+}
+
 static int
 headless_output_repaint(struct weston_output *output_base,
 		       pixman_region32_t *damage,
 		       void *repaint_data)
 {
 	struct headless_output *output = to_headless_output(output_base);
+	struct headless_backend *b = to_headless_backend(output_base->compositor);
 	struct weston_compositor *ec = output->base.compositor;
 
 	ec->renderer->repaint_output(&output->base, damage);
 
+	if (b->use_gl)
+		headless_output_read_back(output, damage);
+
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
 
-	wl_event_source_timer_update(output->finish_frame_timer, 16);
+	headless_output_queue_frame(output);
 
 	return 0;
 }
@@ -118,8 +285,17 @@ headless_output_disable(struct weston_output *base)
 		return 0;
 
 	wl_event_source_remove(output->finish_frame_timer);
+	if (output->finish_frame_idle) {
+		wl_event_source_remove(output->finish_frame_idle);
+		output->finish_frame_idle = NULL;
+	}
 
-	if (b->use_pixman) {
+	if (b->use_gl) {
+		gl_renderer->output_destroy(&output->base);
+		pixman_image_unref(output->image);
+		free(output->image_buf);
+		free(output->row_buf);
+	} else if (b->use_pixman) {
 		pixman_renderer_output_destroy(&output->base);
 		pixman_image_unref(output->image);
 		free(output->image_buf);
@@ -150,7 +326,33 @@ headless_output_enable(struct weston_output *base)
 	output->finish_frame_timer =
 		wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
-	if (b->use_pixman) {
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &output->vblank_base);
+	output->base.msc = 0;
+
+	if (b->use_gl) {
+		output->image_buf = malloc(output->base.current_mode->width *
+					   output->base.current_mode->height * 4);
+		output->row_buf = malloc(output->base.current_mode->width * 4);
+		if (!output->image_buf || !output->row_buf)
+			goto err_malloc_gl;
+
+		output->image = pixman_image_create_bits(PIXMAN_a8r8g8b8,
+							 output->base.current_mode->width,
+							 output->base.current_mode->height,
+							 output->image_buf,
+							 output->base.current_mode->width * 4);
+
+		if (gl_renderer->output_pbuffer_create(&output->base,
+						       output->base.current_mode->width,
+						       output->base.current_mode->height,
+						       gl_renderer->pbuffer_attribs,
+						       NULL, 0) < 0) {
+			weston_log("failed to create gl renderer output state\n");
+			pixman_image_unref(output->image);
+			goto err_malloc_gl;
+		}
+	} else if (b->use_pixman) {
 		output->image_buf = malloc(output->base.current_mode->width *
 					   output->base.current_mode->height * 4);
 		if (!output->image_buf)
@@ -162,7 +364,7 @@ headless_output_enable(struct weston_output *base)
 							 output->image_buf,
 							 output->base.current_mode->width * 4);
 
-		if (pixman_renderer_output_create(&output->base) < 0)
+		if (pixman_renderer_output_create(&output->base, 0) < 0)
 			goto err_renderer;
 
 		pixman_renderer_output_set_buffer(&output->base,
@@ -171,6 +373,13 @@ headless_output_enable(struct weston_output *base)
 
 	return 0;
 
+err_malloc_gl:
+	free(output->row_buf);
+	free(output->image_buf);
+	wl_event_source_remove(output->finish_frame_timer);
+
+	return -1;
+
 err_renderer:
 	pixman_image_unref(output->image);
 	free(output->image_buf);
@@ -200,7 +409,10 @@ headless_output_set_size(struct weston_output *base,
 		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED;
 	output->mode.width = output_width;
 	output->mode.height = output_height;
-	output->mode.refresh = 60000;
+	if (output->refresh_mode == WESTON_HEADLESS_REFRESH_FREE_RUNNING)
+		output->mode.refresh = 0;
+	else
+		output->mode.refresh = output->refresh;
 	wl_list_insert(&output->base.mode_list, &output->mode.link);
 
 	output->base.current_mode = &output->mode;
@@ -221,10 +433,48 @@ headless_output_set_size(struct weston_output *base,
 	return 0;
 }
 
+static int
+headless_output_set_refresh(struct weston_output *base, int refresh,
+			    enum weston_headless_refresh_mode mode)
+{
+	struct headless_output *output = to_headless_output(base);
+	struct headless_backend *b = to_headless_backend(base->compositor);
+
+	/* The mode is made from it when the size is set. */
+	if (output->base.current_mode) {
+		weston_log("Refresh rate of output %s set too late\n",
+			   output->base.name);
+		return -1;
+	}
+
+	if (refresh < 0) {
+		weston_log("Invalid refresh rate %d mHz for output %s\n",
+			   refresh, output->base.name);
+		return -1;
+	}
+
+	output->refresh = refresh ? refresh : b->refresh;
+	output->refresh_mode = mode;
+
+	return 0;
+}
+
+static pixman_image_t *
+headless_output_get_image(struct weston_output *base)
+{
+	struct headless_output *output = to_headless_output(base);
+
+	if (!output->base.enabled)
+		return NULL;
+
+	return output->image;
+}
+
 static int
 headless_output_create(struct weston_compositor *compositor,
 		       const char *name)
 {
+	struct headless_backend *b = to_headless_backend(compositor);
 	struct headless_output *output;
 
 	/* name can't be NULL. */
@@ -236,6 +486,9 @@ headless_output_create(struct weston_compositor *compositor,
 
 	weston_output_init(&output->base, compositor, name);
 
+	output->refresh = b->refresh;
+	output->refresh_mode = b->refresh_mode;
+
 	output->base.destroy = headless_output_destroy;
 	output->base.disable = headless_output_disable;
 	output->base.enable = headless_output_enable;
@@ -260,11 +513,39 @@ headless_destroy(struct weston_compositor *ec)
 	free(b);
 }
 
+static int
+headless_gl_renderer_init(struct headless_backend *b)
+{
+	gl_renderer = weston_load_module("gl-renderer.so",
+					 "gl_renderer_interface");
+	if (!gl_renderer)
+		return -1;
+
+	/* Mesa's surfaceless platform needs neither a window system nor
+	 * a GPU; fall back to the default display without it. */
+	if (gl_renderer->display_create(b->compositor,
+					EGL_PLATFORM_SURFACELESS_MESA,
+					NULL, NULL,
+					gl_renderer->pbuffer_attribs,
+					NULL, 0) == 0)
+		return 0;
+
+	return gl_renderer->display_create(b->compositor, NO_EGL_PLATFORM,
+					   NULL, NULL,
+					   gl_renderer->pbuffer_attribs,
+					   NULL, 0);
+}
+
 static const struct weston_windowed_output_api api = {
 	headless_output_set_size,
 	headless_output_create,
 };
 
+static const struct weston_headless_output_api headless_api = {
+	headless_output_set_refresh,
+	headless_output_get_image,
+};
+
 static struct headless_backend *
 headless_backend_create(struct weston_compositor *compositor,
 			struct weston_headless_backend_config *config)
@@ -285,12 +566,26 @@ headless_backend_create(struct weston_compositor *compositor,
 	b->base.destroy = headless_destroy;
 	b->base.restore = headless_restore;
 
+	b->refresh = config->refresh ? config->refresh : 60000;
+	b->refresh_mode = config->refresh_mode;
+	if (b->refresh < 0) {
+		weston_log("Invalid refresh rate %d mHz\n", b->refresh);
+		goto err_free;
+	}
+
 	b->use_pixman = config->use_pixman;
-	if (b->use_pixman) {
+	b->use_gl = config->use_gl && !b->use_pixman;
+	if (b->use_gl) {
+		if (headless_gl_renderer_init(b) < 0) {
+			weston_log("Failed to initialize the GL renderer\n");
+			goto err_input;
+		}
+	} else if (b->use_pixman) {
 		pixman_renderer_init(compositor);
 	}
 
-	if (!b->use_pixman && noop_renderer_init(compositor) < 0)
+	if (!b->use_pixman && !b->use_gl &&
+	    noop_renderer_init(compositor) < 0)
 		goto err_input;
 
 	ret = weston_plugin_api_register(compositor, WESTON_WINDOWED_OUTPUT_API_NAME,
@@ -301,6 +596,15 @@ headless_backend_create(struct weston_compositor *compositor,
 		goto err_input;
 	}
 
+	ret = weston_plugin_api_register(compositor,
+					 WESTON_HEADLESS_OUTPUT_API_NAME,
+					 &headless_api, sizeof(headless_api));
+
+	if (ret < 0) {
+		weston_log("Failed to register headless output API.\n");
+		goto err_input;
+	}
+
 	return b;
 
 err_input:
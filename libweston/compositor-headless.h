@@ -33,14 +33,77 @@ extern "C" {
 #include <stdint.h>
 
 #include "compositor.h"
+#include "plugin-registry.h"
 
-#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 2
+#define WESTON_HEADLESS_BACKEND_CONFIG_VERSION 4
+
+/** How a headless output paces its frames */
+enum weston_headless_refresh_mode {
+	/** Frames are shown at the virtual vblanks of the refresh rate. */
+	WESTON_HEADLESS_REFRESH_FIXED = 0,
+	/** Frames are shown once repainted, but not more often than the
+	 * refresh rate allows, like a variable refresh rate display. */
+	WESTON_HEADLESS_REFRESH_VARIABLE,
+	/** Frames are shown as soon as they are repainted; the output
+	 * has no refresh rate. Measures the compositor's throughput. */
+	WESTON_HEADLESS_REFRESH_FREE_RUNNING,
+};
+
+#define WESTON_HEADLESS_OUTPUT_API_NAME "weston_headless_output_api_v1"
+
+struct weston_headless_output_api {
+	/** Set the refresh rate of an output
+	 *
+	 * \param output The output to set the refresh rate of.
+	 * \param refresh Refresh rate in mHz, 0 for the backend default;
+	 *                ignored when free-running.
+	 * \param mode How frames are paced.
+	 * \return 0 on success, -1 on failure.
+	 *
+	 * Must be called before the output's size is set. Overrides the
+	 * defaults from weston_headless_backend_config.
+	 */
+	int (*set_refresh)(struct weston_output *output, int refresh,
+			   enum weston_headless_refresh_mode mode);
+
+	/** Get the image the frames of an output end up in
+	 *
+	 * \param output The output to get the image of.
+	 * \return The image, or NULL if the output is not enabled or the
+	 *         backend does not render.
+	 *
+	 * With the GL renderer, the damaged rows of each frame are read
+	 * back into it once the frame is repainted.
+	 */
+	pixman_image_t *(*get_image)(struct weston_output *output);
+};
+
+static inline const struct weston_headless_output_api *
+weston_headless_output_get_api(struct weston_compositor *compositor)
+{
+	const void *api;
+	api = weston_plugin_api_get(compositor, WESTON_HEADLESS_OUTPUT_API_NAME,
+				    sizeof(struct weston_headless_output_api));
+
+	return (const struct weston_headless_output_api *)api;
+}
 
 struct weston_headless_backend_config {
 	struct weston_backend_config base;
 
 	/** Whether to use the pixman renderer instead of the OpenGL ES renderer. */
 	int use_pixman;
+
+	/** Whether to render with the OpenGL ES renderer into offscreen
+	 * pbuffers, read back into memory, instead of not rendering at all;
+	 * use_pixman takes precedence. */
+	int use_gl;
+
+	/** Refresh rate of the outputs in mHz; 0 means 60000. */
+	int refresh;
+
+	/** How the outputs pace their frames. */
+	enum weston_headless_refresh_mode refresh_mode;
 };
 
 #ifdef  __cplusplus
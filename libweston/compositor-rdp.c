@@ -26,11 +26,18 @@
 #include "config.h"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
 #include <linux/input.h>
+#include <linux/sockios.h>
 
 #if HAVE_FREERDP_VERSION_H
 #include <freerdp/version.h>
@@ -85,11 +92,18 @@
 #include "compositor.h"
 #include "compositor-rdp.h"
 #include "pixman-renderer.h"
+#include "tile-hash.h"
 
 #define MAX_FREERDP_FDS 32
 #define DEFAULT_AXIS_STEP_DISTANCE 10
 #define RDP_MODE_FREQ 60 * 1000
 
+/* Bounds of the time between two updates to a peer, in ms */
+#define RDP_FLOW_MIN_INTERVAL 16
+#define RDP_FLOW_MAX_INTERVAL 1000
+/* How often to log the flow control statistics of a peer, in ms */
+#define RDP_FLOW_STATS_PERIOD 10000
+
 #if FREERDP_VERSION_MAJOR >= 2 && defined(PIXEL_FORMAT_BGRA32) && !defined(PIXEL_FORMAT_B8G8R8A8)
 	/* The RDP API is truly wonderful: the pixel format definition changed
 	 * from BGRA32 to B8G8R8A8, but some versions ship with a definition of
@@ -101,6 +115,8 @@
 #endif
 
 struct rdp_output;
+struct rdp_encoder_pool;
+struct rdp_encode_group;
 
 struct rdp_backend {
 	struct weston_backend base;
@@ -115,6 +131,14 @@ struct rdp_backend {
 	char *rdp_key;
 	int tls_enabled;
 	int no_clients_resize;
+	int hash_tiles;
+
+	struct rdp_encoder_pool *encoder_pool;
+	struct rdp_encode_group *encode_groups[2]; /* NSCodec, RemoteFX */
+	uint64_t bytes_encoded;
+	uint64_t bytes_sent;
+	uint64_t area_damaged;	/* in pixels, before and after tile hashing */
+	uint64_t area_updated;
 };
 
 enum peer_item_flags {
@@ -130,23 +154,121 @@ struct rdp_peers_item {
 	struct wl_list link;
 };
 
+/* Worker threads running the RemoteFX and NSCodec encoders. The main
+ * thread copies the damaged part of the shadow surface into the peer's
+ * job, a worker encodes it, and the main thread sends the result from
+ * the event loop. A peer has at most one job in flight; damage repainted
+ * meanwhile is accumulated and encoded as a single update once the job
+ * has been sent, so peers that do not keep up skip intermediate frames.
+ */
+struct rdp_encoder_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int thread_count;
+	bool quit;
+
+	struct wl_list queue;	/* rdp_encode_job::link, protected by mutex */
+	struct wl_list done;	/* rdp_encode_job::link, protected by mutex */
+
+	int done_fd;
+	struct wl_event_source *done_source;
+};
+
+enum rdp_encode_job_state {
+	RDP_ENCODE_IDLE = 0,
+	RDP_ENCODE_QUEUED,
+	RDP_ENCODE_RUNNING,
+	RDP_ENCODE_DONE,
+};
+
+/* Codec state producing one bitstream, either a peer's own or the one
+ * shared by the followers of an encode group. */
+struct rdp_encoder {
+	RFX_CONTEXT *rfx_context;
+	wStream *encode_stream;
+	RFX_RECT *rfx_rects;
+	NSC_CONTEXT *nsc_context;
+};
+
+struct rdp_encode_job {
+	/* Protected by the pool mutex */
+	enum rdp_encode_job_state state;
+	struct wl_list link;
+
+	struct rdp_encoder *encoder;
+	struct rdp_encode_group *group;	/* NULL for a peer's own job */
+
+	/* Owned by the worker while the job is not idle */
+	pixman_region32_t damage;	/* in output coordinates */
+	pixman_image_t *snapshot;	/* damage extents of the shadow */
+	bool use_rfx;
+
+	/* Main thread only */
+	pixman_region32_t pending_damage;
+	void *snapshot_data;
+	size_t snapshot_size;
+};
+
+/* Peers using the same codec share one bitstream: the damage of each
+ * repaint is encoded once by their group and sent to every follower.
+ * A peer only encodes on its own while catching up, after connecting,
+ * being resized or asking for a refresh, and joins the group again
+ * once that update is sent.
+ */
+struct rdp_encode_group {
+	struct rdp_encoder encoder;
+	struct rdp_encode_job job;
+	int width, height;	/* of the encoder contexts */
+	uint32_t seq;		/* of the last update started */
+};
+
 struct rdp_output {
 	struct weston_output base;
 	struct wl_event_source *finish_frame_timer;
 	pixman_image_t *shadow_surface;
+	struct weston_tile_hash *tile_hash;
 
 	struct wl_list peers;
 };
 
+/* Flow control of the updates to a peer. The drain rate of the link is
+ * estimated from how fast the socket send queue empties while there is
+ * a backlog, and caps how often the peer gets an update. Damage
+ * repainted meanwhile is coalesced into the peer's next update.
+ */
+struct rdp_peer_flow {
+	int fd;
+	struct wl_event_source *timer;
+
+	struct timespec last_update;
+	uint64_t bytes_sent;
+	uint32_t update_size;	/* running average, in bytes */
+	uint32_t drain_rate;	/* in bytes per second, 0 until measured */
+	int interval;		/* current minimum time between updates, ms */
+
+	/* The previous sample of the socket send queue */
+	struct timespec sample_time;
+	uint64_t sample_bytes_sent;
+	int sample_queued;
+
+	/* Counted since stats_start */
+	struct timespec stats_start;
+	uint32_t updates_sent;
+	uint32_t frames_coalesced;
+};
+
 struct rdp_peer_context {
 	rdpContext _p;
 
 	struct rdp_backend *rdpBackend;
 	struct wl_event_source *events[MAX_FREERDP_FDS];
-	RFX_CONTEXT *rfx_context;
-	wStream *encode_stream;
-	RFX_RECT *rfx_rects;
-	NSC_CONTEXT *nsc_context;
+	struct rdp_encoder encoder;
+	struct rdp_encode_job encode_job;
+	bool follows_group;
+	uint32_t group_seq;	/* first group update to receive */
+	struct rdp_peer_flow flow;
 
 	struct rdp_peers_item item;
 };
@@ -164,46 +286,82 @@ to_rdp_backend(struct weston_compositor *base)
 	return container_of(base->backend, struct rdp_backend, base);
 }
 
+/* Pointer to the top left corner of the damage in image, whose own top
+ * left corner is at x, y on the output. */
+static BYTE *
+rdp_image_damage_data(pixman_region32_t *damage, pixman_image_t *image,
+		      int x, int y)
+{
+	return (BYTE *)(pixman_image_get_data(image) +
+			(damage->extents.x1 - x) +
+			(damage->extents.y1 - y) *
+			(pixman_image_get_stride(image) / sizeof(uint32_t)));
+}
+
+static int
+rdp_encoder_init(struct rdp_encoder *encoder, int width, int height)
+{
+#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
+	encoder->rfx_context = rfx_context_new();
+#else
+	encoder->rfx_context = rfx_context_new(TRUE);
+#endif
+	if (!encoder->rfx_context)
+		return -1;
+
+	encoder->rfx_context->mode = RLGR3;
+	encoder->rfx_context->width = width;
+	encoder->rfx_context->height = height;
+	rfx_context_set_pixel_format(encoder->rfx_context, DEFAULT_PIXEL_FORMAT);
+
+	encoder->nsc_context = nsc_context_new();
+	if (!encoder->nsc_context)
+		goto out_error_nsc;
+
+	nsc_context_set_pixel_format(encoder->nsc_context, DEFAULT_PIXEL_FORMAT);
+
+	encoder->encode_stream = Stream_New(NULL, 65536);
+	if (!encoder->encode_stream)
+		goto out_error_stream;
+
+	return 0;
+
+out_error_stream:
+	nsc_context_free(encoder->nsc_context);
+out_error_nsc:
+	rfx_context_free(encoder->rfx_context);
+	return -1;
+}
+
 static void
-rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_encoder_release(struct rdp_encoder *encoder)
+{
+	Stream_Free(encoder->encode_stream, TRUE);
+	nsc_context_free(encoder->nsc_context);
+	rfx_context_free(encoder->rfx_context);
+	free(encoder->rfx_rects);
+}
+
+static void
+rdp_encoder_encode_rfx(struct rdp_encoder *encoder, pixman_region32_t *damage,
+		       pixman_image_t *image, int x, int y)
 {
 	int width, height, nrects, i;
 	pixman_box32_t *region, *rects;
-	uint32_t *ptr;
 	RFX_RECT *rfxRect;
-	rdpUpdate *update = peer->update;
-	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
-	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
+	Stream_Clear(encoder->encode_stream);
+	Stream_SetPosition(encoder->encode_stream, 0);
 
 	width = (damage->extents.x2 - damage->extents.x1);
 	height = (damage->extents.y2 - damage->extents.y1);
 
-#ifdef HAVE_SKIP_COMPRESSION
-	cmd->skipCompression = TRUE;
-#else
-	memset(cmd, 0, sizeof(*cmd));
-#endif
-	cmd->destLeft = damage->extents.x1;
-	cmd->destTop = damage->extents.y1;
-	cmd->destRight = damage->extents.x2;
-	cmd->destBottom = damage->extents.y2;
-	cmd->bpp = 32;
-	cmd->codecID = peer->settings->RemoteFxCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
-
 	rects = pixman_region32_rectangles(damage, &nrects);
-	context->rfx_rects = realloc(context->rfx_rects, nrects * sizeof *rfxRect);
+	encoder->rfx_rects = realloc(encoder->rfx_rects, nrects * sizeof *rfxRect);
 
 	for (i = 0; i < nrects; i++) {
 		region = &rects[i];
-		rfxRect = &context->rfx_rects[i];
+		rfxRect = &encoder->rfx_rects[i];
 
 		rfxRect->x = (region->x1 - damage->extents.x1);
 		rfxRect->y = (region->y1 - damage->extents.y1);
@@ -211,33 +369,166 @@ rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 		rfxRect->height = (region->y2 - region->y1);
 	}
 
-	rfx_compose_message(context->rfx_context, context->encode_stream, context->rfx_rects, nrects,
-			(BYTE *)ptr, width, height,
+	rfx_compose_message(encoder->rfx_context, encoder->encode_stream, encoder->rfx_rects, nrects,
+			rdp_image_damage_data(damage, image, x, y), width, height,
 			pixman_image_get_stride(image)
 	);
+}
 
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
+static void
+rdp_encoder_encode_nsc(struct rdp_encoder *encoder, pixman_region32_t *damage,
+		       pixman_image_t *image, int x, int y)
+{
+	int width, height;
 
-	update->SurfaceBits(update->context, cmd);
+	Stream_Clear(encoder->encode_stream);
+	Stream_SetPosition(encoder->encode_stream, 0);
+
+	width = (damage->extents.x2 - damage->extents.x1);
+	height = (damage->extents.y2 - damage->extents.y1);
+
+	nsc_compose_message(encoder->nsc_context, encoder->encode_stream,
+			rdp_image_damage_data(damage, image, x, y),
+			width, height,
+			pixman_image_get_stride(image));
+}
+
+static int
+rdp_peer_flow_queued(RdpPeerContext *context)
+{
+	int queued;
+
+	if (context->flow.fd < 0 ||
+	    ioctl(context->flow.fd, SIOCOUTQ, &queued) < 0)
+		return 0;
+
+	return queued;
+}
+
+/* Refine the drain rate estimate of the peer's link, and the interval
+ * between updates it allows, from how much of what was written to the
+ * socket since the last sample has left it. Returns the length of the
+ * send queue. */
+static int
+rdp_peer_flow_sample(RdpPeerContext *context, const struct timespec *now)
+{
+	struct rdp_peer_flow *flow = &context->flow;
+	int queued = rdp_peer_flow_queued(context);
+	int64_t elapsed, drained, rate;
+
+	elapsed = timespec_sub_to_msec(now, &flow->sample_time);
+	if (elapsed < RDP_FLOW_MIN_INTERVAL)
+		return queued;
+
+	drained = (int64_t)(flow->bytes_sent - flow->sample_bytes_sent) +
+		  flow->sample_queued - queued;
+	rate = MAX(drained, 0) * 1000 / elapsed;
+
+	if (flow->sample_queued > 0 && queued > 0) {
+		/* The link was busy all along, so that is its rate. */
+		flow->drain_rate = flow->drain_rate ?
+				   (flow->drain_rate + rate) / 2 : rate;
+	} else if (queued == 0 && flow->drain_rate) {
+		/* The link kept up, and may be faster than measured. */
+		flow->drain_rate = MIN(MAX(flow->drain_rate +
+					   flow->drain_rate / 8, rate),
+				       1u << 30);
+	}
+
+	if (flow->drain_rate)
+		flow->interval = (uint64_t)flow->update_size * 1000 /
+				 flow->drain_rate;
+	flow->interval = MIN(MAX(flow->interval, RDP_FLOW_MIN_INTERVAL),
+			     RDP_FLOW_MAX_INTERVAL);
+
+	flow->sample_time = *now;
+	flow->sample_bytes_sent = flow->bytes_sent;
+	flow->sample_queued = queued;
+
+	return queued;
 }
 
+/* Whether the peer's link can take an update now. If not, *delay is set
+ * to the time in ms after which to ask again. */
+static bool
+rdp_peer_flow_ready(RdpPeerContext *context, int *delay)
+{
+	struct rdp_peer_flow *flow = &context->flow;
+	struct timespec now;
+	int64_t elapsed;
+	int queued;
+
+	weston_compositor_read_presentation_clock(context->rdpBackend->compositor,
+						  &now);
+	queued = rdp_peer_flow_sample(context, &now);
+
+	elapsed = timespec_sub_to_msec(&now, &flow->last_update);
+	if (elapsed < flow->interval) {
+		*delay = flow->interval - elapsed;
+		return false;
+	}
+
+	/* Don't queue an update behind more than one the link has not
+	 * taken yet; that only adds latency. */
+	if (queued > (int)flow->update_size) {
+		if (flow->drain_rate)
+			*delay = MAX((int64_t)(queued - flow->update_size) *
+				     1000 / flow->drain_rate, 1);
+		else
+			*delay = RDP_FLOW_MIN_INTERVAL;
+		return false;
+	}
+
+	return true;
+}
 
 static void
-rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+rdp_peer_flow_account(RdpPeerContext *context, uint32_t bytes)
+{
+	context->flow.bytes_sent += bytes;
+	context->rdpBackend->bytes_sent += bytes;
+}
+
+/* Note that an update of size bytes went out to the peer. */
+static void
+rdp_peer_flow_update_sent(RdpPeerContext *context, uint32_t size)
+{
+	struct rdp_peer_flow *flow = &context->flow;
+	struct timespec now;
+
+	weston_compositor_read_presentation_clock(context->rdpBackend->compositor,
+						  &now);
+
+	flow->update_size = flow->update_size ?
+			    (flow->update_size * 7 + size) / 8 : size;
+	flow->last_update = now;
+	flow->updates_sent++;
+
+	if (timespec_sub_to_msec(&now, &flow->stats_start) <
+	    RDP_FLOW_STATS_PERIOD)
+		return;
+
+	if (flow->frames_coalesced)
+		weston_log("RDP peer @%s: %u updates, %u frames coalesced, "
+			   "link drains %u KiB/s, %d ms between updates\n",
+			   context->item.peer->settings->ClientAddress,
+			   flow->updates_sent, flow->frames_coalesced,
+			   flow->drain_rate / 1024, flow->interval);
+
+	flow->stats_start = now;
+	flow->updates_sent = 0;
+	flow->frames_coalesced = 0;
+}
+
+/* Send stream, holding damage encoded with codecID, to the peer. */
+static void
+rdp_peer_send_surface_bits(pixman_region32_t *damage, UINT32 codecID,
+			   wStream *stream, freerdp_peer *peer)
 {
-	int width, height;
-	uint32_t *ptr;
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 
-	Stream_Clear(context->encode_stream);
-	Stream_SetPosition(context->encode_stream, 0);
-
-	width = (damage->extents.x2 - damage->extents.x1);
-	height = (damage->extents.y2 - damage->extents.y1);
-
 #ifdef HAVE_SKIP_COMPRESSION
 	cmd->skipCompression = TRUE;
 #else
@@ -248,19 +539,40 @@ rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_p
 	cmd->destRight = damage->extents.x2;
 	cmd->destBottom = damage->extents.y2;
 	cmd->bpp = 32;
-	cmd->codecID = peer->settings->NSCodecId;
-	cmd->width = width;
-	cmd->height = height;
-
-	ptr = pixman_image_get_data(image) + damage->extents.x1 +
-				damage->extents.y1 * (pixman_image_get_stride(image) / sizeof(uint32_t));
+	cmd->codecID = codecID;
+	cmd->width = (damage->extents.x2 - damage->extents.x1);
+	cmd->height = (damage->extents.y2 - damage->extents.y1);
+	cmd->bitmapDataLength = Stream_GetPosition(stream);
+	cmd->bitmapData = Stream_Buffer(stream);
 
-	nsc_compose_message(context->nsc_context, context->encode_stream, (BYTE *)ptr,
-			cmd->width,	cmd->height,
-			pixman_image_get_stride(image));
-	cmd->bitmapDataLength = Stream_GetPosition(context->encode_stream);
-	cmd->bitmapData = Stream_Buffer(context->encode_stream);
 	update->SurfaceBits(update->context, cmd);
+
+	rdp_peer_flow_account(context, cmd->bitmapDataLength);
+	rdp_peer_flow_update_sent(context, cmd->bitmapDataLength);
+}
+
+static void
+rdp_peer_refresh_rfx(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	wStream *stream = context->encoder.encode_stream;
+
+	rdp_encoder_encode_rfx(&context->encoder, damage, image, 0, 0);
+	context->rdpBackend->bytes_encoded += Stream_GetPosition(stream);
+	rdp_peer_send_surface_bits(damage, peer->settings->RemoteFxCodecId,
+				   stream, peer);
+}
+
+static void
+rdp_peer_refresh_nsc(pixman_region32_t *damage, pixman_image_t *image, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	wStream *stream = context->encoder.encode_stream;
+
+	rdp_encoder_encode_nsc(&context->encoder, damage, image, 0, 0);
+	context->rdpBackend->bytes_encoded += Stream_GetPosition(stream);
+	rdp_peer_send_surface_bits(damage, peer->settings->NSCodecId,
+				   stream, peer);
 }
 
 static void
@@ -283,9 +595,11 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 	rdpUpdate *update = peer->update;
 	SURFACE_BITS_COMMAND *cmd = &update->surface_bits_command;
 	SURFACE_FRAME_MARKER *marker = &update->surface_frame_marker;
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	pixman_box32_t *rect, subrect;
 	int nrects, i;
 	int heightIncrement, remainingHeight, top;
+	uint32_t size = 0;
 
 	rect = pixman_region32_rectangles(region, &nrects);
 	if (!nrects)
@@ -325,6 +639,8 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 
 			   /*weston_log("*  sending (%d,%d, %d,%d)\n", subrect.x1, subrect.y1, subrect.x2, subrect.y2); */
 			   update->SurfaceBits(peer->context, cmd);
+			   rdp_peer_flow_account(context, cmd->bitmapDataLength);
+			   size += cmd->bitmapDataLength;
 
 			   remainingHeight -= cmd->height;
 			   top += cmd->height;
@@ -333,10 +649,13 @@ rdp_peer_refresh_raw(pixman_region32_t *region, pixman_image_t *image, freerdp_p
 
 	marker->frameAction = SURFACECMD_FRAMEACTION_END;
 	update->SurfaceFrameMarker(peer->context, marker);
+
+	rdp_peer_flow_update_sent(context, size);
 }
 
+/* Encode and send region to the peer right away. */
 static void
-rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+rdp_peer_refresh_now(pixman_region32_t *region, freerdp_peer *peer)
 {
 	RdpPeerContext *context = (RdpPeerContext *)peer->context;
 	struct rdp_output *output = context->rdpBackend->output;
@@ -350,6 +669,581 @@ rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
 		rdp_peer_refresh_raw(region, output->shadow_surface, peer);
 }
 
+static void
+rdp_encode_job_run(struct rdp_encode_job *job)
+{
+	pixman_box32_t *extents = &job->damage.extents;
+
+	if (job->use_rfx)
+		rdp_encoder_encode_rfx(job->encoder, &job->damage, job->snapshot,
+				       extents->x1, extents->y1);
+	else
+		rdp_encoder_encode_nsc(job->encoder, &job->damage, job->snapshot,
+				       extents->x1, extents->y1);
+}
+
+static enum rdp_encode_job_state
+rdp_encode_job_get_state(struct rdp_encoder_pool *pool,
+			 struct rdp_encode_job *job)
+{
+	enum rdp_encode_job_state state;
+
+	pthread_mutex_lock(&pool->mutex);
+	state = job->state;
+	pthread_mutex_unlock(&pool->mutex);
+
+	return state;
+}
+
+/* Copy the pending damage of the job out of the shadow surface and hand
+ * it to the encoder pool. */
+static void
+rdp_encode_job_start(struct rdp_backend *b, struct rdp_encode_job *job)
+{
+	struct rdp_encoder_pool *pool = b->encoder_pool;
+	pixman_box32_t *extents;
+	int width, height, stride;
+	void *data;
+
+	extents = pixman_region32_extents(&job->pending_damage);
+	width = extents->x2 - extents->x1;
+	height = extents->y2 - extents->y1;
+	stride = width * 4;
+
+	if ((size_t)stride * height > job->snapshot_size) {
+		data = realloc(job->snapshot_data, (size_t)stride * height);
+		if (!data) {
+			weston_log("failed to allocate an RDP encoder snapshot\n");
+			return;
+		}
+		job->snapshot_data = data;
+		job->snapshot_size = (size_t)stride * height;
+	}
+
+	/* The NSCodec encodes the whole extents, so copy all of them. */
+	job->snapshot = pixman_image_create_bits(PIXMAN_x8r8g8b8,
+						 width, height,
+						 job->snapshot_data, stride);
+	if (!job->snapshot)
+		return;
+
+	pixman_image_composite32(PIXMAN_OP_SRC, b->output->shadow_surface,
+				 NULL, job->snapshot,
+				 extents->x1, extents->y1, 0, 0, 0, 0,
+				 width, height);
+
+	pixman_region32_copy(&job->damage, &job->pending_damage);
+	pixman_region32_clear(&job->pending_damage);
+
+	pthread_mutex_lock(&pool->mutex);
+	job->state = RDP_ENCODE_QUEUED;
+	wl_list_insert(pool->queue.prev, &job->link);
+	pthread_cond_signal(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Take the job back from the encoder pool, waiting for it if it is being
+ * encoded, and put its damage back into the pending damage. */
+static void
+rdp_encode_job_cancel(struct rdp_encoder_pool *pool, struct rdp_encode_job *job)
+{
+	pthread_mutex_lock(&pool->mutex);
+	while (job->state == RDP_ENCODE_RUNNING)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	if (job->state == RDP_ENCODE_IDLE) {
+		pthread_mutex_unlock(&pool->mutex);
+		return;
+	}
+
+	wl_list_remove(&job->link);
+	job->state = RDP_ENCODE_IDLE;
+	pthread_mutex_unlock(&pool->mutex);
+
+	pixman_region32_union(&job->pending_damage,
+			      &job->pending_damage, &job->damage);
+	pixman_image_unref(job->snapshot);
+	job->snapshot = NULL;
+}
+
+static void
+rdp_encode_job_init(struct rdp_encode_job *job, struct rdp_encoder *encoder,
+		    struct rdp_encode_group *group)
+{
+	job->encoder = encoder;
+	job->group = group;
+	pixman_region32_init(&job->damage);
+	pixman_region32_init(&job->pending_damage);
+}
+
+static void
+rdp_encode_job_release(struct rdp_encode_job *job)
+{
+	if (job->snapshot)
+		pixman_image_unref(job->snapshot);
+	pixman_region32_fini(&job->damage);
+	pixman_region32_fini(&job->pending_damage);
+	free(job->snapshot_data);
+}
+
+static bool
+rdp_peer_is_enabled(RdpPeerContext *context)
+{
+	int flags = RDP_PEER_ACTIVATED | RDP_PEER_OUTPUT_ENABLED;
+
+	return (context->item.flags & flags) == flags;
+}
+
+static struct rdp_encode_group *
+rdp_peer_get_group(RdpPeerContext *context)
+{
+	rdpSettings *settings = context->item.peer->settings;
+
+	return context->rdpBackend->encode_groups[settings->RemoteFxCodec ? 1 : 0];
+}
+
+static UINT32
+rdp_peer_get_codec_id(RdpPeerContext *context, bool use_rfx)
+{
+	rdpSettings *settings = context->item.peer->settings;
+
+	return use_rfx ? settings->RemoteFxCodecId : settings->NSCodecId;
+}
+
+static bool
+rdp_encode_group_has_followers(struct rdp_backend *b,
+			       struct rdp_encode_group *group)
+{
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+
+	wl_list_for_each(item, &b->output->peers, link) {
+		context = container_of(item, RdpPeerContext, item);
+		if (context->follows_group && rdp_peer_is_enabled(context) &&
+		    rdp_peer_get_group(context) == group)
+			return true;
+	}
+
+	return false;
+}
+
+static void
+rdp_encode_group_start(struct rdp_backend *b, struct rdp_encode_group *group)
+{
+	struct weston_output *output = &b->output->base;
+
+	/* The group is idle, so its contexts are not in use. */
+	if (group->width != output->width || group->height != output->height) {
+		RFX_RESET(group->encoder.rfx_context, output->width, output->height);
+		NSC_RESET(group->encoder.nsc_context, output->width, output->height);
+		group->width = output->width;
+		group->height = output->height;
+	}
+
+	group->seq++;
+	rdp_encode_job_start(b, &group->job);
+}
+
+/* Add region to the next update of the group, and start encoding it
+ * unless the previous one is still in flight. */
+static void
+rdp_encode_group_queue(struct rdp_backend *b, struct rdp_encode_group *group,
+		       pixman_region32_t *region)
+{
+	struct rdp_encode_job *job = &group->job;
+
+	pixman_region32_union(&job->pending_damage,
+			      &job->pending_damage, region);
+
+	if (pixman_region32_not_empty(&job->pending_damage) &&
+	    rdp_encode_job_get_state(b->encoder_pool, job) == RDP_ENCODE_IDLE)
+		rdp_encode_group_start(b, group);
+}
+
+/* Hand the peer over to its group. What it still misses goes out with
+ * the group's next update, to all followers. */
+static void
+rdp_peer_join_group(RdpPeerContext *context)
+{
+	struct rdp_encode_group *group = rdp_peer_get_group(context);
+	struct rdp_encode_job *job = &context->encode_job;
+
+	context->follows_group = true;
+	context->group_seq = group->seq + 1;
+
+	rdp_encode_group_queue(context->rdpBackend, group, &job->pending_damage);
+	pixman_region32_clear(&job->pending_damage);
+}
+
+/* Take the peer out of its group, keeping whatever the group still owes
+ * it as the peer's own pending damage. */
+static void
+rdp_peer_leave_group(RdpPeerContext *context)
+{
+	struct rdp_backend *b = context->rdpBackend;
+	struct rdp_encode_group *group;
+	struct rdp_encode_job *job = &context->encode_job;
+
+	if (!context->follows_group)
+		return;
+
+	context->follows_group = false;
+	group = rdp_peer_get_group(context);
+
+	pixman_region32_union(&job->pending_damage, &job->pending_damage,
+			      &group->job.pending_damage);
+
+	/* Workers only ever read the damage of a job. */
+	if (rdp_encode_job_get_state(b->encoder_pool, &group->job) != RDP_ENCODE_IDLE &&
+	    (int32_t)(group->seq - context->group_seq) >= 0)
+		pixman_region32_union(&job->pending_damage,
+				      &job->pending_damage,
+				      &group->job.damage);
+}
+
+static void
+rdp_encode_group_deliver(struct rdp_backend *b, struct rdp_encode_group *group)
+{
+	struct rdp_encode_job *job = &group->job;
+	struct rdp_peers_item *item;
+	RdpPeerContext *context;
+	int delay;
+
+	wl_list_for_each(item, &b->output->peers, link) {
+		context = container_of(item, RdpPeerContext, item);
+		if (!context->follows_group || !rdp_peer_is_enabled(context) ||
+		    rdp_peer_get_group(context) != group)
+			continue;
+
+		/* Peers that joined after this update was started may
+		 * already have newer content. */
+		if ((int32_t)(group->seq - context->group_seq) < 0)
+			continue;
+
+		/* A peer whose link is behind gets this update coalesced
+		 * into its own next one. */
+		if (!rdp_peer_flow_ready(context, &delay)) {
+			rdp_peer_leave_group(context);
+			pixman_region32_union(&context->encode_job.pending_damage,
+					      &context->encode_job.pending_damage,
+					      &job->damage);
+			context->flow.frames_coalesced++;
+			wl_event_source_timer_update(context->flow.timer, delay);
+			continue;
+		}
+
+		rdp_peer_send_surface_bits(&job->damage,
+					   rdp_peer_get_codec_id(context, job->use_rfx),
+					   group->encoder.encode_stream,
+					   item->peer);
+	}
+
+	if (!rdp_encode_group_has_followers(b, group))
+		pixman_region32_clear(&job->pending_damage);
+	else if (pixman_region32_not_empty(&job->pending_damage))
+		rdp_encode_group_start(b, group);
+}
+
+static void
+rdp_encode_group_destroy(struct rdp_encode_group *group)
+{
+	rdp_encode_job_release(&group->job);
+	rdp_encoder_release(&group->encoder);
+	free(group);
+}
+
+static struct rdp_encode_group *
+rdp_encode_group_create(bool use_rfx)
+{
+	struct rdp_encode_group *group;
+
+	group = zalloc(sizeof *group);
+	if (!group)
+		return NULL;
+
+	/* The contexts are sized when the first update is started. */
+	if (rdp_encoder_init(&group->encoder, 0, 0) < 0) {
+		free(group);
+		return NULL;
+	}
+
+	rdp_encode_job_init(&group->job, &group->encoder, group);
+	group->job.use_rfx = use_rfx;
+
+	return group;
+}
+
+static void
+rdp_encode_groups_destroy(struct rdp_backend *b)
+{
+	unsigned int i;
+
+	for (i = 0; i < ARRAY_LENGTH(b->encode_groups); i++)
+		if (b->encode_groups[i])
+			rdp_encode_group_destroy(b->encode_groups[i]);
+}
+
+/* Send the pending damage of the peer if its link can take an update
+ * now, encoding it on the pool if there is one, or try again once the
+ * link should be able to. */
+static void
+rdp_peer_flush(RdpPeerContext *context)
+{
+	struct rdp_backend *b = context->rdpBackend;
+	struct rdp_encode_job *job = &context->encode_job;
+	rdpSettings *settings = context->item.peer->settings;
+	bool use_pool;
+	int delay;
+
+	/* A peer that is not activated yet or suppressed its output gets
+	 * a full refresh once it is enabled. */
+	if (!rdp_peer_is_enabled(context)) {
+		pixman_region32_clear(&job->pending_damage);
+		return;
+	}
+
+	if (!pixman_region32_not_empty(&job->pending_damage))
+		return;
+
+	use_pool = b->encoder_pool &&
+		   (settings->RemoteFxCodec || settings->NSCodec);
+
+	/* The pending damage goes out once the update in flight is sent. */
+	if (use_pool &&
+	    rdp_encode_job_get_state(b->encoder_pool, job) != RDP_ENCODE_IDLE)
+		return;
+
+	if (!rdp_peer_flow_ready(context, &delay)) {
+		wl_event_source_timer_update(context->flow.timer, delay);
+		return;
+	}
+
+	if (use_pool) {
+		job->use_rfx = settings->RemoteFxCodec;
+		rdp_encode_job_start(b, job);
+	} else {
+		rdp_peer_refresh_now(&job->pending_damage, context->item.peer);
+		pixman_region32_clear(&job->pending_damage);
+	}
+}
+
+static int
+rdp_peer_flow_timer(void *data)
+{
+	rdp_peer_flush(data);
+
+	return 0;
+}
+
+static void
+rdp_peer_cancel_encode(RdpPeerContext *context)
+{
+	struct rdp_encoder_pool *pool = context->rdpBackend->encoder_pool;
+
+	if (pool)
+		rdp_encode_job_cancel(pool, &context->encode_job);
+}
+
+static void
+rdp_peer_deliver(RdpPeerContext *context)
+{
+	struct rdp_encode_job *job = &context->encode_job;
+
+	/* The peer asks for a refresh when it enables its output again. */
+	if (!rdp_peer_is_enabled(context)) {
+		pixman_region32_clear(&job->pending_damage);
+		return;
+	}
+
+	rdp_peer_send_surface_bits(&job->damage,
+				   rdp_peer_get_codec_id(context, job->use_rfx),
+				   context->encoder.encode_stream,
+				   context->item.peer);
+
+	/* Caught up, but for what was repainted while encoding. */
+	if (rdp_peer_get_group(context))
+		rdp_peer_join_group(context);
+	else
+		rdp_peer_flush(context);
+}
+
+static void
+rdp_encode_job_deliver(struct rdp_backend *b, struct rdp_encode_job *job)
+{
+	pixman_image_unref(job->snapshot);
+	job->snapshot = NULL;
+
+	b->bytes_encoded += Stream_GetPosition(job->encoder->encode_stream);
+
+	if (job->group)
+		rdp_encode_group_deliver(b, job->group);
+	else
+		rdp_peer_deliver(container_of(job, RdpPeerContext, encode_job));
+}
+
+static int
+rdp_encoder_pool_done(int fd, uint32_t mask, void *data)
+{
+	struct rdp_backend *b = data;
+	struct rdp_encoder_pool *pool = b->encoder_pool;
+	struct rdp_encode_job *job;
+	eventfd_t count;
+
+	eventfd_read(fd, &count);
+
+	for (;;) {
+		pthread_mutex_lock(&pool->mutex);
+		if (wl_list_empty(&pool->done)) {
+			pthread_mutex_unlock(&pool->mutex);
+			break;
+		}
+
+		job = container_of(pool->done.next, struct rdp_encode_job, link);
+		wl_list_remove(&job->link);
+		job->state = RDP_ENCODE_IDLE;
+		pthread_mutex_unlock(&pool->mutex);
+
+		rdp_encode_job_deliver(b, job);
+	}
+
+	return 0;
+}
+
+static void *
+rdp_encoder_thread(void *data)
+{
+	struct rdp_encoder_pool *pool = data;
+	struct rdp_encode_job *job;
+
+	pthread_mutex_lock(&pool->mutex);
+
+	while (!pool->quit) {
+		if (wl_list_empty(&pool->queue)) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+			continue;
+		}
+
+		job = container_of(pool->queue.next, struct rdp_encode_job, link);
+		wl_list_remove(&job->link);
+		job->state = RDP_ENCODE_RUNNING;
+		pthread_mutex_unlock(&pool->mutex);
+
+		rdp_encode_job_run(job);
+
+		pthread_mutex_lock(&pool->mutex);
+		job->state = RDP_ENCODE_DONE;
+		wl_list_insert(pool->done.prev, &job->link);
+		pthread_cond_broadcast(&pool->done_cond);
+		eventfd_write(pool->done_fd, 1);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+rdp_encoder_pool_destroy(struct rdp_encoder_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	if (pool->done_source)
+		wl_event_source_remove(pool->done_source);
+	if (pool->done_fd >= 0)
+		close(pool->done_fd);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+static struct rdp_encoder_pool *
+rdp_encoder_pool_create(struct rdp_backend *b, int thread_count)
+{
+	struct rdp_encoder_pool *pool;
+	struct wl_event_loop *loop;
+	sigset_t mask, old_mask;
+	int i;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = zalloc(thread_count * sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+	wl_list_init(&pool->queue);
+	wl_list_init(&pool->done);
+
+	pool->done_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (pool->done_fd < 0)
+		goto err;
+
+	loop = wl_display_get_event_loop(b->compositor->wl_display);
+	pool->done_source = wl_event_loop_add_fd(loop, pool->done_fd,
+						 WL_EVENT_READABLE,
+						 rdp_encoder_pool_done, b);
+	if (!pool->done_source)
+		goto err;
+
+	/* Leave asynchronous signals to the main thread's event loop. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	for (i = 0; i < thread_count; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   rdp_encoder_thread, pool) != 0)
+			break;
+		pool->thread_count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (pool->thread_count == 0)
+		goto err;
+
+	return pool;
+
+err:
+	rdp_encoder_pool_destroy(pool);
+	return NULL;
+}
+
+static void
+rdp_peer_refresh_region(pixman_region32_t *region, freerdp_peer *peer)
+{
+	RdpPeerContext *context = (RdpPeerContext *)peer->context;
+	struct rdp_encode_job *job = &context->encode_job;
+
+	rdp_peer_leave_group(context);
+	pixman_region32_union(&job->pending_damage,
+			      &job->pending_damage, region);
+	rdp_peer_flush(context);
+
+	if (pixman_region32_not_empty(&job->pending_damage))
+		context->flow.frames_coalesced++;
+}
+
 static void
 rdp_output_start_repaint_loop(struct weston_output *output)
 {
@@ -359,26 +1253,69 @@ rdp_output_start_repaint_loop(struct weston_output *output)
 	weston_output_finish_frame(output, &ts, WP_PRESENTATION_FEEDBACK_INVALID);
 }
 
+static uint64_t
+rdp_region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *rects;
+	uint64_t area = 0;
+	int i, nrects;
+
+	rects = pixman_region32_rectangles(region, &nrects);
+	for (i = 0; i < nrects; i++)
+		area += (uint64_t)(rects[i].x2 - rects[i].x1) *
+			(rects[i].y2 - rects[i].y1);
+
+	return area;
+}
+
 static int
 rdp_output_repaint(struct weston_output *output_base, pixman_region32_t *damage,
 		   void *repaint_data)
 {
 	struct rdp_output *output = container_of(output_base, struct rdp_output, base);
 	struct weston_compositor *ec = output->base.compositor;
+	struct rdp_backend *b = to_rdp_backend(ec);
 	struct rdp_peers_item *outputPeer;
+	struct rdp_encode_group *group;
+	pixman_region32_t update;
+	unsigned int i;
 
 	pixman_renderer_output_set_buffer(output_base, output->shadow_surface);
 	ec->renderer->repaint_output(&output->base, damage);
 
-	if (pixman_region32_not_empty(damage)) {
+	/* Peers only get the tiles whose content changed; the whole damage
+	 * is still repainted and cleared from the primary plane. */
+	pixman_region32_init(&update);
+	pixman_region32_copy(&update, damage);
+	if (output->tile_hash) {
+		b->area_damaged += rdp_region_area(&update);
+		weston_tile_hash_refine(output->tile_hash,
+					output->shadow_surface, &update);
+		b->area_updated += rdp_region_area(&update);
+	}
+
+	if (pixman_region32_not_empty(&update)) {
 		wl_list_for_each(outputPeer, &output->peers, link) {
+			RdpPeerContext *context = (RdpPeerContext *)outputPeer->peer->context;
+
+			/* followers get the damage from their group below */
+			if (context->follows_group)
+				continue;
+
 			if ((outputPeer->flags & RDP_PEER_ACTIVATED) &&
 					(outputPeer->flags & RDP_PEER_OUTPUT_ENABLED))
 			{
-				rdp_peer_refresh_region(damage, outputPeer->peer);
+				rdp_peer_refresh_region(&update, outputPeer->peer);
 			}
 		}
+
+		for (i = 0; i < ARRAY_LENGTH(b->encode_groups); i++) {
+			group = b->encode_groups[i];
+			if (group && rdp_encode_group_has_followers(b, group))
+				rdp_encode_group_queue(b, group, &update);
+		}
 	}
+	pixman_region32_fini(&update);
 
 	pixman_region32_subtract(&ec->primary_plane.damage,
 				 &ec->primary_plane.damage, damage);
@@ -450,7 +1387,7 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	output->current_mode->flags |= WL_OUTPUT_MODE_CURRENT;
 
 	pixman_renderer_output_destroy(output);
-	pixman_renderer_output_create(output);
+	pixman_renderer_output_create(output, 0);
 
 	new_shadow_buffer = pixman_image_create_bits(PIXMAN_x8r8g8b8, target_mode->width,
 			target_mode->height, 0, target_mode->width * 4);
@@ -459,6 +1396,14 @@ rdp_switch_mode(struct weston_output *output, struct weston_mode *target_mode)
 	pixman_image_unref(rdpOutput->shadow_surface);
 	rdpOutput->shadow_surface = new_shadow_buffer;
 
+	if (rdpOutput->tile_hash) {
+		weston_tile_hash_destroy(rdpOutput->tile_hash);
+		rdpOutput->tile_hash = weston_tile_hash_create(target_mode->width,
+							       target_mode->height);
+		if (!rdpOutput->tile_hash)
+			weston_log("Failed to create tile hash, sending all damage.\n");
+	}
+
 	wl_list_for_each(rdpPeer, &rdpOutput->peers, link) {
 		settings = rdpPeer->peer->settings;
 		if (settings->DesktopWidth == (UINT32)target_mode->width &&
@@ -534,11 +1479,18 @@ rdp_output_enable(struct weston_output *base)
 		return -1;
 	}
 
-	if (pixman_renderer_output_create(&output->base) < 0) {
+	if (pixman_renderer_output_create(&output->base, 0) < 0) {
 		pixman_image_unref(output->shadow_surface);
 		return -1;
 	}
 
+	if (b->hash_tiles) {
+		output->tile_hash = weston_tile_hash_create(output->base.current_mode->width,
+							    output->base.current_mode->height);
+		if (!output->tile_hash)
+			weston_log("Failed to create tile hash, sending all damage.\n");
+	}
+
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
 	output->finish_frame_timer = wl_event_loop_add_timer(loop, finish_frame_handler, output);
 
@@ -559,6 +1511,11 @@ rdp_output_disable(struct weston_output *base)
 	pixman_image_unref(output->shadow_surface);
 	pixman_renderer_output_destroy(&output->base);
 
+	if (output->tile_hash) {
+		weston_tile_hash_destroy(output->tile_hash);
+		output->tile_hash = NULL;
+	}
+
 	wl_event_source_remove(output->finish_frame_timer);
 	b->output = NULL;
 
@@ -614,6 +1571,10 @@ rdp_destroy(struct weston_compositor *ec)
 
 	freerdp_listener_free(b->listener);
 
+	if (b->encoder_pool)
+		rdp_encoder_pool_destroy(b->encoder_pool);
+	rdp_encode_groups_destroy(b);
+
 	free(b->server_cert);
 	free(b->server_key);
 	free(b->rdp_key);
@@ -665,38 +1626,18 @@ rdp_peer_context_new(freerdp_peer* client, RdpPeerContext* context)
 {
 	context->item.peer = client;
 	context->item.flags = RDP_PEER_OUTPUT_ENABLED;
+	context->flow.fd = -1;
+	context->flow.interval = RDP_FLOW_MIN_INTERVAL;
 
-#if FREERDP_VERSION_MAJOR == 1 && FREERDP_VERSION_MINOR == 1
-	context->rfx_context = rfx_context_new();
-#else
-	context->rfx_context = rfx_context_new(TRUE);
-#endif
-	if (!context->rfx_context) {
+	if (rdp_encoder_init(&context->encoder,
+			     client->settings->DesktopWidth,
+			     client->settings->DesktopHeight) < 0) {
 		FREERDP_CB_RETURN(FALSE);
 	}
 
-	context->rfx_context->mode = RLGR3;
-	context->rfx_context->width = client->settings->DesktopWidth;
-	context->rfx_context->height = client->settings->DesktopHeight;
-	rfx_context_set_pixel_format(context->rfx_context, DEFAULT_PIXEL_FORMAT);
-
-	context->nsc_context = nsc_context_new();
-	if (!context->nsc_context)
-		goto out_error_nsc;
-
-	nsc_context_set_pixel_format(context->nsc_context, DEFAULT_PIXEL_FORMAT);
-
-	context->encode_stream = Stream_New(NULL, 65536);
-	if (!context->encode_stream)
-		goto out_error_stream;
+	rdp_encode_job_init(&context->encode_job, &context->encoder, NULL);
 
 	FREERDP_CB_RETURN(TRUE);
-
-out_error_nsc:
-	rfx_context_free(context->rfx_context);
-out_error_stream:
-	nsc_context_free(context->nsc_context);
-	FREERDP_CB_RETURN(FALSE);
 }
 
 static void
@@ -719,10 +1660,22 @@ rdp_peer_context_free(freerdp_peer* client, RdpPeerContext* context)
 		 * but it would crash on reconnect */
 	}
 
-	Stream_Free(context->encode_stream, TRUE);
-	nsc_context_free(context->nsc_context);
-	rfx_context_free(context->rfx_context);
-	free(context->rfx_rects);
+	if (context->flow.timer)
+		wl_event_source_remove(context->flow.timer);
+
+	rdp_peer_cancel_encode(context);
+	rdp_encode_job_release(&context->encode_job);
+	rdp_encoder_release(&context->encoder);
+
+	weston_log("RDP peer gone, %" PRIu64 " bytes encoded and %" PRIu64
+		   " bytes sent since startup\n",
+		   context->rdpBackend->bytes_encoded,
+		   context->rdpBackend->bytes_sent);
+	if (context->rdpBackend->area_damaged)
+		weston_log("RDP tile hashing sent %" PRIu64 " of %" PRIu64
+			   " damaged pixels\n",
+			   context->rdpBackend->area_updated,
+			   context->rdpBackend->area_damaged);
 }
 
 
@@ -945,8 +1898,16 @@ xf_peer_activate(freerdp_peer* client)
 	}
 
 	weston_output = &output->base;
-	RFX_RESET(peerCtx->rfx_context, weston_output->width, weston_output->height);
-	NSC_RESET(peerCtx->nsc_context, weston_output->width, weston_output->height);
+
+	/* Don't send an update encoded for the previous size. */
+	rdp_peer_leave_group(peerCtx);
+	rdp_peer_cancel_encode(peerCtx);
+	pixman_region32_intersect_rect(&peerCtx->encode_job.pending_damage,
+				       &peerCtx->encode_job.pending_damage,
+				       0, 0, weston_output->width,
+				       weston_output->height);
+	RFX_RESET(peerCtx->encoder.rfx_context, weston_output->width, weston_output->height);
+	NSC_RESET(peerCtx->encoder.nsc_context, weston_output->width, weston_output->height);
 
 	if (peersItem->flags & RDP_PEER_ACTIVATED)
 		return TRUE;
@@ -1181,11 +2142,29 @@ static FREERDP_CB_RET_TYPE
 xf_suppress_output(rdpContext *context, BYTE allow, const RECTANGLE_16 *area)
 {
 	RdpPeerContext *peerContext = (RdpPeerContext *)context;
+	struct weston_output *output = &peerContext->rdpBackend->output->base;
+	pixman_region32_t damage;
+
+	if (allow) {
+		if (peerContext->item.flags & RDP_PEER_OUTPUT_ENABLED)
+			FREERDP_CB_RETURN(TRUE);
 
-	if (allow)
 		peerContext->item.flags |= RDP_PEER_OUTPUT_ENABLED;
-	else
+
+		/* nothing was sent while suppressed, send a full refresh */
+		pixman_region32_init_rect(&damage, 0, 0,
+					  output->width, output->height);
+		rdp_peer_refresh_region(&damage, peerContext->item.peer);
+		pixman_region32_fini(&damage);
+	} else {
 		peerContext->item.flags &= (~RDP_PEER_OUTPUT_ENABLED);
+		rdp_peer_leave_group(peerContext);
+
+		/* drop the damage held back for flow control */
+		if (peerContext->flow.timer)
+			wl_event_source_timer_update(peerContext->flow.timer, 0);
+		pixman_region32_clear(&peerContext->encode_job.pending_damage);
+	}
 
 	FREERDP_CB_RETURN(TRUE);
 }
@@ -1254,6 +2233,18 @@ rdp_peer_init(freerdp_peer *client, struct rdp_backend *b)
 	}
 
 	loop = wl_display_get_event_loop(b->compositor->wl_display);
+
+	peerCtx->flow.timer = wl_event_loop_add_timer(loop, rdp_peer_flow_timer,
+						      peerCtx);
+	if (!peerCtx->flow.timer) {
+		weston_log("unable to create the flow control timer\n");
+		goto error_initialize;
+	}
+	if (rcount > 0)
+		peerCtx->flow.fd = (int)(long)(rfds[0]);
+	weston_compositor_read_presentation_clock(b->compositor,
+						  &peerCtx->flow.stats_start);
+
 	for (i = 0; i < rcount; i++) {
 		fd = (int)(long)(rfds[i]);
 
@@ -1306,6 +2297,7 @@ rdp_backend_create(struct weston_compositor *compositor,
 	b->base.restore = rdp_restore;
 	b->rdp_key = config->rdp_key ? strdup(config->rdp_key) : NULL;
 	b->no_clients_resize = config->no_clients_resize;
+	b->hash_tiles = config->hash_tiles;
 
 	compositor->backend = &b->base;
 
@@ -1325,6 +2317,20 @@ rdp_backend_create(struct weston_compositor *compositor,
 	if (pixman_renderer_init(compositor) < 0)
 		goto err_compositor;
 
+	if (config->encoder_threads > 0) {
+		b->encoder_pool = rdp_encoder_pool_create(b,
+							  config->encoder_threads);
+		if (b->encoder_pool) {
+			weston_log("RDP encoding on %d threads\n",
+				   b->encoder_pool->thread_count);
+			b->encode_groups[0] = rdp_encode_group_create(false);
+			b->encode_groups[1] = rdp_encode_group_create(true);
+		} else {
+			weston_log("failed to start RDP encoder threads, "
+				   "encoding on the main thread\n");
+		}
+	}
+
 	if (rdp_backend_create_output(compositor) < 0)
 		goto err_compositor;
 
@@ -1371,6 +2377,9 @@ err_output:
 	weston_output_release(&b->output->base);
 err_compositor:
 	weston_compositor_shutdown(compositor);
+	if (b->encoder_pool)
+		rdp_encoder_pool_destroy(b->encoder_pool);
+	rdp_encode_groups_destroy(b);
 err_free_strings:
 	free(b->rdp_key);
 	free(b->server_cert);
@@ -1389,6 +2398,8 @@ config_init_to_defaults(struct weston_rdp_backend_config *config)
 	config->server_key = NULL;
 	config->env_socket = 0;
 	config->no_clients_resize = 0;
+	config->encoder_threads = 2;
+	config->hash_tiles = 0;
 }
 
 WL_EXPORT int
@@ -54,7 +54,7 @@ weston_rdp_output_get_api(struct weston_compositor *compositor)
 	return (const struct weston_rdp_output_api *)api;
 }
 
-#define WESTON_RDP_BACKEND_CONFIG_VERSION 2
+#define WESTON_RDP_BACKEND_CONFIG_VERSION 4
 
 struct weston_rdp_backend_config {
 	struct weston_backend_config base;
@@ -65,6 +65,12 @@ struct weston_rdp_backend_config {
 	char *server_key;
 	int env_socket;
 	int no_clients_resize;
+	/** Number of threads encoding RemoteFX and NSCodec updates, 0 to
+	 * encode on the compositor thread. */
+	int encoder_threads;
+	/** Keep a hash of every 64x64 tile of the output and drop damaged
+	 * tiles whose content did not change from updates. */
+	int hash_tiles;
 };
 
 #ifdef  __cplusplus
@@ -63,8 +63,10 @@
 #include "git-version.h"
 #include "version.h"
 #include "plugin-registry.h"
+#include "pick-grid.h"
 
 #define DEFAULT_REPAINT_WINDOW 7 /* milliseconds */
+#define ADAPTIVE_REPAINT_MARGIN_NSEC 2000000 /* timer and dispatch slop */
 
 static void
 weston_output_update_matrix(struct weston_output *output);
@@ -1267,6 +1269,7 @@ weston_view_update_transform(struct weston_view *view)
 		weston_view_update_transform(parent);
 
 	view->transform.dirty = 0;
+	view->surface->compositor->pick_grid_dirty = true;
 
 	weston_view_damage_below(view);
 
@@ -1329,6 +1332,7 @@ weston_view_geometry_dirty(struct weston_view *view)
 		return;
 
 	view->transform.dirty = 1;
+	view->transform.generation++;
 
 	wl_list_for_each(child, &view->geometry.child_list,
 			 geometry.parent_link)
@@ -1727,38 +1731,93 @@ weston_compositor_get_time(struct timespec *time)
 	clock_gettime(CLOCK_REALTIME, time);
 }
 
-WL_EXPORT struct weston_view *
-weston_compositor_pick_view(struct weston_compositor *compositor,
-			    wl_fixed_t x, wl_fixed_t y,
-			    wl_fixed_t *vx, wl_fixed_t *vy)
+static bool
+view_accepts_input_at(struct weston_view *view,
+		      wl_fixed_t x, wl_fixed_t y,
+		      wl_fixed_t *vx, wl_fixed_t *vy)
 {
-	struct weston_view *view;
 	wl_fixed_t view_x, view_y;
 	int view_ix, view_iy;
-	int ix = wl_fixed_to_int(x);
-	int iy = wl_fixed_to_int(y);
 
+	if (!pixman_region32_contains_point(&view->transform.boundingbox,
+					    wl_fixed_to_int(x),
+					    wl_fixed_to_int(y), NULL))
+		return false;
+
+	weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
+	view_ix = wl_fixed_to_int(view_x);
+	view_iy = wl_fixed_to_int(view_y);
+
+	if (!pixman_region32_contains_point(&view->surface->input,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	if (view->geometry.scissor_enabled &&
+	    !pixman_region32_contains_point(&view->geometry.scissor,
+					    view_ix, view_iy, NULL))
+		return false;
+
+	*vx = view_x;
+	*vy = view_y;
+	return true;
+}
+
+/* The pick grid indexes the bounding boxes of compositor->view_list. It is
+ * marked dirty whenever a view transform is recomputed or the view list
+ * changes, and rebuilt lazily on the next pick, so that the cost of the
+ * rebuild is paid at most once per repaint no matter the input rate.
+ */
+static int
+weston_compositor_update_pick_grid(struct weston_compositor *compositor)
+{
+	struct weston_view *view;
+	pixman_box32_t *box;
+
+	if (!compositor->pick_grid)
+		return -1;
+
+	if (!compositor->pick_grid_dirty)
+		return 0;
+
+	weston_pick_grid_clear(compositor->pick_grid);
 	wl_list_for_each(view, &compositor->view_list, link) {
-		if (!pixman_region32_contains_point(
-				&view->transform.boundingbox, ix, iy, NULL))
-			continue;
+		box = pixman_region32_extents(&view->transform.boundingbox);
+		if (weston_pick_grid_add(compositor->pick_grid,
+					 box->x1, box->y1, box->x2, box->y2,
+					 view) < 0)
+			return -1;
+	}
+
+	if (weston_pick_grid_finish(compositor->pick_grid) < 0)
+		return -1;
 
-		weston_view_from_global_fixed(view, x, y, &view_x, &view_y);
-		view_ix = wl_fixed_to_int(view_x);
-		view_iy = wl_fixed_to_int(view_y);
+	compositor->pick_grid_dirty = false;
 
-		if (!pixman_region32_contains_point(&view->surface->input,
-						    view_ix, view_iy, NULL))
-			continue;
+	return 0;
+}
 
-		if (view->geometry.scissor_enabled &&
-		    !pixman_region32_contains_point(&view->geometry.scissor,
-						    view_ix, view_iy, NULL))
-			continue;
+WL_EXPORT struct weston_view *
+weston_compositor_pick_view(struct weston_compositor *compositor,
+			    wl_fixed_t x, wl_fixed_t y,
+			    wl_fixed_t *vx, wl_fixed_t *vy)
+{
+	struct weston_view *view;
+	int ix = wl_fixed_to_int(x);
+	int iy = wl_fixed_to_int(y);
+	int pos = 0;
 
-		*vx = view_x;
-		*vy = view_y;
-		return view;
+	if (weston_compositor_update_pick_grid(compositor) == 0) {
+		while ((view = weston_pick_grid_next(compositor->pick_grid,
+						     ix, iy, &pos))) {
+			if (view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		}
+	} else {
+		/* No usable grid, fall back to walking the whole list. */
+		wl_list_for_each(view, &compositor->view_list, link) {
+			if (view_accepts_input_at(view, x, y, vx, vy))
+				return view;
+		}
 	}
 
 	*vx = wl_fixed_from_int(-1000000);
@@ -1793,6 +1852,8 @@ weston_view_unmap(struct weston_view *view)
 	weston_layer_entry_remove(&view->layer_link);
 	wl_list_remove(&view->link);
 	wl_list_init(&view->link);
+	view->surface->compositor->view_list_needs_rebuild = true;
+	view->surface->compositor->pick_grid_dirty = true;
 	view->output_mask = 0;
 	weston_surface_assign_output(view->surface);
 
@@ -1849,6 +1910,7 @@ weston_view_destroy(struct weston_view *view)
 
 	wl_list_remove(&view->link);
 	weston_layer_entry_remove(&view->layer_link);
+	view->surface->compositor->pick_grid_dirty = true;
 
 	pixman_region32_fini(&view->clip);
 	pixman_region32_fini(&view->geometry.scissor);
@@ -2072,12 +2134,39 @@ view_accumulate_damage(struct weston_view *view,
 	pixman_region32_union(opaque, opaque, &view->transform.opaque);
 }
 
+/* Whether the damage of a view has to be accumulated in the repaint of
+ * the output with the given bit in its output_mask.
+ *
+ * Views on other outputs are left alone: they cannot damage or occlude
+ * anything on this output, and their surface damage is kept until their
+ * own output is repainted. A view that is not on this output still counts
+ * if its surface has another view here, because flushing the surface
+ * would lose the damage of this view otherwise.
+ */
+static bool
+view_damage_on_output(struct weston_view *ev, uint32_t output_bit)
+{
+	return (ev->output_mask & output_bit) ||
+	       (ev->surface->output_mask & output_bit);
+}
+
+static bool
+surface_flush_on_output(struct weston_surface *surface, uint32_t output_bit)
+{
+	return surface->output_mask == 0 ||
+	       (surface->output_mask & output_bit);
+}
+
 static void
-compositor_accumulate_damage(struct weston_compositor *ec)
+compositor_accumulate_damage(struct weston_compositor *ec,
+			     struct weston_output *output)
 {
 	struct weston_plane *plane;
 	struct weston_view *ev;
 	pixman_region32_t opaque, clip;
+	uint32_t output_bit = 1u << output->id;
+
+	TL_POINT("core_accumulate_damage_begin", TLP_OUTPUT(output), TLP_END);
 
 	pixman_region32_init(&clip);
 
@@ -2090,6 +2179,9 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 			if (ev->plane != plane)
 				continue;
 
+			if (!view_damage_on_output(ev, output_bit))
+				continue;
+
 			view_accumulate_damage(ev, &opaque);
 		}
 
@@ -2107,6 +2199,9 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 			continue;
 		ev->surface->touched = true;
 
+		if (!surface_flush_on_output(ev->surface, output_bit))
+			continue;
+
 		surface_flush_damage(ev->surface);
 
 		/* Both the renderer and the backend have seen the buffer
@@ -2120,6 +2215,8 @@ compositor_accumulate_damage(struct weston_compositor *ec)
 		if (!ev->surface->keep_buffer)
 			weston_buffer_reference(&ev->surface->buffer_ref, NULL);
 	}
+
+	TL_POINT("core_accumulate_damage_end", TLP_OUTPUT(output), TLP_END);
 }
 
 static void
@@ -2231,17 +2328,34 @@ view_list_add(struct weston_compositor *compositor,
 	}
 }
 
+/* The view list is only rebuilt when the layer list, the contents of a
+ * layer or the sub-surface tree of a view in a layer has changed since the
+ * last build, see view_list_needs_rebuild. All outputs repainted in the same
+ * cycle then share the result. Otherwise only the view transforms are
+ * brought up to date, which is cheap for views that are not dirty.
+ */
 static void
 weston_compositor_build_view_list(struct weston_compositor *compositor)
 {
-	struct weston_view *view;
+	struct weston_view *view, *next;
 	struct weston_layer *layer;
 
+	if (!compositor->view_list_needs_rebuild) {
+		wl_list_for_each(view, &compositor->view_list, link)
+			weston_view_update_transform(view);
+		return;
+	}
+
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_stash_subsurface_views(view->surface);
 
+	/* Unlink every view, so that views which do not get re-added
+	 * are not left pointing into the new list. */
+	wl_list_for_each_safe(view, next, &compositor->view_list, link)
+		wl_list_init(&view->link);
 	wl_list_init(&compositor->view_list);
+
 	wl_list_for_each(layer, &compositor->layer_list, link) {
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link) {
 			view_list_add(compositor, view);
@@ -2251,6 +2365,9 @@ weston_compositor_build_view_list(struct weston_compositor *compositor)
 	wl_list_for_each(layer, &compositor->layer_list, link)
 		wl_list_for_each(view, &layer->view_list.link, layer_link.link)
 			surface_free_unused_subsurface_views(view->surface);
+
+	compositor->view_list_needs_rebuild = false;
+	compositor->pick_grid_dirty = true;
 }
 
 static void
@@ -2295,9 +2412,20 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 
 	TL_POINT("core_repaint_begin", TLP_OUTPUT(output), TLP_END);
 
+	weston_compositor_read_presentation_clock(ec, &output->repaint_start);
+	output->repaint_gpu_pending = false;
+	weston_output_frame_stats_end(output, WESTON_FRAME_STATS_PRESENT_SLACK,
+				      &output->repaint_start);
+
 	/* Rebuild the surface list and update surface transforms up front. */
+	weston_output_frame_stats_begin(output,
+					WESTON_FRAME_STATS_BUILD_VIEW_LIST);
 	weston_compositor_build_view_list(ec);
+	weston_output_frame_stats_end(output,
+				      WESTON_FRAME_STATS_BUILD_VIEW_LIST, NULL);
 
+	weston_output_frame_stats_begin(output,
+					WESTON_FRAME_STATS_ASSIGN_PLANES);
 	if (output->assign_planes && !output->disable_planes) {
 		output->assign_planes(output, repaint_data);
 	} else {
@@ -2306,6 +2434,8 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 			ev->psf_flags = 0;
 		}
 	}
+	weston_output_frame_stats_end(output,
+				      WESTON_FRAME_STATS_ASSIGN_PLANES, NULL);
 
 	wl_list_init(&frame_callback_list);
 	wl_list_for_each(ev, &ec->view_list, link) {
@@ -2321,7 +2451,12 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 		}
 	}
 
-	compositor_accumulate_damage(ec);
+	weston_output_frame_stats_begin(output,
+					WESTON_FRAME_STATS_ACCUMULATE_DAMAGE);
+	compositor_accumulate_damage(ec, output);
+	weston_output_frame_stats_end(output,
+				      WESTON_FRAME_STATS_ACCUMULATE_DAMAGE,
+				      NULL);
 
 	pixman_region32_init(&output_damage);
 	pixman_region32_intersect(&output_damage,
@@ -2337,8 +2472,11 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	pixman_region32_fini(&output_damage);
 
 	output->repaint_needed = false;
-	if (r == 0)
+	if (r == 0) {
 		output->repaint_status = REPAINT_AWAITING_COMPLETION;
+		weston_output_frame_stats_begin(output,
+						WESTON_FRAME_STATS_PRESENT_LATENCY);
+	}
 
 	weston_compositor_repick(ec);
 
@@ -2359,10 +2497,90 @@ weston_output_repaint(struct weston_output *output, void *repaint_data)
 	return r;
 }
 
+static void
+weston_output_update_repaint_estimate(struct weston_output *output,
+				      const struct timespec *done)
+{
+	int64_t duration = timespec_sub_to_nsec(done, &output->repaint_start);
+
+	if (duration < 0)
+		return;
+
+	weston_output_frame_stats_record(output,
+					 WESTON_FRAME_STATS_REPAINT_TOTAL,
+					 duration);
+
+	/* Follow a slower repaint immediately, but only let the estimate
+	 * shrink gradually, so that a single fast frame does not make us
+	 * miss the next vblank. */
+	output->repaint_estimate_nsec -= output->repaint_estimate_nsec / 16;
+	if (duration > output->repaint_estimate_nsec)
+		output->repaint_estimate_nsec = duration;
+}
+
+static void
+weston_output_repaint_flushed(struct weston_output *output,
+			      const struct timespec *flushed)
+{
+	output->repaint_cpu_done = *flushed;
+
+	if (!output->repaint_gpu_pending)
+		weston_output_update_repaint_estimate(output, flushed);
+}
+
+/** Report GPU completion of an output repaint
+ *
+ * \param output The output that was repainted.
+ * \param stamp The time rendering finished on the GPU, in the
+ * presentation clock domain, or NULL if it could not be determined.
+ *
+ * Renderers that set weston_output::repaint_gpu_pending during
+ * repaint call this once the GPU is done with the frame, so that the
+ * adaptive repaint window accounts for GPU time as well.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_repaint_gpu_done(struct weston_output *output,
+			       const struct timespec *stamp)
+{
+	const struct timespec *done = &output->repaint_cpu_done;
+
+	if (!output->repaint_gpu_pending)
+		return;
+
+	output->repaint_gpu_pending = false;
+
+	if (stamp && timespec_sub_to_nsec(stamp, done) > 0)
+		done = stamp;
+
+	weston_output_update_repaint_estimate(output, done);
+}
+
+static int64_t
+weston_output_get_repaint_window(struct weston_output *output,
+				 int32_t refresh_nsec)
+{
+	struct weston_compositor *compositor = output->compositor;
+	int64_t window;
+
+	if (!compositor->repaint_adaptive || output->repaint_estimate_nsec == 0)
+		return (int64_t) compositor->repaint_msec * 1000000;
+
+	window = output->repaint_estimate_nsec + ADAPTIVE_REPAINT_MARGIN_NSEC;
+
+	return MIN(window, refresh_nsec);
+}
+
 static void
 weston_output_schedule_repaint_reset(struct weston_output *output)
 {
 	output->repaint_status = REPAINT_NOT_SCHEDULED;
+	output->repaint_target.tv_sec = 0;
+	output->repaint_target.tv_nsec = 0;
+	/* An idle output has no next repaint to be late for. */
+	weston_output_frame_stats_cancel(output,
+					 WESTON_FRAME_STATS_PRESENT_SLACK);
 	TL_POINT("core_repaint_exit_loop", TLP_OUTPUT(output), TLP_END);
 }
 
@@ -2454,8 +2672,10 @@ output_repaint_timer_handler(void *data)
 {
 	struct weston_compositor *compositor = data;
 	struct weston_output *output;
-	struct timespec now;
+	struct timespec now, flushed;
 	void *repaint_data = NULL;
+	uint32_t repainted = 0;
+	bool scheduled;
 	int ret;
 
 	weston_compositor_read_presentation_clock(compositor, &now);
@@ -2464,15 +2684,31 @@ output_repaint_timer_handler(void *data)
 		repaint_data = compositor->backend->repaint_begin(compositor);
 
 	wl_list_for_each(output, &compositor->output_list, link) {
+		scheduled = output->repaint_status == REPAINT_SCHEDULED;
 		ret = weston_output_maybe_repaint(output, &now, repaint_data);
 		if (ret)
 			break;
+		if (scheduled &&
+		    output->repaint_status == REPAINT_AWAITING_COMPLETION)
+			repainted |= 1u << output->id;
 	}
 
 	if (ret == 0) {
+	    weston_compositor_read_presentation_clock(compositor, &now);
 	    if (compositor->backend->repaint_flush)
 		    compositor->backend->repaint_flush(compositor,
 						       repaint_data);
+	    weston_compositor_read_presentation_clock(compositor, &flushed);
+
+	    wl_list_for_each(output, &compositor->output_list, link) {
+		    if (!(repainted & (1u << output->id)))
+			    continue;
+		    weston_output_frame_stats_record(output,
+						     WESTON_FRAME_STATS_REPAINT_FLUSH,
+						     timespec_sub_to_nsec(&flushed,
+									  &now));
+		    weston_output_repaint_flushed(output, &flushed);
+	    }
 	} else {
 	    if (compositor->backend->repaint_cancel)
 		    compositor->backend->repaint_cancel(compositor,
@@ -2493,6 +2729,7 @@ weston_output_finish_frame(struct weston_output *output,
 	int32_t refresh_nsec;
 	struct timespec now;
 	int64_t msec_rel;
+	bool missed;
 
 	TL_POINT("core_repaint_finished", TLP_OUTPUT(output),
 		 TLP_VBLANK(stamp), TLP_END);
@@ -2507,10 +2744,53 @@ weston_output_finish_frame(struct weston_output *output,
 	 * repaint as soon as possible so we can get on with it. */
 	if (!stamp) {
 		output->next_repaint = now;
+		output->repaint_target.tv_sec = 0;
+		output->repaint_target.tv_nsec = 0;
+		goto out;
+	}
+
+	if (presented_flags != WP_PRESENTATION_FEEDBACK_INVALID) {
+		weston_output_frame_stats_end(output,
+					      WESTON_FRAME_STATS_PRESENT_LATENCY,
+					      stamp);
+		weston_output_frame_stats_begin_at(output,
+						   WESTON_FRAME_STATS_PRESENT_SLACK,
+						   stamp);
+	}
+
+	/* A mode without a refresh rate has no vblank to wait for: repaint
+	 * as soon as the previous frame is done. No frame can miss one. */
+	if (output->current_mode->refresh == 0) {
+		if (presented_flags != WP_PRESENTATION_FEEDBACK_INVALID)
+			weston_output_frame_stats_count_frame(output, false);
+
+		weston_presentation_feedback_present_list(&output->feedback_list,
+							  output, 0, stamp,
+							  output->msc,
+							  presented_flags);
+		output->frame_time = *stamp;
+		output->next_repaint = now;
+		output->repaint_target.tv_sec = 0;
+		output->repaint_target.tv_nsec = 0;
 		goto out;
 	}
 
 	refresh_nsec = millihz_to_nsec(output->current_mode->refresh);
+
+	/* A frame counts as missed when it was presented later than the
+	 * vblank its repaint was scheduled for. In adaptive mode, widen the
+	 * repaint window so repeated misses back off. */
+	if (presented_flags != WP_PRESENTATION_FEEDBACK_INVALID &&
+	    (output->repaint_target.tv_sec != 0 ||
+	     output->repaint_target.tv_nsec != 0)) {
+		missed = timespec_sub_to_nsec(stamp, &output->repaint_target) >
+			 refresh_nsec / 2;
+		weston_output_frame_stats_count_frame(output, missed);
+		if (missed && compositor->repaint_adaptive)
+			output->repaint_estimate_nsec +=
+				ADAPTIVE_REPAINT_MARGIN_NSEC;
+	}
+
 	weston_presentation_feedback_present_list(&output->feedback_list,
 						  output, refresh_nsec, stamp,
 						  output->msc,
@@ -2518,9 +2798,10 @@ weston_output_finish_frame(struct weston_output *output,
 
 	output->frame_time = *stamp;
 
-	timespec_add_nsec(&output->next_repaint, stamp, refresh_nsec);
-	timespec_add_msec(&output->next_repaint, &output->next_repaint,
-			  -compositor->repaint_msec);
+	output->repaint_window_nsec =
+		weston_output_get_repaint_window(output, refresh_nsec);
+	timespec_add_nsec(&output->next_repaint, stamp,
+			  refresh_nsec - output->repaint_window_nsec);
 	msec_rel = timespec_sub_to_msec(&output->next_repaint, &now);
 
 	if (msec_rel < -1000 || msec_rel > 1000) {
@@ -2547,6 +2828,9 @@ weston_output_finish_frame(struct weston_output *output,
 		}
 	}
 
+	timespec_add_nsec(&output->repaint_target, &output->next_repaint,
+			  output->repaint_window_nsec);
+
 out:
 	output->repaint_status = REPAINT_SCHEDULED;
 	output_repaint_timer_arm(compositor);
@@ -2568,11 +2852,15 @@ weston_layer_entry_insert(struct weston_layer_entry *list,
 {
 	wl_list_insert(&list->link, &entry->link);
 	entry->layer = list->layer;
+	if (entry->layer)
+		entry->layer->compositor->view_list_needs_rebuild = true;
 }
 
 WL_EXPORT void
 weston_layer_entry_remove(struct weston_layer_entry *entry)
 {
+	if (entry->layer)
+		entry->layer->compositor->view_list_needs_rebuild = true;
 	wl_list_remove(&entry->link);
 	wl_list_init(&entry->link);
 	entry->layer = NULL;
@@ -2618,10 +2906,12 @@ weston_layer_set_position(struct weston_layer *layer,
 	wl_list_for_each_reverse(below, &layer->compositor->layer_list, link) {
 		if (below->position >= layer->position) {
 			wl_list_insert(&below->link, &layer->link);
+			layer->compositor->view_list_needs_rebuild = true;
 			return;
 		}
 	}
 	wl_list_insert(&layer->compositor->layer_list, &layer->link);
+	layer->compositor->view_list_needs_rebuild = true;
 }
 
 /** Hide a layer by taking it off the layer list.
@@ -2634,6 +2924,7 @@ weston_layer_unset_position(struct weston_layer *layer)
 {
 	wl_list_remove(&layer->link);
 	wl_list_init(&layer->link);
+	layer->compositor->view_list_needs_rebuild = true;
 }
 
 WL_EXPORT void
@@ -2856,8 +3147,10 @@ weston_surface_commit_subsurface_order(struct weston_surface *surface)
 		wl_list_remove(&sub->parent_link);
 		wl_list_insert(&surface->subsurface_list, &sub->parent_link);
 
-		if (sub->reordered)
+		if (sub->reordered) {
+			surface->compositor->view_list_needs_rebuild = true;
 			weston_surface_damage_subsurfaces(sub);
+		}
 	}
 }
 
@@ -3524,6 +3817,7 @@ subsurface_committed(struct weston_surface *surface, int32_t dx, int32_t dy)
 
 	if (!weston_surface_is_mapped(surface)) {
 		surface->is_mapped = true;
+		surface->compositor->view_list_needs_rebuild = true;
 
 		/* Cannot call weston_view_update_transform(),
 		 * because that would call it also for the parent surface,
@@ -3861,6 +4155,7 @@ subsurface_set_desync(struct wl_client *client, struct wl_resource *resource)
 static void
 weston_subsurface_unlink_parent(struct weston_subsurface *sub)
 {
+	sub->surface->compositor->view_list_needs_rebuild = true;
 	wl_list_remove(&sub->parent_link);
 	wl_list_remove(&sub->parent_link_pending);
 	wl_list_remove(&sub->parent_destroy_listener.link);
@@ -3927,6 +4222,7 @@ weston_subsurface_link_parent(struct weston_subsurface *sub,
 	wl_list_insert(&parent->subsurface_list, &sub->parent_link);
 	wl_list_insert(&parent->subsurface_list_pending,
 		       &sub->parent_link_pending);
+	parent->compositor->view_list_needs_rebuild = true;
 }
 
 static void
@@ -4739,6 +5035,8 @@ weston_output_init(struct weston_output *output,
 	pixman_region32_init(&output->previous_damage);
 	pixman_region32_init(&output->region);
 	wl_list_init(&output->mode_list);
+
+	weston_output_frame_stats_init(output);
 }
 
 /** Adds weston_output object to pending output list.
@@ -4940,6 +5238,7 @@ weston_output_release(struct weston_output *output)
 	pixman_region32_fini(&output->region);
 	pixman_region32_fini(&output->previous_damage);
 	wl_list_remove(&output->link);
+	weston_output_frame_stats_release(output);
 	free(output->name);
 }
 
@@ -5331,6 +5630,10 @@ weston_compositor_create(struct wl_display *display, void *user_data)
 	weston_plane_init(&ec->primary_plane, ec, 0, 0);
 	weston_compositor_stack_plane(ec, &ec->primary_plane, NULL);
 
+	/* Picking falls back to a linear search without the grid. */
+	ec->pick_grid = weston_pick_grid_create();
+	ec->pick_grid_dirty = true;
+
 	wl_data_device_manager_init(ec->wl_display);
 
 	wl_display_init_shm(ec->wl_display);
@@ -5596,6 +5899,9 @@ weston_compositor_destroy(struct weston_compositor *compositor)
 
 	weston_plugin_api_destroy_list(compositor);
 
+	weston_pick_grid_destroy(compositor->pick_grid);
+	weston_compositor_set_frame_stats_file(compositor, NULL, 0);
+
 	free(compositor);
 }
 
@@ -33,6 +33,7 @@ extern "C" {
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <time.h>
 #include <pixman.h>
 #include <xkbcommon/xkbcommon.h>
@@ -95,7 +96,7 @@ enum weston_led {
 struct weston_mode {
 	uint32_t flags;
 	int32_t width, height;
-	uint32_t refresh;
+	uint32_t refresh; /* mHz, 0 if frames are shown as soon as ready */
 	struct wl_list link;
 };
 
@@ -188,6 +189,14 @@ struct weston_output {
 	 *  next repaint should be run */
 	struct timespec next_repaint;
 
+	/** Adaptive repaint scheduling, see weston_output_finish_frame() */
+	struct timespec repaint_start; /**< when the last repaint began */
+	struct timespec repaint_cpu_done; /**< when it was flushed */
+	bool repaint_gpu_pending; /**< renderer will report GPU completion */
+	int64_t repaint_estimate_nsec; /**< decaying peak repaint duration */
+	int64_t repaint_window_nsec; /**< repaint window currently in use */
+	struct timespec repaint_target; /**< vblank the repaint aims for */
+
 	struct weston_output_zoom zoom;
 	int dirty;
 	struct wl_signal frame_signal;
@@ -233,6 +242,7 @@ struct weston_output {
 			  uint16_t *b);
 
 	struct weston_timeline_object timeline;
+	struct weston_frame_stats *frame_stats;
 
 	bool enabled; /**< is in the output_list, not pending list */
 	int scale;
@@ -913,6 +923,13 @@ struct weston_compositor {
 
 	/* Repaint state. */
 	struct weston_plane primary_plane;
+	bool view_list_needs_rebuild;
+
+	/* Spatial index of view_list for weston_compositor_pick_view() */
+	struct weston_pick_grid *pick_grid;
+	bool pick_grid_dirty;
+
+	struct weston_frame_stats_file *frame_stats_file;
 	uint32_t capabilities; /* combination of enum weston_capability */
 
 	struct weston_renderer *renderer;
@@ -938,6 +955,11 @@ struct weston_compositor {
 
 	clockid_t presentation_clock;
 	int32_t repaint_msec;
+	bool repaint_adaptive;
+
+	/** Threads the renderer may composite with; only the pixman
+	 *  renderer uses more than one. Read when the renderer starts. */
+	int32_t renderer_threads;
 
 	unsigned int activate_serial;
 
@@ -1079,6 +1101,10 @@ struct weston_view {
 	struct {
 		int dirty;
 
+		/* Bumped whenever the geometry is marked dirty, so that
+		 * derived data can be cached across repaints. */
+		uint32_t generation;
+
 		/* Approximations in global coordinates:
 		 * - boundingbox is guaranteed to include the whole view in
 		 *   the smallest possible single rectangle.
@@ -1878,6 +1904,70 @@ noop_renderer_init(struct weston_compositor *ec);
 int
 weston_input_init(struct weston_compositor *compositor);
 
+/** Stages of an output repaint measured by the frame statistics */
+enum weston_frame_stats_stage {
+	WESTON_FRAME_STATS_BUILD_VIEW_LIST = 0,
+	WESTON_FRAME_STATS_ASSIGN_PLANES,
+	WESTON_FRAME_STATS_ACCUMULATE_DAMAGE,
+	WESTON_FRAME_STATS_RENDERER_REPAINT,
+	WESTON_FRAME_STATS_REPAINT_FLUSH,
+	/** From the end of the repaint to the presentation of the frame */
+	WESTON_FRAME_STATS_PRESENT_LATENCY,
+	/** From the start of the repaint until the frame is ready for
+	 *  scanout, including GPU rendering when it can be measured */
+	WESTON_FRAME_STATS_REPAINT_TOTAL,
+	/** From the presentation of a frame to the start of the next
+	 *  repaint; the refresh period minus the repaint window when the
+	 *  repaint loop keeps up */
+	WESTON_FRAME_STATS_PRESENT_SLACK,
+	WESTON_FRAME_STATS_STAGE_COUNT
+};
+
+void
+weston_output_frame_stats_init(struct weston_output *output);
+
+void
+weston_output_frame_stats_release(struct weston_output *output);
+
+void
+weston_output_frame_stats_record(struct weston_output *output,
+				 enum weston_frame_stats_stage stage,
+				 int64_t nsec);
+
+void
+weston_output_frame_stats_begin(struct weston_output *output,
+				enum weston_frame_stats_stage stage);
+
+void
+weston_output_frame_stats_begin_at(struct weston_output *output,
+				   enum weston_frame_stats_stage stage,
+				   const struct timespec *stamp);
+
+void
+weston_output_frame_stats_cancel(struct weston_output *output,
+				 enum weston_frame_stats_stage stage);
+
+void
+weston_output_frame_stats_end(struct weston_output *output,
+			      enum weston_frame_stats_stage stage,
+			      const struct timespec *stamp);
+
+void
+weston_output_frame_stats_count_frame(struct weston_output *output,
+				      bool missed);
+
+void
+weston_output_repaint_gpu_done(struct weston_output *output,
+			       const struct timespec *stamp);
+
+void
+weston_compositor_write_frame_stats(struct weston_compositor *compositor,
+				    FILE *fp);
+
+int
+weston_compositor_set_frame_stats_file(struct weston_compositor *compositor,
+				       const char *path, int interval_msec);
+
 int
 weston_backend_init(struct weston_compositor *c,
 		    struct weston_backend_config *config_base);
@@ -0,0 +1,87 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "drm-damage.h"
+
+const pixman_box32_t *
+drm_damage_fb_clips(pixman_region32_t *damage, bool reused, int *n_rects)
+{
+	static const pixman_box32_t none = { 0, 0, 0, 0 };
+	pixman_box32_t *rects;
+
+	rects = pixman_region32_rectangles(damage, n_rects);
+	if (*n_rects > 0)
+		return rects;
+
+	if (!reused)
+		return NULL;
+
+	*n_rects = 1;
+	return &none;
+}
+
+static unsigned short
+clip_coord(int32_t v)
+{
+	if (v < 0)
+		return 0;
+	if (v > UINT16_MAX)
+		return UINT16_MAX;
+	return v;
+}
+
+drmModeClip *
+drm_damage_dirty_clips(pixman_region32_t *damage, int *n_clips)
+{
+	pixman_box32_t *rects;
+	drmModeClip *clips;
+	int n_rects, i;
+
+	*n_clips = 0;
+
+	rects = pixman_region32_rectangles(damage, &n_rects);
+	if (n_rects == 0)
+		return NULL;
+
+	clips = calloc(n_rects, sizeof *clips);
+	if (!clips)
+		return NULL;
+
+	for (i = 0; i < n_rects; i++) {
+		clips[i].x1 = clip_coord(rects[i].x1);
+		clips[i].y1 = clip_coord(rects[i].y1);
+		clips[i].x2 = clip_coord(rects[i].x2);
+		clips[i].y2 = clip_coord(rects[i].y2);
+	}
+
+	*n_clips = n_rects;
+	return clips;
+}
@@ -0,0 +1,57 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_DRM_DAMAGE_H
+#define WESTON_DRM_DAMAGE_H
+
+#include <stdbool.h>
+
+#include <pixman.h>
+#include <xf86drmMode.h>
+
+/* Damage of a framebuffer, in framebuffer coordinates, as the kernel
+ * takes it: the FB_DAMAGE_CLIPS plane property of atomic commits, and
+ * the clip list of the legacy DIRTYFB ioctl.
+ */
+
+/* The rectangles for FB_DAMAGE_CLIPS; pixman_box32_t has the layout of
+ * struct drm_mode_rect. A missing blob means the whole plane is damaged,
+ * and an empty blob is refused, so a framebuffer shown again without
+ * damage (reused) gets a single empty rectangle, which the kernel clips
+ * away. A new framebuffer without damage returns NULL, for no blob.
+ *
+ * The result points into damage, or to static storage.
+ */
+const pixman_box32_t *
+drm_damage_fb_clips(pixman_region32_t *damage, bool reused, int *n_rects);
+
+/* The clips for drmModeDirtyFB(), clamped to the 16 bits they have.
+ * Returns NULL when there is no damage or on allocation failure; the
+ * result is freed with free().
+ */
+drmModeClip *
+drm_damage_dirty_clips(pixman_region32_t *damage, int *n_clips);
+
+#endif
@@ -0,0 +1,453 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+#include "shared/zalloc.h"
+
+/* Durations are kept in microseconds in a log-linear histogram: values
+ * below 8 us get a bucket each, above that every power of two is split
+ * into 8 buckets, giving a relative error of at most 12.5%. 160 buckets
+ * reach well over a second; anything longer lands in the last one.
+ */
+#define FRAME_STATS_SUB_BITS 3
+#define FRAME_STATS_SUB_COUNT (1 << FRAME_STATS_SUB_BITS)
+#define FRAME_STATS_BUCKETS 160
+
+struct frame_stats_histogram {
+	uint32_t bucket[FRAME_STATS_BUCKETS];
+	uint64_t count;
+	uint64_t sum_usec;
+	uint64_t max_usec;
+};
+
+struct weston_frame_stats {
+	struct frame_stats_histogram stage[WESTON_FRAME_STATS_STAGE_COUNT];
+	struct timespec begin[WESTON_FRAME_STATS_STAGE_COUNT];
+	uint32_t pending; /* mask of stages with a valid begin */
+	uint64_t frames_presented;
+	uint64_t frames_missed;
+};
+
+struct weston_frame_stats_file {
+	char *path;
+	int interval_msec;
+	struct wl_event_source *timer;
+};
+
+static const char * const stage_names[] = {
+	[WESTON_FRAME_STATS_BUILD_VIEW_LIST] = "build_view_list",
+	[WESTON_FRAME_STATS_ASSIGN_PLANES] = "assign_planes",
+	[WESTON_FRAME_STATS_ACCUMULATE_DAMAGE] = "accumulate_damage",
+	[WESTON_FRAME_STATS_RENDERER_REPAINT] = "renderer_repaint",
+	[WESTON_FRAME_STATS_REPAINT_FLUSH] = "repaint_flush",
+	[WESTON_FRAME_STATS_PRESENT_LATENCY] = "present_latency",
+	[WESTON_FRAME_STATS_REPAINT_TOTAL] = "repaint_total",
+	[WESTON_FRAME_STATS_PRESENT_SLACK] = "present_slack",
+};
+
+static int
+bucket_from_usec(uint64_t usec)
+{
+	int msb, bucket;
+
+	if (usec < FRAME_STATS_SUB_COUNT)
+		return usec;
+
+	msb = 63 - __builtin_clzll(usec);
+	bucket = (msb - FRAME_STATS_SUB_BITS + 1) * FRAME_STATS_SUB_COUNT +
+		 ((usec >> (msb - FRAME_STATS_SUB_BITS)) &
+		  (FRAME_STATS_SUB_COUNT - 1));
+
+	return MIN(bucket, FRAME_STATS_BUCKETS - 1);
+}
+
+/* Exclusive upper bound of the values counted in a bucket. */
+static uint64_t
+bucket_limit_usec(int bucket)
+{
+	int shift;
+
+	if (bucket < FRAME_STATS_SUB_COUNT)
+		return bucket + 1;
+
+	shift = bucket / FRAME_STATS_SUB_COUNT - 1;
+	return (uint64_t)(FRAME_STATS_SUB_COUNT +
+			  bucket % FRAME_STATS_SUB_COUNT + 1) << shift;
+}
+
+static uint64_t
+histogram_percentile(const struct frame_stats_histogram *h, int percent)
+{
+	uint64_t target, sum = 0;
+	int i;
+
+	if (h->count == 0)
+		return 0;
+
+	target = (h->count * percent + 99) / 100;
+	for (i = 0; i < FRAME_STATS_BUCKETS; i++) {
+		sum += h->bucket[i];
+		if (sum >= target)
+			return MIN(bucket_limit_usec(i), h->max_usec);
+	}
+
+	return h->max_usec;
+}
+
+/** Set up the frame statistics of an output
+ *
+ * \param output The output.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_init(struct weston_output *output)
+{
+	/* Statistics are best effort; everything below copes with NULL. */
+	output->frame_stats = zalloc(sizeof *output->frame_stats);
+}
+
+/** Free the frame statistics of an output
+ *
+ * \param output The output.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_release(struct weston_output *output)
+{
+	free(output->frame_stats);
+	output->frame_stats = NULL;
+}
+
+/** Record the duration of one frame stage
+ *
+ * \param output The output the stage ran for.
+ * \param stage The stage.
+ * \param nsec The duration in nanoseconds. Negative values are ignored.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_record(struct weston_output *output,
+				 enum weston_frame_stats_stage stage,
+				 int64_t nsec)
+{
+	struct frame_stats_histogram *h;
+	uint64_t usec;
+
+	if (!output->frame_stats || nsec < 0)
+		return;
+
+	h = &output->frame_stats->stage[stage];
+	usec = nsec / 1000;
+
+	h->bucket[bucket_from_usec(usec)]++;
+	h->count++;
+	h->sum_usec += usec;
+	if (usec > h->max_usec)
+		h->max_usec = usec;
+}
+
+/** Mark the beginning of a frame stage
+ *
+ * \param output The output the stage runs for.
+ * \param stage The stage.
+ *
+ * Timestamps are taken from the compositor's presentation clock, so that
+ * stages can also be ended with a presentation timestamp.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_begin(struct weston_output *output,
+				enum weston_frame_stats_stage stage)
+{
+	struct timespec now;
+
+	if (!output->frame_stats)
+		return;
+
+	weston_compositor_read_presentation_clock(output->compositor, &now);
+	weston_output_frame_stats_begin_at(output, stage, &now);
+}
+
+/** Mark the beginning of a frame stage at a given time
+ *
+ * \param output The output the stage runs for.
+ * \param stage The stage.
+ * \param stamp The start time, on the compositor's presentation clock.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_begin_at(struct weston_output *output,
+				   enum weston_frame_stats_stage stage,
+				   const struct timespec *stamp)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+
+	if (!stats)
+		return;
+
+	stats->begin[stage] = *stamp;
+	stats->pending |= 1u << stage;
+}
+
+/** Forget a begun frame stage which will not end
+ *
+ * \param output The output the stage was begun for.
+ * \param stage The stage.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_cancel(struct weston_output *output,
+				 enum weston_frame_stats_stage stage)
+{
+	if (output->frame_stats)
+		output->frame_stats->pending &= ~(1u << stage);
+}
+
+/** Mark the end of a frame stage and record its duration
+ *
+ * \param output The output the stage runs for.
+ * \param stage The stage.
+ * \param stamp The end time, or NULL to use the current time.
+ *
+ * Nothing is recorded if the stage was not begun since it last ended.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_end(struct weston_output *output,
+			      enum weston_frame_stats_stage stage,
+			      const struct timespec *stamp)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+	struct timespec now;
+
+	if (!stats || !(stats->pending & (1u << stage)))
+		return;
+
+	stats->pending &= ~(1u << stage);
+
+	if (!stamp) {
+		weston_compositor_read_presentation_clock(output->compositor,
+							  &now);
+		stamp = &now;
+	}
+
+	weston_output_frame_stats_record(output, stage,
+					 timespec_sub_to_nsec(stamp,
+							      &stats->begin[stage]));
+}
+
+/** Count a presented frame
+ *
+ * \param output The output the frame was presented on.
+ * \param missed Whether the frame was presented later than the vblank its
+ * repaint was scheduled for.
+ *
+ * \memberof weston_output
+ */
+WL_EXPORT void
+weston_output_frame_stats_count_frame(struct weston_output *output,
+				      bool missed)
+{
+	struct weston_frame_stats *stats = output->frame_stats;
+
+	if (!stats)
+		return;
+
+	stats->frames_presented++;
+	if (missed)
+		stats->frames_missed++;
+}
+
+/** Write the frame statistics of all outputs
+ *
+ * \param compositor The compositor instance.
+ * \param fp The stream to write to.
+ *
+ * One line is written per output and stage, with the sample count and
+ * the mean, median, 90th and 99th percentile and maximum in microseconds.
+ * Percentiles are bucket upper bounds, accurate to within 12.5%.
+ * A second table lists the presented and missed frames per output and
+ * the repaint window in use, in microseconds.
+ *
+ * \memberof weston_compositor
+ */
+WL_EXPORT void
+weston_compositor_write_frame_stats(struct weston_compositor *compositor,
+				    FILE *fp)
+{
+	struct weston_output *output;
+	const struct frame_stats_histogram *h;
+	int i;
+
+	fprintf(fp, "# output stage count mean_us p50_us p90_us p99_us "
+		"max_us\n");
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!output->frame_stats)
+			continue;
+
+		for (i = 0; i < WESTON_FRAME_STATS_STAGE_COUNT; i++) {
+			h = &output->frame_stats->stage[i];
+			fprintf(fp, "%s %s %" PRIu64 " %" PRIu64 " %" PRIu64
+				" %" PRIu64 " %" PRIu64 " %" PRIu64 "\n",
+				output->name, stage_names[i], h->count,
+				h->count ? h->sum_usec / h->count : 0,
+				histogram_percentile(h, 50),
+				histogram_percentile(h, 90),
+				histogram_percentile(h, 99),
+				h->max_usec);
+		}
+	}
+
+	fprintf(fp, "# output presented missed repaint_window_us\n");
+
+	wl_list_for_each(output, &compositor->output_list, link) {
+		if (!output->frame_stats)
+			continue;
+
+		fprintf(fp, "%s %" PRIu64 " %" PRIu64 " %" PRId64 "\n",
+			output->name, output->frame_stats->frames_presented,
+			output->frame_stats->frames_missed,
+			output->repaint_window_nsec / 1000);
+	}
+}
+
+static void
+frame_stats_file_write(struct weston_compositor *compositor)
+{
+	struct weston_frame_stats_file *sf = compositor->frame_stats_file;
+	char *tmp;
+	FILE *fp;
+
+	/* Write to a temporary file and rename it over the old one, so
+	 * that readers never see a partially written file. */
+	if (asprintf(&tmp, "%s.tmp", sf->path) < 0)
+		return;
+
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		free(tmp);
+		return;
+	}
+
+	weston_compositor_write_frame_stats(compositor, fp);
+
+	if (fclose(fp) != 0 || rename(tmp, sf->path) < 0)
+		unlink(tmp);
+
+	free(tmp);
+}
+
+static int
+frame_stats_timer_handler(void *data)
+{
+	struct weston_compositor *compositor = data;
+	struct weston_frame_stats_file *sf = compositor->frame_stats_file;
+
+	frame_stats_file_write(compositor);
+	wl_event_source_timer_update(sf->timer, sf->interval_msec);
+
+	return 0;
+}
+
+/** Periodically write the frame statistics to a file
+ *
+ * \param compositor The compositor instance.
+ * \param path The file to (re)write, or NULL to stop writing.
+ * \param interval_msec How often to rewrite the file, in milliseconds.
+ * \return 0 on success, -1 on failure.
+ *
+ * Statistics are always collected; this only controls publishing them,
+ * in the format of weston_compositor_write_frame_stats(). The file is
+ * replaced atomically, so it can be scraped at any time, and removed
+ * when writing stops, including at compositor teardown.
+ *
+ * \memberof weston_compositor
+ */
+WL_EXPORT int
+weston_compositor_set_frame_stats_file(struct weston_compositor *compositor,
+				       const char *path, int interval_msec)
+{
+	struct weston_frame_stats_file *sf = compositor->frame_stats_file;
+	struct wl_event_loop *loop;
+
+	if (sf) {
+		wl_event_source_remove(sf->timer);
+		unlink(sf->path);
+		free(sf->path);
+		free(sf);
+		compositor->frame_stats_file = NULL;
+	}
+
+	if (!path)
+		return 0;
+
+	if (interval_msec <= 0)
+		return -1;
+
+	sf = zalloc(sizeof *sf);
+	if (!sf)
+		return -1;
+
+	sf->path = strdup(path);
+	sf->interval_msec = interval_msec;
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	sf->timer = wl_event_loop_add_timer(loop, frame_stats_timer_handler,
+					    compositor);
+	if (!sf->path || !sf->timer) {
+		if (sf->timer)
+			wl_event_source_remove(sf->timer);
+		free(sf->path);
+		free(sf);
+		return -1;
+	}
+
+	compositor->frame_stats_file = sf;
+	wl_event_source_timer_update(sf->timer, interval_msec);
+
+	weston_log("Writing frame statistics to '%s' every %d ms\n",
+		   path, interval_msec);
+
+	return 0;
+}
@@ -32,6 +32,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
@@ -68,6 +69,14 @@ struct gl_shader {
 	GLint alpha_uniform;
 	GLint color_uniform;
 	const char *vertex_source, *fragment_source;
+
+	/* Uniform values last set by shader_uniforms(), so that views
+	 * sharing a shader do not repeat them. Code setting uniforms
+	 * directly must clear uniforms_valid. */
+	bool uniforms_valid;
+	GLfloat proj[16];
+	GLfloat color[4];
+	GLfloat alpha;
 };
 
 #define BUFFER_DAMAGE_COUNT 2
@@ -99,6 +108,9 @@ struct gl_output_state {
 
 	struct weston_matrix output_matrix;
 
+	/* Single-buffered offscreen surface, read back by the backend */
+	bool is_pbuffer;
+
 	/* struct timeline_render_point::link */
 	struct wl_list timeline_render_point_list;
 };
@@ -156,6 +168,7 @@ struct gl_surface_state {
 
 	GLuint textures[3];
 	int num_textures;
+	GLint filter; /* of textures, 0 if unknown */
 	bool needs_full_upload;
 	pixman_region32_t texture_damage;
 
@@ -186,6 +199,97 @@ struct gl_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Triangles drawn for one repaint_region() call, kept in buffer objects
+ * for as long as the inputs of texture_region() stay the same. */
+struct gl_geometry_cache {
+	bool valid;
+	uint32_t last_used; /* gl_view_state::use_count */
+
+	/* key */
+	uint32_t generation; /* weston_view::transform.generation */
+	pixman_region32_t region;
+	pixman_region32_t surf_region;
+	struct weston_matrix surface_to_buffer;
+	int pitch;
+	int height;
+	int y_inverted;
+
+	GLuint buffers[2]; /* vertices, indices */
+	GLsizei count; /* of indices */
+
+	/* The same triangles in client memory, for drawing them in one
+	 * call with those of other views. */
+	struct wl_array vertices;
+	struct wl_array indices;
+};
+
+/* Enough for the opaque and blended parts on two outputs. */
+#define VIEW_GEOMETRY_CACHE_SIZE 4
+
+struct gl_view_state {
+	struct gl_geometry_cache geometry[VIEW_GEOMETRY_CACHE_SIZE];
+	uint32_t use_count;
+
+	struct weston_view *view;
+
+	struct wl_listener view_destroy_listener;
+	struct wl_listener renderer_destroy_listener;
+};
+
+/* Staging buffers for wl_shm uploads. Uploads of one repaint are packed
+ * into one of them, which is fenced when the repaint is submitted and
+ * reused UPLOAD_RING_SIZE repaints later. */
+#define UPLOAD_RING_SIZE 3
+
+/* The ring only needs these OpenGL ES 3 tokens and types, and its entry
+ * points are looked up at run time, so do not require GLES3/gl3.h. */
+#ifndef GL_PIXEL_UNPACK_BUFFER
+#define GL_PIXEL_UNPACK_BUFFER 0x88EC
+#endif
+#ifndef GL_MAP_WRITE_BIT
+#define GL_MAP_WRITE_BIT 0x0002
+#endif
+#ifndef GL_MAP_INVALIDATE_RANGE_BIT
+#define GL_MAP_INVALIDATE_RANGE_BIT 0x0004
+#endif
+#ifndef GL_MAP_UNSYNCHRONIZED_BIT
+#define GL_MAP_UNSYNCHRONIZED_BIT 0x0020
+#endif
+#ifndef GL_SYNC_GPU_COMMANDS_COMPLETE
+#define GL_SYNC_GPU_COMMANDS_COMPLETE 0x9117
+#endif
+#ifndef GL_SYNC_FLUSH_COMMANDS_BIT
+#define GL_SYNC_FLUSH_COMMANDS_BIT 0x00000001
+#endif
+#ifndef GL_TIMEOUT_IGNORED
+#define GL_TIMEOUT_IGNORED 0xFFFFFFFFFFFFFFFFull
+#endif
+#ifndef GL_APPLE_sync
+typedef struct __GLsync *GLsync;
+typedef khronos_uint64_t GLuint64;
+#endif
+
+struct gl_upload_ring {
+	GLuint pbo[UPLOAD_RING_SIZE];
+	GLsizeiptr size[UPLOAD_RING_SIZE];
+	GLsync fence[UPLOAD_RING_SIZE];
+	int current;
+	GLintptr offset; /* first free byte in pbo[current] */
+};
+
+/* The state a part of a view is drawn with. Consecutive parts drawn with
+ * the same state are drawn with one call, by batch_flush(). */
+struct gl_batch_state {
+	struct gl_shader *shader;
+	GLenum target;
+	GLuint textures[3];
+	int num_textures;
+	GLint filter;
+	GLfloat color[4];
+	GLfloat alpha;
+	bool blend;
+};
+
 struct gl_renderer {
 	struct weston_renderer base;
 	int fragment_shader_debug;
@@ -201,6 +305,15 @@ struct gl_renderer {
 
 	struct wl_array vertices;
 	struct wl_array vtxcnt;
+	struct wl_array indices;
+
+	/* State of the GL context while views are drawn, and the cached
+	 * geometry waiting to be drawn with it */
+	struct gl_batch_state batch_state;
+	struct wl_array batch; /* struct gl_geometry_cache * */
+	int batch_nvtx;
+	struct wl_array batch_vertices;
+	struct wl_array batch_indices;
 
 	PFNGLEGLIMAGETARGETTEXTURE2DOESPROC image_target_texture_2d;
 	PFNEGLCREATEIMAGEKHRPROC create_image;
@@ -210,6 +323,19 @@ struct gl_renderer {
 
 	int has_unpack_subimage;
 
+	/* OpenGL ES 3 pixel unpack buffers and fences, for uploading
+	 * wl_shm buffers without stalling on the texture. */
+	int has_pbo;
+	struct gl_upload_ring upload_ring;
+	void *(GL_APIENTRY *map_buffer_range)(GLenum target, GLintptr offset,
+					      GLsizeiptr length,
+					      GLbitfield access);
+	GLboolean (GL_APIENTRY *unmap_buffer)(GLenum target);
+	GLsync (GL_APIENTRY *fence_sync)(GLenum condition, GLbitfield flags);
+	GLenum (GL_APIENTRY *client_wait_sync)(GLsync sync, GLbitfield flags,
+					       GLuint64 timeout);
+	void (GL_APIENTRY *delete_sync)(GLsync sync);
+
 	PFNEGLBINDWAYLANDDISPLAYWL bind_display;
 	PFNEGLUNBINDWAYLANDDISPLAYWL unbind_display;
 	PFNEGLQUERYWAYLANDBUFFERWL query_buffer;
@@ -336,31 +462,49 @@ timeline_render_point_handler(int fd, uint32_t mask, void *data)
 	struct timeline_render_point *trp = data;
 	const char *tp_name = trp->type == TIMELINE_RENDER_POINT_TYPE_BEGIN ?
 			      "renderer_gpu_begin" : "renderer_gpu_end";
+	struct timespec tspec = { 0 };
+	bool valid = false;
 
 	if (mask & WL_EVENT_READABLE) {
 		uint64_t ts;
 
 		if (linux_sync_file_read_timestamp(trp->fd, &ts) == 0) {
-			struct timespec tspec = { 0 };
-
 			timespec_add_nsec(&tspec, &tspec, ts);
+			valid = true;
 
 			TL_POINT(tp_name, TLP_GPU(&tspec),
 				 TLP_OUTPUT(trp->output), TLP_END);
 		}
 	}
 
+	if (trp->type == TIMELINE_RENDER_POINT_TYPE_END)
+		weston_output_repaint_gpu_done(trp->output,
+					       valid ? &tspec : NULL);
+
 	timeline_render_point_destroy(trp);
 
 	return 0;
 }
 
+/* Render syncs feed both the timeline and the adaptive repaint window. */
+static bool
+timeline_render_sync_wanted(struct gl_renderer *gr,
+			    struct weston_output *output)
+{
+	if (!gr->has_native_fence_sync)
+		return false;
+
+	return weston_timeline_enabled_ ||
+	       output->compositor->repaint_adaptive;
+}
+
 static EGLSyncKHR
-timeline_create_render_sync(struct gl_renderer *gr)
+timeline_create_render_sync(struct gl_renderer *gr,
+			    struct weston_output *output)
 {
 	static const EGLint attribs[] = { EGL_NONE };
 
-	if (!weston_timeline_enabled_ || !gr->has_native_fence_sync)
+	if (!timeline_render_sync_wanted(gr, output))
 		return EGL_NO_SYNC_KHR;
 
 	return gr->create_sync(gr->egl_display, EGL_SYNC_NATIVE_FENCE_ANDROID,
@@ -379,8 +523,7 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 	int fd;
 	struct timeline_render_point *trp;
 
-	if (!weston_timeline_enabled_ ||
-	    !gr->has_native_fence_sync ||
+	if (!timeline_render_sync_wanted(gr, output) ||
 	    sync == EGL_NO_SYNC_KHR)
 		return;
 
@@ -407,6 +550,9 @@ timeline_submit_render_sync(struct gl_renderer *gr,
 
 	wl_list_insert(&go->timeline_render_point_list, &trp->link);
 
+	if (type == TIMELINE_RENDER_POINT_TYPE_END)
+		output->repaint_gpu_pending = true;
+
 out:
 	gr->destroy_sync(gr->egl_display, sync);
 }
@@ -764,20 +910,370 @@ triangle_fan_debug(struct weston_view *view, int first, int count)
 	glUseProgram(gr->solid_shader.program);
 	glUniform4fv(gr->solid_shader.color_uniform, 1,
 			color[color_idx++ % ARRAY_LENGTH(color)]);
+	gr->solid_shader.uniforms_valid = false;
+	gr->batch_state.shader = NULL;
 	glDrawElements(GL_LINES, nelems, GL_UNSIGNED_SHORT, buffer);
 	glUseProgram(gr->current_shader->program);
 	free(buffer);
 }
 
 static void
-repaint_region(struct weston_view *ev, pixman_region32_t *region,
-		pixman_region32_t *surf_region)
+view_state_destroy(struct gl_view_state *vs)
+{
+	struct gl_geometry_cache *gc;
+	int i;
+
+	wl_list_remove(&vs->view_destroy_listener.link);
+	wl_list_remove(&vs->renderer_destroy_listener.link);
+
+	vs->view->renderer_state = NULL;
+
+	for (i = 0; i < VIEW_GEOMETRY_CACHE_SIZE; i++) {
+		gc = &vs->geometry[i];
+		if (gc->buffers[0])
+			glDeleteBuffers(2, gc->buffers);
+		wl_array_release(&gc->vertices);
+		wl_array_release(&gc->indices);
+		pixman_region32_fini(&gc->region);
+		pixman_region32_fini(&gc->surf_region);
+	}
+
+	free(vs);
+}
+
+static void
+view_state_handle_view_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_view_state *vs;
+
+	vs = container_of(listener, struct gl_view_state,
+			  view_destroy_listener);
+
+	view_state_destroy(vs);
+}
+
+static void
+view_state_handle_renderer_destroy(struct wl_listener *listener, void *data)
+{
+	struct gl_view_state *vs;
+
+	vs = container_of(listener, struct gl_view_state,
+			  renderer_destroy_listener);
+
+	view_state_destroy(vs);
+}
+
+static struct gl_view_state *
+get_view_state(struct weston_view *view)
+{
+	struct gl_renderer *gr = get_renderer(view->surface->compositor);
+	struct gl_view_state *vs;
+	int i;
+
+	if (view->renderer_state)
+		return view->renderer_state;
+
+	vs = zalloc(sizeof *vs);
+	if (vs == NULL)
+		return NULL;
+
+	for (i = 0; i < VIEW_GEOMETRY_CACHE_SIZE; i++) {
+		pixman_region32_init(&vs->geometry[i].region);
+		pixman_region32_init(&vs->geometry[i].surf_region);
+		wl_array_init(&vs->geometry[i].vertices);
+		wl_array_init(&vs->geometry[i].indices);
+	}
+
+	vs->view = view;
+	view->renderer_state = vs;
+
+	vs->view_destroy_listener.notify = view_state_handle_view_destroy;
+	wl_signal_add(&view->destroy_signal, &vs->view_destroy_listener);
+
+	vs->renderer_destroy_listener.notify =
+		view_state_handle_renderer_destroy;
+	wl_signal_add(&gr->destroy_signal, &vs->renderer_destroy_listener);
+
+	return vs;
+}
+
+static bool
+geometry_cache_matches(struct gl_geometry_cache *gc, struct weston_view *ev,
+		       struct gl_surface_state *gs, pixman_region32_t *region,
+		       pixman_region32_t *surf_region)
+{
+	return gc->valid &&
+	       gc->generation == ev->transform.generation &&
+	       gc->pitch == gs->pitch &&
+	       gc->height == gs->height &&
+	       gc->y_inverted == gs->y_inverted &&
+	       memcmp(&gc->surface_to_buffer,
+		      &ev->surface->surface_to_buffer_matrix,
+		      sizeof gc->surface_to_buffer) == 0 &&
+	       pixman_region32_equal(&gc->region, region) &&
+	       pixman_region32_equal(&gc->surf_region, surf_region);
+}
+
+/* Returns the cache entry for these arguments of repaint_region(). If
+ * there is none, the least recently used entry is rekeyed and returned
+ * invalid, to be filled in by the caller. */
+static struct gl_geometry_cache *
+geometry_cache_get(struct weston_view *ev, pixman_region32_t *region,
+		   pixman_region32_t *surf_region)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	struct gl_view_state *vs = get_view_state(ev);
+	struct gl_geometry_cache *gc, *lru;
+	int i;
+
+	if (vs == NULL)
+		return NULL;
+
+	vs->use_count++;
+
+	lru = &vs->geometry[0];
+	for (i = 0; i < VIEW_GEOMETRY_CACHE_SIZE; i++) {
+		gc = &vs->geometry[i];
+		if (geometry_cache_matches(gc, ev, gs, region, surf_region)) {
+			gc->last_used = vs->use_count;
+			return gc;
+		}
+
+		if (vs->use_count - gc->last_used >
+		    vs->use_count - lru->last_used)
+			lru = gc;
+	}
+
+	gc = lru;
+	gc->valid = false;
+	gc->last_used = vs->use_count;
+	gc->generation = ev->transform.generation;
+	pixman_region32_copy(&gc->region, region);
+	pixman_region32_copy(&gc->surf_region, surf_region);
+	gc->surface_to_buffer = ev->surface->surface_to_buffer_matrix;
+	gc->pitch = gs->pitch;
+	gc->height = gs->height;
+	gc->y_inverted = gs->y_inverted;
+
+	return gc;
+}
+
+static void
+geometry_cache_fill(struct gl_geometry_cache *gc, GLfloat *v, int nvtx,
+		    struct wl_array *indices)
+{
+	if (!gc->buffers[0])
+		glGenBuffers(2, gc->buffers);
+
+	glBindBuffer(GL_ARRAY_BUFFER, gc->buffers[0]);
+	glBufferData(GL_ARRAY_BUFFER, nvtx * 4 * sizeof *v, v,
+		     GL_STATIC_DRAW);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gc->buffers[1]);
+	glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices->size, indices->data,
+		     GL_STATIC_DRAW);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+	gc->vertices.size = 0;
+	gc->indices.size = 0;
+	if (wl_array_copy(&gc->indices, indices) < 0 ||
+	    !wl_array_add(&gc->vertices, nvtx * 4 * sizeof *v))
+		return;
+	memcpy(gc->vertices.data, v, gc->vertices.size);
+
+	gc->count = indices->size / sizeof(GLushort);
+	gc->valid = true;
+}
+
+static void
+geometry_cache_draw(struct gl_geometry_cache *gc)
+{
+	if (gc->count == 0)
+		return;
+
+	glBindBuffer(GL_ARRAY_BUFFER, gc->buffers[0]);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, gc->buffers[1]);
+
+	/* position: */
+	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+			      (void *) 0);
+	/* texcoord: */
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(GLfloat),
+			      (void *) (2 * sizeof(GLfloat)));
+
+	glDrawElements(GL_TRIANGLES, gc->count, GL_UNSIGNED_SHORT, NULL);
+
+	/* Everything else draws from client memory. */
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+static void
+use_shader(struct gl_renderer *gr, struct gl_shader *shader);
+
+static void
+shader_uniforms(struct gl_shader *shader,
+		struct weston_view *view,
+		struct weston_output *output);
+
+/* Draws cached geometry of views sharing the current GL state; several
+ * regions are copied into one set of arrays and drawn with one call. */
+static void
+batch_draw(struct gl_renderer *gr, struct gl_geometry_cache **batch, int n)
+{
+	struct gl_geometry_cache *gc;
+	GLushort *index, *src;
+	GLfloat *v;
+	int i, k, base;
+
+	glEnableVertexAttribArray(0);
+	glEnableVertexAttribArray(1);
+
+	gr->batch_vertices.size = 0;
+	gr->batch_indices.size = 0;
+
+	for (i = 0, base = 0; n > 1 && i < n; i++) {
+		gc = batch[i];
+		v = wl_array_add(&gr->batch_vertices, gc->vertices.size);
+		index = wl_array_add(&gr->batch_indices, gc->indices.size);
+		if (!v || !index)
+			break;
+
+		memcpy(v, gc->vertices.data, gc->vertices.size);
+		src = gc->indices.data;
+		for (k = 0; k < gc->count; k++)
+			index[k] = src[k] + base;
+		base += gc->vertices.size / (4 * sizeof *v);
+	}
+
+	if (n > 1 && i == n) {
+		v = gr->batch_vertices.data;
+
+		/* position: */
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+				      &v[0]);
+		/* texcoord: */
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+				      &v[2]);
+
+		glDrawElements(GL_TRIANGLES,
+			       gr->batch_indices.size / sizeof *index,
+			       GL_UNSIGNED_SHORT, gr->batch_indices.data);
+	} else {
+		/* A single region, or out of memory. */
+		for (i = 0; i < n; i++)
+			geometry_cache_draw(batch[i]);
+	}
+
+	glDisableVertexAttribArray(1);
+	glDisableVertexAttribArray(0);
+}
+
+static void
+batch_flush(struct gl_renderer *gr)
+{
+	int n = gr->batch.size / sizeof(struct gl_geometry_cache *);
+
+	if (n > 0)
+		batch_draw(gr, gr->batch.data, n);
+
+	gr->batch.size = 0;
+	gr->batch_nvtx = 0;
+}
+
+/* Makes state the GL state views are drawn with. The geometry batched
+ * with the previous state is drawn first. Uniforms, textures and
+ * blending are only touched when they change. */
+static void
+batch_set_state(struct gl_renderer *gr, struct weston_view *ev,
+		struct weston_output *output,
+		const struct gl_batch_state *state)
+{
+	struct gl_surface_state *gs = get_surface_state(ev->surface);
+	int i;
+
+	if (memcmp(&gr->batch_state, state, sizeof *state) == 0)
+		return;
+
+	batch_flush(gr);
+
+	use_shader(gr, state->shader);
+	shader_uniforms(state->shader, ev, output);
+
+	for (i = 0; i < state->num_textures; i++) {
+		glActiveTexture(GL_TEXTURE0 + i);
+		glBindTexture(state->target, state->textures[i]);
+		if (gs->filter == state->filter)
+			continue;
+		glTexParameteri(state->target, GL_TEXTURE_MIN_FILTER,
+				state->filter);
+		glTexParameteri(state->target, GL_TEXTURE_MAG_FILTER,
+				state->filter);
+	}
+	gs->filter = state->filter;
+
+	if (state->blend)
+		glEnable(GL_BLEND);
+	else
+		glDisable(GL_BLEND);
+
+	gr->batch_state = *state;
+}
+
+/* Queues cached geometry to be drawn with the current state. */
+static void
+batch_add(struct gl_renderer *gr, struct gl_geometry_cache *gc)
+{
+	struct gl_geometry_cache **p;
+	int nvtx = gc->vertices.size / (4 * sizeof(GLfloat));
+
+	if (gc->count == 0)
+		return;
+
+	/* The indices of a batch are 16 bits wide. */
+	if (gr->batch_nvtx + nvtx > 65536)
+		batch_flush(gr);
+
+	p = wl_array_add(&gr->batch, sizeof *p);
+	if (!p) {
+		batch_flush(gr);
+		batch_draw(gr, &gc, 1);
+		return;
+	}
+
+	*p = gc;
+	gr->batch_nvtx += nvtx;
+}
+
+static void
+repaint_region(struct weston_view *ev, struct weston_output *output,
+	       const struct gl_batch_state *state,
+	       pixman_region32_t *region, pixman_region32_t *surf_region)
 {
 	struct weston_compositor *ec = ev->surface->compositor;
 	struct gl_renderer *gr = get_renderer(ec);
+	struct gl_geometry_cache *gc = NULL;
 	GLfloat *v;
 	unsigned int *vtxcnt;
-	int i, first, nfans;
+	GLushort *index;
+	int i, j, k, first, base, nfans;
+
+	/* The triangles only change with the view's geometry, the buffer
+	 * and the regions, so a static view in a static repaint region
+	 * draws straight from the buffer objects of the last frame. The
+	 * debug fans need the vertices in client memory. */
+	if (!gr->fan_debug)
+		gc = geometry_cache_get(ev, region, surf_region);
+
+	batch_set_state(gr, ev, output, state);
+
+	/* Cached geometry is drawn together with that of the views
+	 * before and after this one, as long as they share the state. */
+	if (gc && gc->valid) {
+		batch_add(gr, gc);
+		return;
+	}
 
 	/* The final region to be painted is the intersection of
 	 * 'region' and 'surf_region'. However, 'region' is in the global
@@ -792,26 +1288,70 @@ repaint_region(struct weston_view *ev, pixman_region32_t *region,
 	v = gr->vertices.data;
 	vtxcnt = gr->vtxcnt.data;
 
-	/* position: */
-	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[0]);
-	glEnableVertexAttribArray(0);
+	/* Rather than one glDrawArrays() per fan, split the fans into
+	 * triangles and draw as many as 16-bit indices can address at
+	 * once; that is all of them, unless the damage is very complex. */
+	for (i = 0, first = 0; i < nfans; ) {
+		base = first;
+		gr->indices.size = 0;
+
+		for (j = i; j < nfans && first + vtxcnt[j] - base <= 65536;
+		     j++) {
+			index = wl_array_add(&gr->indices,
+					     (vtxcnt[j] - 2) * 3 * sizeof *index);
+			for (k = 1; k < (int) vtxcnt[j] - 1; k++) {
+				*index++ = first - base;
+				*index++ = first - base + k;
+				*index++ = first - base + k + 1;
+			}
+			first += vtxcnt[j];
+		}
 
-	/* texcoord: */
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v, &v[2]);
-	glEnableVertexAttribArray(1);
+		if (gc && j == nfans && base == 0) {
+			geometry_cache_fill(gc, v, first, &gr->indices);
+			if (gc->valid) {
+				batch_add(gr, gc);
+				i = j;
+				continue;
+			}
+		}
+
+		/* Drawn straight away, so what is batched goes first. */
+		batch_flush(gr);
+
+		glEnableVertexAttribArray(0);
+		glEnableVertexAttribArray(1);
+
+		/* position: */
+		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+				      &v[base * 4]);
+		/* texcoord: */
+		glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof *v,
+				      &v[base * 4 + 2]);
+
+		glDrawElements(GL_TRIANGLES, gr->indices.size / sizeof *index,
+			       GL_UNSIGNED_SHORT, gr->indices.data);
 
-	for (i = 0, first = 0; i < nfans; i++) {
-		glDrawArrays(GL_TRIANGLE_FAN, first, vtxcnt[i]);
-		if (gr->fan_debug)
-			triangle_fan_debug(ev, first, vtxcnt[i]);
-		first += vtxcnt[i];
+		if (gr->fan_debug) {
+			for (k = base; i < j; i++) {
+				triangle_fan_debug(ev, k - base, vtxcnt[i]);
+				k += vtxcnt[i];
+			}
+		}
+		i = j;
+
+		glDisableVertexAttribArray(1);
+		glDisableVertexAttribArray(0);
 	}
 
-	glDisableVertexAttribArray(1);
-	glDisableVertexAttribArray(0);
+	if (gc && nfans == 0) {
+		gc->count = 0;
+		gc->valid = true;
+	}
 
 	gr->vertices.size = 0;
 	gr->vtxcnt.size = 0;
+	gr->indices.size = 0;
 }
 
 static int
@@ -870,13 +1410,32 @@ shader_uniforms(struct gl_shader *shader,
 	struct gl_surface_state *gs = get_surface_state(view->surface);
 	struct gl_output_state *go = get_output_state(output);
 
-	glUniformMatrix4fv(shader->proj_uniform,
-			   1, GL_FALSE, go->output_matrix.d);
-	glUniform4fv(shader->color_uniform, 1, gs->color);
-	glUniform1f(shader->alpha_uniform, view->alpha);
+	if (!shader->uniforms_valid) {
+		/* Samplers never change; unused ones have location -1,
+		 * which GL ignores. */
+		for (i = 0; i < ARRAY_LENGTH(shader->tex_uniforms); i++)
+			glUniform1i(shader->tex_uniforms[i], i);
+	}
 
-	for (i = 0; i < gs->num_textures; i++)
-		glUniform1i(shader->tex_uniforms[i], i);
+	if (!shader->uniforms_valid ||
+	    memcmp(shader->proj, go->output_matrix.d, sizeof shader->proj)) {
+		glUniformMatrix4fv(shader->proj_uniform,
+				   1, GL_FALSE, go->output_matrix.d);
+		memcpy(shader->proj, go->output_matrix.d, sizeof shader->proj);
+	}
+
+	if (!shader->uniforms_valid ||
+	    memcmp(shader->color, gs->color, sizeof shader->color)) {
+		glUniform4fv(shader->color_uniform, 1, gs->color);
+		memcpy(shader->color, gs->color, sizeof shader->color);
+	}
+
+	if (!shader->uniforms_valid || shader->alpha != view->alpha) {
+		glUniform1f(shader->alpha_uniform, view->alpha);
+		shader->alpha = view->alpha;
+	}
+
+	shader->uniforms_valid = true;
 }
 
 static void
@@ -892,6 +1451,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	pixman_region32_t surface_opaque;
 	/* non-opaque region in surface coordinates: */
 	pixman_region32_t surface_blend;
+	struct gl_batch_state state, opaque_state;
 	GLint filter;
 	int i;
 
@@ -909,28 +1469,31 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 	if (!pixman_region32_not_empty(&repaint))
 		goto out;
 
-	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
-
 	if (gr->fan_debug) {
+		batch_flush(gr);
 		use_shader(gr, &gr->solid_shader);
 		shader_uniforms(&gr->solid_shader, ev, output);
+		/* The view's own shader has to be made current again. */
+		gr->batch_state.shader = NULL;
 	}
 
-	use_shader(gr, gs->shader);
-	shader_uniforms(gs->shader, ev, output);
-
 	if (ev->transform.enabled || output->zoom.active ||
 	    output->current_scale != ev->surface->buffer_viewport.buffer.scale)
 		filter = GL_LINEAR;
 	else
 		filter = GL_NEAREST;
 
-	for (i = 0; i < gs->num_textures; i++) {
-		glActiveTexture(GL_TEXTURE0 + i);
-		glBindTexture(gs->target, gs->textures[i]);
-		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, filter);
-		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, filter);
-	}
+	/* Zeroed first, as states are compared with memcmp(). */
+	memset(&state, 0, sizeof state);
+	state.shader = gs->shader;
+	state.target = gs->target;
+	state.num_textures = gs->num_textures;
+	for (i = 0; i < gs->num_textures; i++)
+		state.textures[i] = gs->textures[i];
+	state.filter = filter;
+	memcpy(state.color, gs->color, sizeof state.color);
+	state.alpha = ev->alpha;
+	state.blend = true;
 
 	/* blended region is whole surface minus opaque region: */
 	pixman_region32_init_rect(&surface_blend, 0, 0,
@@ -951,30 +1514,25 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		pixman_region32_copy(&surface_opaque, &ev->surface->opaque);
 
 	if (pixman_region32_not_empty(&surface_opaque)) {
-		if (gs->shader == &gr->texture_shader_rgba) {
-			/* Special case for RGBA textures with possibly
-			 * bad data in alpha channel: use the shader
-			 * that forces texture alpha = 1.0.
-			 * Xwayland surfaces need this.
-			 */
-			use_shader(gr, &gr->texture_shader_rgbx);
-			shader_uniforms(&gr->texture_shader_rgbx, ev, output);
-		}
+		opaque_state = state;
 
-		if (ev->alpha < 1.0)
-			glEnable(GL_BLEND);
-		else
-			glDisable(GL_BLEND);
+		/* Special case for RGBA textures with possibly
+		 * bad data in alpha channel: use the shader
+		 * that forces texture alpha = 1.0.
+		 * Xwayland surfaces need this.
+		 */
+		if (gs->shader == &gr->texture_shader_rgba)
+			opaque_state.shader = &gr->texture_shader_rgbx;
 
-		repaint_region(ev, &repaint, &surface_opaque);
-	}
+		opaque_state.blend = ev->alpha < 1.0;
 
-	if (pixman_region32_not_empty(&surface_blend)) {
-		use_shader(gr, gs->shader);
-		glEnable(GL_BLEND);
-		repaint_region(ev, &repaint, &surface_blend);
+		repaint_region(ev, output, &opaque_state,
+			       &repaint, &surface_opaque);
 	}
 
+	if (pixman_region32_not_empty(&surface_blend))
+		repaint_region(ev, output, &state, &repaint, &surface_blend);
+
 	pixman_region32_fini(&surface_blend);
 	pixman_region32_fini(&surface_opaque);
 
@@ -986,11 +1544,18 @@ static void
 repaint_views(struct weston_output *output, pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
+	struct gl_renderer *gr = get_renderer(compositor);
 	struct weston_view *view;
 
+	/* Other code changes the GL state, so it is unknown here. */
+	memset(&gr->batch_state, 0, sizeof gr->batch_state);
+	glBlendFunc(GL_ONE, GL_ONE_MINUS_SRC_ALPHA);
+
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
 			draw_view(view, output, damage);
+
+	batch_flush(gr);
 }
 
 static void
@@ -1106,6 +1671,7 @@ draw_output_borders(struct weston_output *output,
 
 	glUniform1i(shader->tex_uniforms[0], 0);
 	glUniform1f(shader->alpha_uniform, 1);
+	shader->uniforms_valid = false;
 	glActiveTexture(GL_TEXTURE0);
 
 	if (border_status & BORDER_TOP_DIRTY)
@@ -1173,7 +1739,10 @@ output_get_damage(struct weston_output *output,
 	EGLBoolean ret;
 	int i;
 
-	if (gr->has_egl_buffer_age) {
+	/* A pbuffer keeps its contents and is never swapped. */
+	if (go->is_pbuffer) {
+		buffer_age = 1;
+	} else if (gr->has_egl_buffer_age) {
 		ret = eglQuerySurface(gr->egl_display, go->egl_surface,
 				      EGL_BUFFER_AGE_EXT, &buffer_age);
 		if (ret == EGL_FALSE) {
@@ -1229,6 +1798,81 @@ output_rotate_damage(struct weston_output *output,
  * Depending on the underlying hardware, violating that assumption could
  * result in seeing through to another display plane.
  */
+/* Returns 'size' bytes of write-only staging memory, mapped from the
+ * pixel unpack buffer left bound, and their offset in that buffer. */
+static void *
+upload_ring_map(struct gl_renderer *gr, GLsizeiptr size, GLintptr *offset)
+{
+	struct gl_upload_ring *ring = &gr->upload_ring;
+	int i = ring->current;
+	GLsizeiptr new_size;
+	GLintptr start;
+
+	if (!ring->pbo[i])
+		glGenBuffers(1, &ring->pbo[i]);
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, ring->pbo[i]);
+
+	/* The GPU may still read the last contents of this buffer. */
+	if (ring->fence[i]) {
+		gr->client_wait_sync(ring->fence[i],
+				     GL_SYNC_FLUSH_COMMANDS_BIT,
+				     GL_TIMEOUT_IGNORED);
+		gr->delete_sync(ring->fence[i]);
+		ring->fence[i] = NULL;
+	}
+
+	/* Texel data offsets must be aligned to the texel size. */
+	start = (ring->offset + 15) & ~15;
+
+	if (start + size > ring->size[i]) {
+		/* Uploads already issued keep the orphaned storage. */
+		new_size = MAX(2 * ring->size[i], size);
+		new_size = MAX(new_size, 4 * 1024 * 1024);
+		glBufferData(GL_PIXEL_UNPACK_BUFFER, new_size, NULL,
+			     GL_STREAM_DRAW);
+		ring->size[i] = new_size;
+		start = 0;
+	}
+
+	ring->offset = start + size;
+	*offset = start;
+
+	return gr->map_buffer_range(GL_PIXEL_UNPACK_BUFFER, start, size,
+				    GL_MAP_WRITE_BIT |
+				    GL_MAP_INVALIDATE_RANGE_BIT |
+				    GL_MAP_UNSYNCHRONIZED_BIT);
+}
+
+/* Fences the uploads staged for this repaint and moves on to the next
+ * staging buffer. */
+static void
+upload_ring_submit(struct gl_renderer *gr)
+{
+	struct gl_upload_ring *ring = &gr->upload_ring;
+
+	if (!gr->has_pbo || ring->offset == 0)
+		return;
+
+	ring->fence[ring->current] =
+		gr->fence_sync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+	ring->current = (ring->current + 1) % UPLOAD_RING_SIZE;
+	ring->offset = 0;
+}
+
+static void
+upload_ring_release(struct gl_renderer *gr)
+{
+	struct gl_upload_ring *ring = &gr->upload_ring;
+	int i;
+
+	for (i = 0; i < UPLOAD_RING_SIZE; i++) {
+		if (ring->fence[i])
+			gr->delete_sync(ring->fence[i]);
+		if (ring->pbo[i])
+			glDeleteBuffers(1, &ring->pbo[i]);
+	}
+}
+
 static void
 gl_renderer_repaint_output(struct weston_output *output,
 			      pixman_region32_t *output_damage)
@@ -1248,7 +1892,10 @@ gl_renderer_repaint_output(struct weston_output *output,
 	if (use_output(output) < 0)
 		return;
 
-	begin_render_sync = timeline_create_render_sync(gr);
+	weston_output_frame_stats_begin(output,
+					WESTON_FRAME_STATS_RENDERER_REPAINT);
+
+	begin_render_sync = timeline_create_render_sync(gr, output);
 
 	/* Calculate the viewport */
 	glViewport(go->borders[GL_RENDERER_BORDER_LEFT].width,
@@ -1290,6 +1937,8 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	repaint_views(output, &total_damage);
 
+	upload_ring_submit(gr);
+
 	pixman_region32_fini(&total_damage);
 	pixman_region32_fini(&buffer_damage);
 
@@ -1298,9 +1947,11 @@ gl_renderer_repaint_output(struct weston_output *output,
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
 
-	end_render_sync = timeline_create_render_sync(gr);
+	end_render_sync = timeline_create_render_sync(gr, output);
 
-	if (gr->swap_buffers_with_damage) {
+	if (go->is_pbuffer) {
+		ret = EGL_TRUE;
+	} else if (gr->swap_buffers_with_damage) {
 		pixman_region32_init(&buffer_damage);
 		weston_transformed_region(output->width, output->height,
 					  output->transform,
@@ -1346,6 +1997,10 @@ gl_renderer_repaint_output(struct weston_output *output,
 
 	go->border_status = BORDER_STATUS_CLEAN;
 
+	weston_output_frame_stats_end(output,
+				      WESTON_FRAME_STATS_RENDERER_REPAINT,
+				      NULL);
+
 	/* We have to submit the render sync objects after swap buffers, since
 	 * the objects get assigned a valid sync file fd only after a gl flush.
 	 */
@@ -1388,6 +2043,126 @@ gl_renderer_read_pixels(struct weston_output *output,
 	return 0;
 }
 
+static int
+shm_texel_size(GLenum format, GLenum type)
+{
+	if (type == GL_UNSIGNED_SHORT_5_6_5)
+		return 2;
+
+	switch (format) {
+	case GL_BGRA_EXT:
+		return 4;
+	case GL_RG8_EXT:
+	case GL_LUMINANCE_ALPHA:
+		return 2;
+	default:
+		return 1;
+	}
+}
+
+/* Copies a rectangle of texels of one plane into the staging buffer
+ * and starts its transfer into the texture. Redefines the texture
+ * when 'full' is set. */
+static void
+stage_shm_plane(struct gl_renderer *gr, struct gl_surface_state *gs,
+		int plane, uint8_t *data, int height, pixman_box32_t *box,
+		bool full)
+{
+	int texel = shm_texel_size(gs->gl_format[plane], gs->gl_pixel_type);
+	int plane_width = gs->pitch / gs->hsub[plane];
+	int plane_height = height / gs->vsub[plane];
+	int stride = plane_width * texel;
+	int x1, y1, x2, y2, row, y;
+	GLintptr offset;
+	uint8_t *src, *dst;
+
+	if (full) {
+		x1 = 0;
+		y1 = 0;
+		x2 = plane_width;
+		y2 = plane_height;
+	} else {
+		x1 = box->x1 / gs->hsub[plane];
+		y1 = box->y1 / gs->vsub[plane];
+		x2 = MIN((box->x2 + gs->hsub[plane] - 1) / gs->hsub[plane],
+			 plane_width);
+		y2 = MIN((box->y2 + gs->vsub[plane] - 1) / gs->vsub[plane],
+			 plane_height);
+		if (x1 >= x2 || y1 >= y2)
+			return;
+	}
+
+	row = (x2 - x1) * texel;
+	dst = upload_ring_map(gr, row * (y2 - y1), &offset);
+	if (!dst)
+		return;
+
+	src = data + gs->offset[plane] + y1 * stride + x1 * texel;
+	for (y = y1; y < y2; y++) {
+		memcpy(dst, src, row);
+		dst += row;
+		src += stride;
+	}
+	gr->unmap_buffer(GL_PIXEL_UNPACK_BUFFER);
+
+	glBindTexture(GL_TEXTURE_2D, gs->textures[plane]);
+	if (full)
+		glTexImage2D(GL_TEXTURE_2D, 0, gs->gl_format[plane],
+			     plane_width, plane_height, 0,
+			     gs->gl_format[plane], gs->gl_pixel_type,
+			     (void *) offset);
+	else
+		glTexSubImage2D(GL_TEXTURE_2D, 0, x1, y1, x2 - x1, y2 - y1,
+				gs->gl_format[plane], gs->gl_pixel_type,
+				(void *) offset);
+}
+
+/* Uploads through the staging buffers: the only work done here is
+ * copying the damage out of the client buffer, which is then released
+ * straight away, while the GPU fetches the texels once it gets to
+ * them instead of the driver stalling on a texture still in use. */
+static void
+stage_shm_damage(struct weston_surface *surface,
+		 struct weston_buffer *buffer)
+{
+	struct gl_renderer *gr = get_renderer(surface->compositor);
+	struct gl_surface_state *gs = get_surface_state(surface);
+	pixman_box32_t *rectangles;
+	uint8_t *data;
+	int i, j, n;
+
+	glPixelStorei(GL_UNPACK_ROW_LENGTH_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_PIXELS_EXT, 0);
+	glPixelStorei(GL_UNPACK_SKIP_ROWS_EXT, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+
+	data = wl_shm_buffer_get_data(buffer->shm_buffer);
+	wl_shm_buffer_begin_access(buffer->shm_buffer);
+
+	if (gs->needs_full_upload) {
+		for (j = 0; j < gs->num_textures; j++)
+			stage_shm_plane(gr, gs, j, data, buffer->height,
+					NULL, true);
+	} else {
+		rectangles = pixman_region32_rectangles(&gs->texture_damage,
+							&n);
+		for (i = 0; i < n; i++) {
+			pixman_box32_t r;
+
+			r = weston_surface_to_buffer_rect(surface,
+							  rectangles[i]);
+			for (j = 0; j < gs->num_textures; j++)
+				stage_shm_plane(gr, gs, j, data,
+						buffer->height, &r, false);
+		}
+	}
+
+	wl_shm_buffer_end_access(buffer->shm_buffer);
+
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
 static void
 gl_renderer_flush_damage(struct weston_surface *surface)
 {
@@ -1425,6 +2200,11 @@ gl_renderer_flush_damage(struct weston_surface *surface)
 	    !gs->needs_full_upload)
 		goto done;
 
+	if (gr->has_pbo) {
+		stage_shm_damage(surface, buffer);
+		goto done;
+	}
+
 	data = wl_shm_buffer_get_data(buffer->shm_buffer);
 
 	if (!gr->has_unpack_subimage) {
@@ -2281,6 +3061,9 @@ gl_renderer_attach(struct weston_surface *es, struct weston_buffer *buffer)
 
 	weston_buffer_reference(&gs->buffer_ref, buffer);
 
+	/* The texture target may change, forget the filter of the old one */
+	gs->filter = 0;
+
 	if (!buffer) {
 		for (i = 0; i < gs->num_images; i++) {
 			egl_image_unref(gs->images[i]);
@@ -2442,6 +3225,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 
 	glUniformMatrix4fv(gs->shader->proj_uniform, 1, GL_FALSE, proj);
 	glUniform1f(gs->shader->alpha_uniform, 1.0f);
+	gs->shader->uniforms_valid = false;
 
 	for (i = 0; i < gs->num_textures; i++) {
 		glUniform1i(gs->shader->tex_uniforms[i], i);
@@ -2451,6 +3235,7 @@ gl_renderer_surface_copy_content(struct weston_surface *surface,
 		glTexParameteri(gs->target, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(gs->target, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	}
+	gs->filter = GL_NEAREST;
 
 	/* position: */
 	glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, verts);
@@ -2737,6 +3522,7 @@ shader_init(struct gl_shader *shader, struct gl_renderer *renderer,
 	shader->tex_uniforms[2] = glGetUniformLocation(shader->program, "tex2");
 	shader->alpha_uniform = glGetUniformLocation(shader->program, "alpha");
 	shader->color_uniform = glGetUniformLocation(shader->program, "color");
+	shader->uniforms_valid = false;
 
 	return 0;
 }
@@ -3026,6 +3812,59 @@ gl_renderer_output_window_create(struct weston_output *output,
 	return ret;
 }
 
+static int
+gl_renderer_output_pbuffer_create(struct weston_output *output,
+				  int width, int height,
+				  const EGLint *config_attribs,
+				  const EGLint *visual_id,
+				  int n_ids)
+{
+	struct gl_renderer *gr = get_renderer(output->compositor);
+	EGLConfig pbuffer_config;
+	EGLSurface egl_surface;
+	int ret;
+	const EGLint pbuffer_attribs[] = {
+		EGL_WIDTH, width,
+		EGL_HEIGHT, height,
+		EGL_NONE
+	};
+
+	if (egl_choose_config(gr, config_attribs, visual_id,
+			      n_ids, &pbuffer_config) < 0) {
+		weston_log("failed to choose EGL config for PbufferSurface\n");
+		return -1;
+	}
+
+	if (pbuffer_config != gr->egl_config &&
+	    !gr->has_configless_context) {
+		weston_log("attempted to use a different EGL config for an "
+			   "output but EGL_KHR_no_config_context or "
+			   "EGL_MESA_configless_context is not supported\n");
+		return -1;
+	}
+
+	log_egl_config_info(gr->egl_display, pbuffer_config);
+
+	egl_surface = eglCreatePbufferSurface(gr->egl_display, pbuffer_config,
+					      pbuffer_attribs);
+	if (egl_surface == EGL_NO_SURFACE) {
+		weston_log("failed to create egl surface\n");
+		gl_renderer_print_egl_error_state();
+		return -1;
+	}
+
+	ret = gl_renderer_output_create(output, egl_surface);
+	if (ret < 0) {
+		weston_platform_destroy_egl_surface(gr->egl_display,
+						    egl_surface);
+		return ret;
+	}
+
+	get_output_state(output)->is_pbuffer = true;
+
+	return 0;
+}
+
 static void
 gl_renderer_output_destroy(struct weston_output *output)
 {
@@ -3067,6 +3906,9 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&gr->destroy_signal, gr);
 
+	if (gr->has_pbo)
+		upload_ring_release(gr);
+
 	if (gr->has_bind_display)
 		gr->unbind_display(gr->egl_display, ec->wl_display);
 
@@ -3090,6 +3932,10 @@ gl_renderer_destroy(struct weston_compositor *ec)
 
 	wl_array_release(&gr->vertices);
 	wl_array_release(&gr->vtxcnt);
+	wl_array_release(&gr->indices);
+	wl_array_release(&gr->batch);
+	wl_array_release(&gr->batch_vertices);
+	wl_array_release(&gr->batch_indices);
 
 	if (gr->fragment_binding)
 		weston_binding_destroy(gr->fragment_binding);
@@ -3244,6 +4090,16 @@ static const EGLint gl_renderer_alpha_attribs[] = {
 	EGL_NONE
 };
 
+static const EGLint gl_renderer_pbuffer_attribs[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RED_SIZE, 1,
+	EGL_GREEN_SIZE, 1,
+	EGL_BLUE_SIZE, 1,
+	EGL_ALPHA_SIZE, 0,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_ES2_BIT,
+	EGL_NONE
+};
+
 
 /** Checks whether a platform EGL client extension is supported
  *
@@ -3317,6 +4173,8 @@ platform_to_extension(EGLenum platform)
 		return "wayland";
 	case EGL_PLATFORM_X11_KHR:
 		return "x11";
+	case EGL_PLATFORM_SURFACELESS_MESA:
+		return "surfaceless";
 	default:
 		assert(0 && "bad EGL platform enum");
 	}
@@ -3580,6 +4438,8 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 {
 	struct gl_renderer *gr = get_renderer(ec);
 	const char *extensions;
+	const char *version;
+	int gl_major;
 	EGLConfig context_config;
 	EGLBoolean ret;
 
@@ -3639,6 +4499,23 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	if (weston_check_egl_extension(extensions, "GL_EXT_unpack_subimage"))
 		gr->has_unpack_subimage = 1;
 
+	/* Contexts created for OpenGL ES 2 are often OpenGL ES 3
+	 * ones, which have all of GL_EXT_unpack_subimage too. */
+	version = (const char *) glGetString(GL_VERSION);
+	if (version && sscanf(version, "OpenGL ES %d.", &gl_major) == 1 &&
+	    gl_major >= 3) {
+		gr->map_buffer_range =
+			(void *) eglGetProcAddress("glMapBufferRange");
+		gr->unmap_buffer = (void *) eglGetProcAddress("glUnmapBuffer");
+		gr->fence_sync = (void *) eglGetProcAddress("glFenceSync");
+		gr->client_wait_sync =
+			(void *) eglGetProcAddress("glClientWaitSync");
+		gr->delete_sync = (void *) eglGetProcAddress("glDeleteSync");
+		gr->has_pbo = gr->map_buffer_range && gr->unmap_buffer &&
+			      gr->fence_sync && gr->client_wait_sync &&
+			      gr->delete_sync;
+	}
+
 	if (weston_check_egl_extension(extensions, "GL_OES_EGL_image_external"))
 		gr->has_egl_image_external = 1;
 
@@ -3664,7 +4541,10 @@ gl_renderer_setup(struct weston_compositor *ec, EGLSurface egl_surface)
 	weston_log_continue(STAMP_SPACE "read-back format: %s\n",
 		ec->read_format == PIXMAN_a8r8g8b8 ? "BGRA" : "RGBA");
 	weston_log_continue(STAMP_SPACE "wl_shm sub-image to texture: %s\n",
-			    gr->has_unpack_subimage ? "yes" : "no");
+			    gr->has_unpack_subimage || gr->has_pbo ?
+			    "yes" : "no");
+	weston_log_continue(STAMP_SPACE "wl_shm upload through PBOs: %s\n",
+			    gr->has_pbo ? "yes" : "no");
 	weston_log_continue(STAMP_SPACE "EGL Wayland extension: %s\n",
 			    gr->has_bind_display ? "yes" : "no");
 
@@ -3682,5 +4562,8 @@ WL_EXPORT struct gl_renderer_interface gl_renderer_interface = {
 	.output_destroy = gl_renderer_output_destroy,
 	.output_surface = gl_renderer_output_surface,
 	.output_set_border = gl_renderer_output_set_border,
-	.print_egl_error_state = gl_renderer_print_egl_error_state
+	.print_egl_error_state = gl_renderer_print_egl_error_state,
+
+	.pbuffer_attribs = gl_renderer_pbuffer_attribs,
+	.output_pbuffer_create = gl_renderer_output_pbuffer_create,
 };
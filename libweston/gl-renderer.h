@@ -114,5 +114,17 @@ struct gl_renderer_interface {
 				  int32_t tex_width, unsigned char *data);
 
 	void (*print_egl_error_state)(void);
+
+	const EGLint *pbuffer_attribs;
+
+	/* Creates an offscreen output of the given size, rendered into
+	 * an EGL pbuffer. Nothing is presented; the backend reads the
+	 * frames back with read_pixels(), which returns them bottom-up.
+	 */
+	int (*output_pbuffer_create)(struct weston_output *output,
+				     int width, int height,
+				     const EGLint *config_attribs,
+				     const EGLint *visual_id,
+				     int n_ids);
 };
 
@@ -0,0 +1,271 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "pick-grid.h"
+#include "shared/zalloc.h"
+
+/* Cells are at least 1 << MIN_CELL_SHIFT pixels wide, and the grid is
+ * at most MAX_CELLS cells wide or high; larger extents get bigger cells. */
+#define MIN_CELL_SHIFT 6
+#define MAX_CELLS 64
+
+struct pick_grid_entry {
+	int32_t x1, y1, x2, y2;
+	void *data;
+};
+
+struct weston_pick_grid {
+	struct pick_grid_entry *entries;
+	int entry_count;
+	int entry_alloc;
+
+	int32_t origin_x, origin_y;
+	int cell_shift;
+	int cols, rows;
+
+	/* cell c holds cell_index[cell_start[c] .. cell_start[c + 1] - 1] */
+	uint32_t *cell_start;
+	int cell_start_alloc;
+	uint32_t *cell_index;
+	int cell_index_alloc;
+};
+
+static int
+grow_array(void **array, int *alloc, int needed, size_t elem_size)
+{
+	void *data;
+	int size;
+
+	if (needed <= *alloc)
+		return 0;
+
+	size = *alloc ? *alloc : 16;
+	while (size < needed)
+		size *= 2;
+
+	data = realloc(*array, size * elem_size);
+	if (!data)
+		return -1;
+
+	*array = data;
+	*alloc = size;
+
+	return 0;
+}
+
+struct weston_pick_grid *
+weston_pick_grid_create(void)
+{
+	return zalloc(sizeof(struct weston_pick_grid));
+}
+
+void
+weston_pick_grid_destroy(struct weston_pick_grid *grid)
+{
+	if (!grid)
+		return;
+
+	free(grid->entries);
+	free(grid->cell_start);
+	free(grid->cell_index);
+	free(grid);
+}
+
+void
+weston_pick_grid_clear(struct weston_pick_grid *grid)
+{
+	grid->entry_count = 0;
+	grid->cols = 0;
+	grid->rows = 0;
+}
+
+int
+weston_pick_grid_add(struct weston_pick_grid *grid,
+		     int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+		     void *data)
+{
+	struct pick_grid_entry *entry;
+
+	/* Empty boxes can never be hit. */
+	if (x1 >= x2 || y1 >= y2)
+		return 0;
+
+	if (grow_array((void **) &grid->entries, &grid->entry_alloc,
+		       grid->entry_count + 1, sizeof *grid->entries) < 0)
+		return -1;
+
+	entry = &grid->entries[grid->entry_count++];
+	entry->x1 = x1;
+	entry->y1 = y1;
+	entry->x2 = x2;
+	entry->y2 = y2;
+	entry->data = data;
+
+	return 0;
+}
+
+static void
+entry_cell_range(struct weston_pick_grid *grid, struct pick_grid_entry *entry,
+		 int *cx1, int *cy1, int *cx2, int *cy2)
+{
+	*cx1 = ((int64_t) entry->x1 - grid->origin_x) >> grid->cell_shift;
+	*cy1 = ((int64_t) entry->y1 - grid->origin_y) >> grid->cell_shift;
+	*cx2 = ((int64_t) entry->x2 - 1 - grid->origin_x) >> grid->cell_shift;
+	*cy2 = ((int64_t) entry->y2 - 1 - grid->origin_y) >> grid->cell_shift;
+}
+
+int
+weston_pick_grid_finish(struct weston_pick_grid *grid)
+{
+	struct pick_grid_entry *entry;
+	int32_t x1 = INT32_MAX, y1 = INT32_MAX;
+	int32_t x2 = INT32_MIN, y2 = INT32_MIN;
+	int64_t width, height;
+	int cx1, cy1, cx2, cy2, cx, cy;
+	int cells, c, i;
+	uint32_t total = 0;
+
+	grid->cols = 0;
+	grid->rows = 0;
+
+	if (grid->entry_count == 0)
+		return 0;
+
+	for (i = 0; i < grid->entry_count; i++) {
+		entry = &grid->entries[i];
+		if (entry->x1 < x1)
+			x1 = entry->x1;
+		if (entry->y1 < y1)
+			y1 = entry->y1;
+		if (entry->x2 > x2)
+			x2 = entry->x2;
+		if (entry->y2 > y2)
+			y2 = entry->y2;
+	}
+
+	width = (int64_t) x2 - x1;
+	height = (int64_t) y2 - y1;
+
+	grid->origin_x = x1;
+	grid->origin_y = y1;
+	grid->cell_shift = MIN_CELL_SHIFT;
+	while (((width - 1) >> grid->cell_shift) >= MAX_CELLS ||
+	       ((height - 1) >> grid->cell_shift) >= MAX_CELLS)
+		grid->cell_shift++;
+
+	/* Count the entries of each cell. */
+	cells = (((width - 1) >> grid->cell_shift) + 1) *
+		(((height - 1) >> grid->cell_shift) + 1);
+	if (grow_array((void **) &grid->cell_start, &grid->cell_start_alloc,
+		       cells + 1, sizeof *grid->cell_start) < 0)
+		return -1;
+
+	memset(grid->cell_start, 0, (cells + 1) * sizeof *grid->cell_start);
+	grid->cols = ((width - 1) >> grid->cell_shift) + 1;
+
+	for (i = 0; i < grid->entry_count; i++) {
+		entry_cell_range(grid, &grid->entries[i],
+				 &cx1, &cy1, &cx2, &cy2);
+		for (cy = cy1; cy <= cy2; cy++)
+			for (cx = cx1; cx <= cx2; cx++)
+				grid->cell_start[cy * grid->cols + cx]++;
+		total += (cx2 - cx1 + 1) * (cy2 - cy1 + 1);
+	}
+
+	/* Turn the counts into end offsets... */
+	for (c = 1; c < cells; c++)
+		grid->cell_start[c] += grid->cell_start[c - 1];
+	grid->cell_start[cells] = total;
+
+	if (grow_array((void **) &grid->cell_index, &grid->cell_index_alloc,
+		       total, sizeof *grid->cell_index) < 0) {
+		grid->cols = 0;
+		return -1;
+	}
+
+	/* ...and fill backwards, so each cell ends up with its start offset
+	 * and its entries in stacking order. */
+	for (i = grid->entry_count - 1; i >= 0; i--) {
+		entry_cell_range(grid, &grid->entries[i],
+				 &cx1, &cy1, &cx2, &cy2);
+		for (cy = cy1; cy <= cy2; cy++)
+			for (cx = cx1; cx <= cx2; cx++) {
+				c = cy * grid->cols + cx;
+				grid->cell_index[--grid->cell_start[c]] = i;
+			}
+	}
+
+	grid->rows = ((height - 1) >> grid->cell_shift) + 1;
+
+	return 0;
+}
+
+/** Return the next item whose box contains the point
+ *
+ * \param grid The grid, as built by weston_pick_grid_finish().
+ * \param x X coordinate of the point.
+ * \param y Y coordinate of the point.
+ * \param pos Iteration state, must be 0 on the first call.
+ * \return The data of the next item in stacking order whose box contains
+ * the point, or NULL if there are no more.
+ */
+void *
+weston_pick_grid_next(struct weston_pick_grid *grid, int32_t x, int32_t y,
+		      int *pos)
+{
+	struct pick_grid_entry *entry;
+	int64_t cx, cy;
+	uint32_t i, end;
+	int c;
+
+	if (x < grid->origin_x || y < grid->origin_y)
+		return NULL;
+
+	cx = ((int64_t) x - grid->origin_x) >> grid->cell_shift;
+	cy = ((int64_t) y - grid->origin_y) >> grid->cell_shift;
+	if (cx >= grid->cols || cy >= grid->rows)
+		return NULL;
+
+	c = cy * grid->cols + cx;
+	end = grid->cell_start[c + 1];
+	for (i = grid->cell_start[c] + *pos; i < end; i++) {
+		entry = &grid->entries[grid->cell_index[i]];
+		if (x < entry->x1 || x >= entry->x2 ||
+		    y < entry->y1 || y >= entry->y2)
+			continue;
+
+		*pos = i - grid->cell_start[c] + 1;
+		return entry->data;
+	}
+
+	*pos = end - grid->cell_start[c];
+	return NULL;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_PICK_GRID_H
+#define WESTON_PICK_GRID_H
+
+#include <stdint.h>
+
+/* A uniform grid over the bounding boxes of a stacked list of items.
+ *
+ * Items are added in stacking order, topmost first, between
+ * weston_pick_grid_clear() and weston_pick_grid_finish(). A point query
+ * then only visits the items whose boxes touch the grid cell of the point,
+ * still in stacking order, instead of every item.
+ */
+struct weston_pick_grid;
+
+struct weston_pick_grid *
+weston_pick_grid_create(void);
+
+void
+weston_pick_grid_destroy(struct weston_pick_grid *grid);
+
+void
+weston_pick_grid_clear(struct weston_pick_grid *grid);
+
+int
+weston_pick_grid_add(struct weston_pick_grid *grid,
+		     int32_t x1, int32_t y1, int32_t x2, int32_t y2,
+		     void *data);
+
+int
+weston_pick_grid_finish(struct weston_pick_grid *grid);
+
+void *
+weston_pick_grid_next(struct weston_pick_grid *grid, int32_t x, int32_t y,
+		      int *pos);
+
+#endif
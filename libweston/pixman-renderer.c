@@ -31,6 +31,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <signal.h>
 
 #include "pixman-renderer.h"
 #include "shared/helpers.h"
@@ -39,7 +41,7 @@
 
 struct pixman_output_state {
 	void *shadow_buffer;
-	pixman_image_t *shadow_image;
+	pixman_image_t *shadow_image; /* NULL when rendering to hw_buffer */
 	pixman_image_t *hw_buffer;
 };
 
@@ -47,6 +49,7 @@ struct pixman_surface_state {
 	struct weston_surface *surface;
 
 	pixman_image_t *image;
+	pixman_color_t color; /* of image, if it is a solid fill */
 	struct weston_buffer_reference buffer_ref;
 
 	struct wl_listener buffer_destroy_listener;
@@ -54,6 +57,27 @@ struct pixman_surface_state {
 	struct wl_listener renderer_destroy_listener;
 };
 
+/* Worker threads compositing horizontal bands of an output in parallel.
+ * The main thread renders bands too, and blocks until all are done, so
+ * the scene graph cannot change underneath the workers.
+ */
+struct pixman_render_pool {
+	pthread_mutex_t mutex;
+	pthread_cond_t work_cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int thread_count;
+	bool quit;
+
+	/* The frame currently being rendered, protected by mutex */
+	uint32_t frame;
+	struct weston_output *output;
+	pixman_region32_t *damage;
+	int band_count;
+	int next_band;
+	int bands_done;
+};
+
 struct pixman_renderer {
 	struct weston_renderer base;
 
@@ -61,9 +85,22 @@ struct pixman_renderer {
 	pixman_image_t *debug_color;
 	struct weston_binding *debug_binding;
 
+	struct pixman_render_pool *pool;
+
 	struct wl_signal destroy_signal;
 };
 
+/* Where a repaint pass draws to: the whole shadow image, or a single band
+ * of it when rendering on several threads. Pixman images are not thread
+ * safe, as compositing caches state in them, so in the latter case all
+ * images used are private to the thread.
+ */
+struct pixman_render_target {
+	pixman_image_t *image;
+	pixman_image_t *debug_color;
+	pixman_region32_t *band; /* in output coordinates, NULL for all */
+};
+
 static inline struct pixman_output_state *
 get_output_state(struct weston_output *output)
 {
@@ -73,6 +110,12 @@ get_output_state(struct weston_output *output)
 static int
 pixman_renderer_create_surface(struct weston_surface *surface);
 
+static inline pixman_image_t *
+get_render_image(struct pixman_output_state *po)
+{
+	return po->shadow_image ? po->shadow_image : po->hw_buffer;
+}
+
 static inline struct pixman_surface_state *
 get_surface_state(struct weston_surface *surface)
 {
@@ -325,24 +368,53 @@ composite_clipped(pixman_image_t *src,
  *                    coordinates. If NULL, use the whole source image.
  * \param pixman_op Compositing operator, either SRC or OVER.
  */
+static pixman_image_t *
+surface_image_for_thread(struct pixman_surface_state *ps)
+{
+	pixman_image_t *image = ps->image;
+
+	if (!pixman_image_get_data(image))
+		return pixman_image_create_solid_fill(&ps->color);
+
+	return pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						 pixman_image_get_width(image),
+						 pixman_image_get_height(image),
+						 pixman_image_get_data(image),
+						 pixman_image_get_stride(image));
+}
+
 static void
 repaint_region(struct weston_view *ev, struct weston_output *output,
+	       struct pixman_render_target *target,
 	       pixman_region32_t *repaint_output,
 	       pixman_region32_t *source_clip,
 	       pixman_op_t pixman_op)
 {
-	struct pixman_renderer *pr =
-		(struct pixman_renderer *) output->compositor->renderer;
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
-	struct pixman_output_state *po = get_output_state(output);
 	struct weston_buffer_viewport *vp = &ev->surface->buffer_viewport;
+	pixman_region32_t band_clip;
 	pixman_transform_t transform;
 	pixman_filter_t filter;
+	pixman_image_t *src_image;
 	pixman_image_t *mask_image;
 	pixman_color_t mask = { 0, };
 
+	if (target->band) {
+		pixman_region32_init(&band_clip);
+		pixman_region32_intersect(&band_clip, repaint_output,
+					  target->band);
+		if (!pixman_region32_not_empty(&band_clip)) {
+			pixman_region32_fini(&band_clip);
+			return;
+		}
+		repaint_output = &band_clip;
+		src_image = surface_image_for_thread(ps);
+	} else {
+		src_image = pixman_image_ref(ps->image);
+	}
+
 	/* Clip rendering to the damaged output region */
-	pixman_image_set_clip_region32(po->shadow_image, repaint_output);
+	pixman_image_set_clip_region32(target->image, repaint_output);
 
 	pixman_renderer_compute_transform(&transform, ev, output);
 
@@ -362,34 +434,40 @@ repaint_region(struct weston_view *ev, struct weston_output *output,
 	}
 
 	if (source_clip)
-		composite_clipped(ps->image, mask_image, po->shadow_image,
+		composite_clipped(src_image, mask_image, target->image,
 				  &transform, filter, source_clip);
 	else
-		composite_whole(pixman_op, ps->image, mask_image,
-				po->shadow_image, &transform, filter);
+		composite_whole(pixman_op, src_image, mask_image,
+				target->image, &transform, filter);
 
 	if (mask_image)
 		pixman_image_unref(mask_image);
 
+	pixman_image_unref(src_image);
+
 	if (ps->buffer_ref.buffer)
 		wl_shm_buffer_end_access(ps->buffer_ref.buffer->shm_buffer);
 
-	if (pr->repaint_debug)
+	if (target->debug_color)
 		pixman_image_composite32(PIXMAN_OP_OVER,
-					 pr->debug_color, /* src */
+					 target->debug_color, /* src */
 					 NULL /* mask */,
-					 po->shadow_image, /* dest */
+					 target->image, /* dest */
 					 0, 0, /* src_x, src_y */
 					 0, 0, /* mask_x, mask_y */
 					 0, 0, /* dest_x, dest_y */
-					 pixman_image_get_width (po->shadow_image), /* width */
-					 pixman_image_get_height (po->shadow_image) /* height */);
+					 pixman_image_get_width (target->image), /* width */
+					 pixman_image_get_height (target->image) /* height */);
+
+	pixman_image_set_clip_region32 (target->image, NULL);
 
-	pixman_image_set_clip_region32 (po->shadow_image, NULL);
+	if (target->band)
+		pixman_region32_fini(&band_clip);
 }
 
 static void
 draw_view_translated(struct weston_view *view, struct weston_output *output,
+		     struct pixman_render_target *target,
 		     pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -417,8 +495,8 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 							  view);
 			region_global_to_output(output, &repaint_output);
 
-			repaint_region(view, output, &repaint_output, NULL,
-				       PIXMAN_OP_SRC);
+			repaint_region(view, output, target, &repaint_output,
+				       NULL, PIXMAN_OP_SRC);
 		}
 	}
 
@@ -428,7 +506,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 						  &surface_blend, view);
 		region_global_to_output(output, &repaint_output);
 
-		repaint_region(view, output, &repaint_output, NULL,
+		repaint_region(view, output, target, &repaint_output, NULL,
 			       PIXMAN_OP_OVER);
 	}
 
@@ -439,6 +517,7 @@ draw_view_translated(struct weston_view *view, struct weston_output *output,
 static void
 draw_view_source_clipped(struct weston_view *view,
 			 struct weston_output *output,
+			 struct pixman_render_target *target,
 			 pixman_region32_t *repaint_global)
 {
 	struct weston_surface *surface = view->surface;
@@ -464,7 +543,7 @@ draw_view_source_clipped(struct weston_view *view,
 	pixman_region32_copy(&repaint_output, repaint_global);
 	region_global_to_output(output, &repaint_output);
 
-	repaint_region(view, output, &repaint_output, &buffer_region,
+	repaint_region(view, output, target, &repaint_output, &buffer_region,
 		       PIXMAN_OP_OVER);
 
 	pixman_region32_fini(&repaint_output);
@@ -474,6 +553,7 @@ draw_view_source_clipped(struct weston_view *view,
 
 static void
 draw_view(struct weston_view *ev, struct weston_output *output,
+	  struct pixman_render_target *target,
 	  pixman_region32_t *damage) /* in global coordinates */
 {
 	struct pixman_surface_state *ps = get_surface_state(ev->surface);
@@ -500,7 +580,7 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * Also the boundingbox is accurate rather than an
 		 * approximation.
 		 */
-		draw_view_translated(ev, output, &repaint);
+		draw_view_translated(ev, output, target, &repaint);
 	} else {
 		/* The complex case: the view transformation does not allow
 		 * converting opaque etc. regions into global coordinate space.
@@ -509,21 +589,208 @@ draw_view(struct weston_view *ev, struct weston_output *output,
 		 * to be used whole. Source clipping does not work with
 		 * PIXMAN_OP_SRC.
 		 */
-		draw_view_source_clipped(ev, output, &repaint);
+		draw_view_source_clipped(ev, output, target, &repaint);
 	}
 
 out:
 	pixman_region32_fini(&repaint);
 }
 static void
-repaint_surfaces(struct weston_output *output, pixman_region32_t *damage)
+repaint_surfaces(struct weston_output *output,
+		 struct pixman_render_target *target,
+		 pixman_region32_t *damage)
 {
 	struct weston_compositor *compositor = output->compositor;
 	struct weston_view *view;
 
 	wl_list_for_each_reverse(view, &compositor->view_list, link)
 		if (view->plane == &compositor->primary_plane)
-			draw_view(view, output, damage);
+			draw_view(view, output, target, damage);
+}
+
+static void
+render_pool_draw_band(struct pixman_render_pool *pool, int band)
+{
+	struct weston_output *output = pool->output;
+	struct pixman_renderer *pr = get_renderer(output->compositor);
+	struct pixman_output_state *po = get_output_state(output);
+	pixman_image_t *image = get_render_image(po);
+	struct pixman_render_target target;
+	pixman_region32_t band_region;
+	pixman_color_t red = { 0x3fff, 0x0000, 0x0000, 0x3fff };
+	int width = pixman_image_get_width(image);
+	int height = pixman_image_get_height(image);
+	int y1 = height * band / pool->band_count;
+	int y2 = height * (band + 1) / pool->band_count;
+
+	pixman_region32_init_rect(&band_region, 0, y1, width, y2 - y1);
+
+	target.image =
+		pixman_image_create_bits_no_clear(pixman_image_get_format(image),
+						  width, height,
+						  pixman_image_get_data(image),
+						  pixman_image_get_stride(image));
+	target.debug_color = pr->repaint_debug ?
+			     pixman_image_create_solid_fill(&red) : NULL;
+	target.band = &band_region;
+
+	repaint_surfaces(output, &target, pool->damage);
+
+	if (target.debug_color)
+		pixman_image_unref(target.debug_color);
+	pixman_image_unref(target.image);
+	pixman_region32_fini(&band_region);
+}
+
+/* Render bands of the current frame until none are left. Called and
+ * returns with the pool mutex held. */
+static void
+render_pool_run_bands(struct pixman_render_pool *pool)
+{
+	int band;
+
+	while (pool->next_band < pool->band_count) {
+		band = pool->next_band++;
+
+		pthread_mutex_unlock(&pool->mutex);
+		render_pool_draw_band(pool, band);
+		pthread_mutex_lock(&pool->mutex);
+
+		if (++pool->bands_done == pool->band_count)
+			pthread_cond_signal(&pool->done_cond);
+	}
+}
+
+static void *
+render_pool_thread(void *data)
+{
+	struct pixman_render_pool *pool = data;
+	uint32_t frame;
+
+	pthread_mutex_lock(&pool->mutex);
+	frame = pool->frame;
+
+	while (!pool->quit) {
+		if (pool->frame == frame) {
+			pthread_cond_wait(&pool->work_cond, &pool->mutex);
+			continue;
+		}
+
+		frame = pool->frame;
+		render_pool_run_bands(pool);
+	}
+
+	pthread_mutex_unlock(&pool->mutex);
+
+	return NULL;
+}
+
+static void
+render_pool_repaint(struct pixman_render_pool *pool,
+		    struct weston_output *output, pixman_region32_t *damage)
+{
+	struct weston_compositor *compositor = output->compositor;
+	struct pixman_output_state *po = get_output_state(output);
+	struct weston_view *view;
+	int height = pixman_image_get_height(get_render_image(po));
+
+	/* Surface state is created lazily; do that before the workers
+	 * go looking for it. */
+	wl_list_for_each(view, &compositor->view_list, link)
+		if (view->plane == &compositor->primary_plane)
+			get_surface_state(view->surface);
+
+	pthread_mutex_lock(&pool->mutex);
+
+	/* A few bands per thread, so that uneven bands even out, but no
+	 * thinner than 16 rows. */
+	pool->band_count = MAX(MIN((pool->thread_count + 1) * 4,
+				   height / 16), 1);
+	pool->next_band = 0;
+	pool->bands_done = 0;
+	pool->output = output;
+	pool->damage = damage;
+	pool->frame++;
+	pthread_cond_broadcast(&pool->work_cond);
+
+	render_pool_run_bands(pool);
+	while (pool->bands_done < pool->band_count)
+		pthread_cond_wait(&pool->done_cond, &pool->mutex);
+
+	pool->output = NULL;
+	pool->damage = NULL;
+
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+static void
+render_pool_destroy(struct pixman_render_pool *pool)
+{
+	int i;
+
+	pthread_mutex_lock(&pool->mutex);
+	pool->quit = true;
+	pthread_cond_broadcast(&pool->work_cond);
+	pthread_mutex_unlock(&pool->mutex);
+
+	for (i = 0; i < pool->thread_count; i++)
+		pthread_join(pool->threads[i], NULL);
+
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->work_cond);
+	pthread_mutex_destroy(&pool->mutex);
+	free(pool->threads);
+	free(pool);
+}
+
+/* Create a pool rendering with thread_count threads in total, including
+ * the main thread. */
+static struct pixman_render_pool *
+render_pool_create(int thread_count)
+{
+	struct pixman_render_pool *pool;
+	sigset_t mask, old_mask;
+	int i;
+
+	pool = zalloc(sizeof *pool);
+	if (!pool)
+		return NULL;
+
+	pool->threads = zalloc((thread_count - 1) * sizeof *pool->threads);
+	if (!pool->threads) {
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->mutex, NULL);
+	pthread_cond_init(&pool->work_cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	/* Leave asynchronous signals to the main thread's event loop, but
+	 * keep those raised by faults, such as SIGBUS from a truncated shm
+	 * pool, which wl_shm_buffer_begin_access() handles per thread. */
+	sigfillset(&mask);
+	sigdelset(&mask, SIGBUS);
+	sigdelset(&mask, SIGSEGV);
+	sigdelset(&mask, SIGFPE);
+	sigdelset(&mask, SIGILL);
+	pthread_sigmask(SIG_BLOCK, &mask, &old_mask);
+
+	for (i = 0; i < thread_count - 1; i++) {
+		if (pthread_create(&pool->threads[i], NULL,
+				   render_pool_thread, pool) != 0)
+			break;
+		pool->thread_count++;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+	if (pool->thread_count == 0) {
+		render_pool_destroy(pool);
+		return NULL;
+	}
+
+	return pool;
 }
 
 static void
@@ -557,13 +824,31 @@ static void
 pixman_renderer_repaint_output(struct weston_output *output,
 			     pixman_region32_t *output_damage)
 {
+	struct pixman_renderer *pr = get_renderer(output->compositor);
 	struct pixman_output_state *po = get_output_state(output);
+	struct pixman_render_target target;
 
 	if (!po->hw_buffer)
 		return;
 
-	repaint_surfaces(output, output_damage);
-	copy_to_hw_buffer(output, output_damage);
+	weston_output_frame_stats_begin(output,
+					WESTON_FRAME_STATS_RENDERER_REPAINT);
+
+	if (pr->pool) {
+		render_pool_repaint(pr->pool, output, output_damage);
+	} else {
+		target.image = get_render_image(po);
+		target.debug_color = pr->repaint_debug ? pr->debug_color : NULL;
+		target.band = NULL;
+		repaint_surfaces(output, &target, output_damage);
+	}
+
+	if (po->shadow_image)
+		copy_to_hw_buffer(output, output_damage);
+
+	weston_output_frame_stats_end(output,
+				      WESTON_FRAME_STATS_RENDERER_REPAINT,
+				      NULL);
 
 	pixman_region32_copy(&output->previous_damage, output_damage);
 	wl_signal_emit(&output->frame_signal, output);
@@ -735,6 +1020,7 @@ pixman_renderer_surface_set_color(struct weston_surface *es,
 	color.green = green * 0xffff;
 	color.blue = blue * 0xffff;
 	color.alpha = alpha * 0xffff;
+	ps->color = color;
 
 	if (ps->image) {
 		pixman_image_unref(ps->image);
@@ -751,6 +1037,8 @@ pixman_renderer_destroy(struct weston_compositor *ec)
 
 	wl_signal_emit(&pr->destroy_signal, pr);
 	weston_binding_destroy(pr->debug_binding);
+	if (pr->pool)
+		render_pool_destroy(pr->pool);
 	free(pr);
 
 	ec->renderer = NULL;
@@ -856,6 +1144,16 @@ pixman_renderer_init(struct weston_compositor *ec)
 
 	wl_display_add_shm_format(ec->wl_display, WL_SHM_FORMAT_RGB565);
 
+	if (ec->renderer_threads > 1) {
+		renderer->pool = render_pool_create(ec->renderer_threads);
+		if (renderer->pool)
+			weston_log("Pixman renderer using %d threads\n",
+				   renderer->pool->thread_count + 1);
+		else
+			weston_log("Pixman renderer failed to start worker "
+				   "threads, rendering on one thread\n");
+	}
+
 	wl_signal_init(&renderer->destroy_signal);
 
 	return 0;
@@ -876,8 +1174,19 @@ pixman_renderer_output_set_buffer(struct weston_output *output, pixman_image_t *
 	}
 }
 
+/** Create the pixman renderer state of an output
+ *
+ * \param output The output.
+ * \param flags PIXMAN_RENDERER_OUTPUT_USE_SHADOW to composite into a
+ * shadow buffer and copy the damage to the buffer set with
+ * pixman_renderer_output_set_buffer(). Without it, views are composited
+ * directly into that buffer, saving a pass over every damaged pixel.
+ * This needs a buffer in ordinary memory, since blending reads it back,
+ * that keeps its contents from one repaint to the next.
+ * \return 0 on success, -1 on failure.
+ */
 WL_EXPORT int
-pixman_renderer_output_create(struct weston_output *output)
+pixman_renderer_output_create(struct weston_output *output, uint32_t flags)
 {
 	struct pixman_output_state *po;
 	int w, h;
@@ -886,6 +1195,11 @@ pixman_renderer_output_create(struct weston_output *output)
 	if (po == NULL)
 		return -1;
 
+	if (!(flags & PIXMAN_RENDERER_OUTPUT_USE_SHADOW)) {
+		output->renderer_state = po;
+		return 0;
+	}
+
 	/* set shadow image transformation */
 	w = output->current_mode->width;
 	h = output->current_mode->height;
@@ -917,7 +1231,8 @@ pixman_renderer_output_destroy(struct weston_output *output)
 {
 	struct pixman_output_state *po = get_output_state(output);
 
-	pixman_image_unref(po->shadow_image);
+	if (po->shadow_image)
+		pixman_image_unref(po->shadow_image);
 
 	if (po->hw_buffer)
 		pixman_image_unref(po->hw_buffer);
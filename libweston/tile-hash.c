@@ -0,0 +1,349 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "tile-hash.h"
+#include "shared/helpers.h"
+#include "shared/zalloc.h"
+
+#define TILE_SIZE WESTON_TILE_HASH_TILE_SIZE
+
+/* A row of a tile is hashed in 16 byte stripes into 8 64 bit lanes, in
+ * the manner of XXH3: every stripe adds the product of the halves of the
+ * data mixed with a key to one pair of lanes, and the data itself with
+ * the two halves swapped to the same pair. The lanes are scrambled after
+ * each row, so rows moving within a tile change the hash too. With SSE2
+ * a pair of lanes is one register; the generic code gives the same
+ * results one lane at a time.
+ */
+#define STRIPE_SIZE 16
+#define ROW_STRIPES (TILE_SIZE * 4 / STRIPE_SIZE)
+#define LANES 8
+
+#define PRIME32_1 0x9e3779b1U
+#define PRIME64_1 0x9e3779b185ebca87ULL
+#define PRIME64_2 0xc2b2ae3d27d4eb4fULL
+#define PRIME64_3 0x165667b19e3779f9ULL
+
+/* Two per stripe of a row, then one per lane for the scrambling. */
+static const uint64_t tile_hash_keys[ROW_STRIPES * 2 + LANES]
+	__attribute__((aligned(16))) = {
+	0x4d9ff9f759d2c532ULL, 0xc7ea3790f7480c96ULL,
+	0xc902838199fa65f6ULL, 0x28f0e7d27e8391e1ULL,
+	0x885b57b00a11bbdaULL, 0x0811ccc21c34a87cULL,
+	0x11a386cedc7dc967ULL, 0xf0d1ef6e48cd0f5bULL,
+	0x87c95747a2734755ULL, 0xa44ada36971871f3ULL,
+	0xa774575a7269733aULL, 0x6ee18b0e84aab5a4ULL,
+	0xf3007cf17d29b379ULL, 0x2cfe9e7c25a2f595ULL,
+	0x4dba65c25bd878ddULL, 0xb0c0faff90b46f15ULL,
+	0x70b35588f2ea5794ULL, 0x10b517e4a6b1c178ULL,
+	0x9caae1ecb3064931ULL, 0x3de65f5b0e11bdebULL,
+	0xf97a99bd45f80823ULL, 0xd0c144dc9306f074ULL,
+	0x25f773b37610b122ULL, 0x7bf0a41e9e4e9e2eULL,
+	0xf2a9455fc003c845ULL, 0x05f3d457a5139946ULL,
+	0xbd5b2771b38f6638ULL, 0x7e345eed5194ae7aULL,
+	0x500f157e2d0ef29dULL, 0xbaf95179ce23d963ULL,
+	0x23c0462c0a650b8eULL, 0x17e5f2fcf09bdcd9ULL,
+	0x770522d41bd29be6ULL, 0x427e1eaf86ce8eddULL,
+	0x24ef3ca90725dd35ULL, 0xb8bc22136789a9e0ULL,
+	0xd3a9a719f4a3f91aULL, 0xf7b2d0cff905cc52ULL,
+	0x056e7993e7413493ULL, 0x2b603263cf9fcf99ULL,
+};
+
+static const uint64_t tile_hash_init[LANES] = {
+	PRIME32_1, PRIME64_1, PRIME64_2, PRIME64_3,
+	~PRIME64_1, ~PRIME64_2, ~PRIME64_3, ~(uint64_t)PRIME32_1,
+};
+
+struct weston_tile_hash {
+	int width, height;
+	int cols, rows;
+	uint64_t *hashes;
+	bool *known;
+};
+
+static inline uint64_t
+rotl64(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t
+tile_hash_merge(const uint64_t *acc, int width, int height)
+{
+	uint64_t h = ((uint64_t)width << 32) | height;
+	int i;
+
+	for (i = 0; i < LANES; i++) {
+		h ^= acc[i] * PRIME64_2;
+		h = rotl64(h, 31) * PRIME64_1;
+	}
+
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+
+	return h;
+}
+
+#ifdef __SSE2__
+
+static inline __m128i
+tile_hash_accumulate(__m128i acc, __m128i data, __m128i key)
+{
+	__m128i data_key = _mm_xor_si128(data, key);
+	__m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+	__m128i product = _mm_mul_epu32(data_key, data_key_hi);
+	__m128i swapped = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+
+	return _mm_add_epi64(acc, _mm_add_epi64(product, swapped));
+}
+
+static inline __m128i
+tile_hash_scramble(__m128i acc, __m128i key)
+{
+	const __m128i prime = _mm_set1_epi32(PRIME32_1);
+	__m128i hi;
+
+	acc = _mm_xor_si128(acc, _mm_srli_epi64(acc, 47));
+	acc = _mm_xor_si128(acc, key);
+	hi = _mm_shuffle_epi32(acc, _MM_SHUFFLE(0, 3, 0, 1));
+
+	return _mm_add_epi64(_mm_mul_epu32(acc, prime),
+			     _mm_slli_epi64(_mm_mul_epu32(hi, prime), 32));
+}
+
+uint64_t
+weston_tile_hash_compute(const void *data, int stride, int width, int height)
+{
+	const __m128i *keys = (const __m128i *)tile_hash_keys;
+	int row_bytes = width * 4;
+	int stripes = row_bytes / STRIPE_SIZE;
+	int tail = row_bytes % STRIPE_SIZE;
+	uint8_t tail_buf[STRIPE_SIZE] = { 0 };
+	uint64_t result[LANES] __attribute__((aligned(16)));
+	__m128i acc[LANES / 2];
+	const uint8_t *row;
+	int x, y, i;
+
+	assert(width <= TILE_SIZE && height <= TILE_SIZE);
+
+	for (i = 0; i < LANES / 2; i++)
+		acc[i] = _mm_loadu_si128((const __m128i *)&tile_hash_init[i * 2]);
+
+	for (y = 0; y < height; y++) {
+		row = (const uint8_t *)data + y * stride;
+
+		for (x = 0; x < stripes; x++)
+			acc[x & 3] = tile_hash_accumulate(acc[x & 3],
+				_mm_loadu_si128((const __m128i *)(row + x * STRIPE_SIZE)),
+				_mm_load_si128(&keys[x]));
+
+		if (tail) {
+			memcpy(tail_buf, row + stripes * STRIPE_SIZE, tail);
+			acc[x & 3] = tile_hash_accumulate(acc[x & 3],
+				_mm_loadu_si128((const __m128i *)tail_buf),
+				_mm_load_si128(&keys[x]));
+		}
+
+		for (i = 0; i < LANES / 2; i++)
+			acc[i] = tile_hash_scramble(acc[i],
+				_mm_load_si128(&keys[ROW_STRIPES + i]));
+	}
+
+	for (i = 0; i < LANES / 2; i++)
+		_mm_store_si128((__m128i *)&result[i * 2], acc[i]);
+
+	return tile_hash_merge(result, width, height);
+}
+
+#else
+
+static inline uint64_t
+load64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof v);
+
+	return v;
+}
+
+static inline void
+tile_hash_accumulate(uint64_t *acc, const uint8_t *data, const uint64_t *key)
+{
+	uint64_t d[2] = { load64(data), load64(data + 8) };
+	uint64_t dk;
+	int l;
+
+	for (l = 0; l < 2; l++) {
+		dk = d[l] ^ key[l];
+		acc[l] += (dk & 0xffffffff) * (dk >> 32) + d[l ^ 1];
+	}
+}
+
+uint64_t
+weston_tile_hash_compute(const void *data, int stride, int width, int height)
+{
+	const uint64_t *keys = tile_hash_keys;
+	int row_bytes = width * 4;
+	int stripes = row_bytes / STRIPE_SIZE;
+	int tail = row_bytes % STRIPE_SIZE;
+	uint8_t tail_buf[STRIPE_SIZE] = { 0 };
+	uint64_t acc[LANES];
+	const uint8_t *row;
+	int x, y, i;
+
+	assert(width <= TILE_SIZE && height <= TILE_SIZE);
+
+	memcpy(acc, tile_hash_init, sizeof acc);
+
+	for (y = 0; y < height; y++) {
+		row = (const uint8_t *)data + y * stride;
+
+		for (x = 0; x < stripes; x++)
+			tile_hash_accumulate(&acc[(x & 3) * 2],
+					     row + x * STRIPE_SIZE,
+					     &keys[x * 2]);
+
+		if (tail) {
+			memcpy(tail_buf, row + stripes * STRIPE_SIZE, tail);
+			tile_hash_accumulate(&acc[(x & 3) * 2], tail_buf,
+					     &keys[x * 2]);
+		}
+
+		for (i = 0; i < LANES; i++) {
+			acc[i] ^= acc[i] >> 47;
+			acc[i] ^= keys[ROW_STRIPES * 2 + i];
+			acc[i] *= PRIME32_1;
+		}
+	}
+
+	return tile_hash_merge(acc, width, height);
+}
+
+#endif
+
+struct weston_tile_hash *
+weston_tile_hash_create(int width, int height)
+{
+	struct weston_tile_hash *th;
+
+	th = zalloc(sizeof *th);
+	if (!th)
+		return NULL;
+
+	th->width = width;
+	th->height = height;
+	th->cols = (width + TILE_SIZE - 1) / TILE_SIZE;
+	th->rows = (height + TILE_SIZE - 1) / TILE_SIZE;
+	th->hashes = calloc(th->cols * th->rows, sizeof *th->hashes);
+	th->known = calloc(th->cols * th->rows, sizeof *th->known);
+	if (!th->hashes || !th->known) {
+		weston_tile_hash_destroy(th);
+		return NULL;
+	}
+
+	return th;
+}
+
+void
+weston_tile_hash_destroy(struct weston_tile_hash *th)
+{
+	free(th->hashes);
+	free(th->known);
+	free(th);
+}
+
+void
+weston_tile_hash_refine(struct weston_tile_hash *th, pixman_image_t *image,
+			pixman_region32_t *damage)
+{
+	const uint8_t *data = (const uint8_t *)pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image);
+	pixman_region32_t unchanged;
+	pixman_box32_t *extents, tile;
+	int col, row, col1, col2, row1, row2, i;
+	uint64_t hash;
+
+	assert(pixman_image_get_width(image) == th->width &&
+	       pixman_image_get_height(image) == th->height);
+
+	pixman_region32_intersect_rect(damage, damage,
+				       0, 0, th->width, th->height);
+	if (!pixman_region32_not_empty(damage))
+		return;
+
+	extents = pixman_region32_extents(damage);
+	col1 = extents->x1 / TILE_SIZE;
+	col2 = (extents->x2 - 1) / TILE_SIZE;
+	row1 = extents->y1 / TILE_SIZE;
+	row2 = (extents->y2 - 1) / TILE_SIZE;
+
+	pixman_region32_init(&unchanged);
+
+	for (row = row1; row <= row2; row++) {
+		for (col = col1; col <= col2; col++) {
+			tile.x1 = col * TILE_SIZE;
+			tile.y1 = row * TILE_SIZE;
+			tile.x2 = MIN(tile.x1 + TILE_SIZE, th->width);
+			tile.y2 = MIN(tile.y1 + TILE_SIZE, th->height);
+
+			if (pixman_region32_contains_rectangle(damage, &tile) ==
+			    PIXMAN_REGION_OUT)
+				continue;
+
+			hash = weston_tile_hash_compute(data + tile.y1 * stride +
+							tile.x1 * 4, stride,
+							tile.x2 - tile.x1,
+							tile.y2 - tile.y1);
+
+			i = row * th->cols + col;
+			if (th->known[i] && th->hashes[i] == hash)
+				pixman_region32_union_rect(&unchanged, &unchanged,
+							   tile.x1, tile.y1,
+							   tile.x2 - tile.x1,
+							   tile.y2 - tile.y1);
+			th->hashes[i] = hash;
+			th->known[i] = true;
+		}
+	}
+
+	pixman_region32_subtract(damage, damage, &unchanged);
+	pixman_region32_fini(&unchanged);
+}
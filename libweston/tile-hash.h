@@ -0,0 +1,64 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_TILE_HASH_H
+#define WESTON_TILE_HASH_H
+
+#include <stdint.h>
+
+#include <pixman.h>
+
+#define WESTON_TILE_HASH_TILE_SIZE 64
+
+/* Content based damage refinement for outputs whose updates are sent
+ * over a network.
+ *
+ * Damage is often pessimistic: a client damaging a whole window for a
+ * blinking cursor repaints pixels that come out the same. The image is
+ * cut into 64x64 tiles and the hash of every tile is kept from the last
+ * time it was damaged; tiles whose content hashes the same as then are
+ * dropped from the damage.
+ */
+struct weston_tile_hash;
+
+struct weston_tile_hash *
+weston_tile_hash_create(int width, int height);
+
+void
+weston_tile_hash_destroy(struct weston_tile_hash *th);
+
+/* Remove from damage, in image coordinates, the tiles of image whose
+ * content did not change since they were last damaged. The image must
+ * be 32 bits per pixel, and of the size the tile hash was created for.
+ */
+void
+weston_tile_hash_refine(struct weston_tile_hash *th, pixman_image_t *image,
+			pixman_region32_t *damage);
+
+/* The hash of a block of up to 64x64 32 bit pixels, stride in bytes. */
+uint64_t
+weston_tile_hash_compute(const void *data, int stride, int width, int height);
+
+#endif
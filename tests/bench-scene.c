@@ -0,0 +1,142 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+
+#include "bench-scene.h"
+#include "shared/helpers.h"
+
+static void
+add_view(struct bench_scene *scene, int i,
+	 int x, int y, int width, int height, float alpha)
+{
+	struct weston_surface *surface;
+	struct weston_view *view;
+
+	surface = weston_surface_create(scene->compositor);
+	assert(surface);
+	view = weston_view_create(surface);
+	assert(view);
+
+	weston_surface_set_color(surface, 0.2 * i, 0.4, 0.8, alpha);
+	weston_surface_set_size(surface, width, height);
+	if (alpha == 1.0) {
+		pixman_region32_fini(&surface->opaque);
+		pixman_region32_init_rect(&surface->opaque,
+					  0, 0, width, height);
+	}
+	weston_view_set_position(view, x, y);
+	weston_layer_entry_insert(&scene->layer.view_list, &view->layer_link);
+	weston_view_update_transform(view);
+	surface->is_mapped = true;
+	view->is_mapped = true;
+
+	scene->surface[i] = surface;
+	scene->view[i] = view;
+}
+
+static void
+run_idle(void *data)
+{
+	struct bench_scene *scene = data;
+
+	scene->run(scene);
+}
+
+static void
+frame_handler(struct wl_listener *listener, void *data)
+{
+	struct bench_scene *scene =
+		container_of(listener, struct bench_scene, frame_listener);
+	struct wl_event_loop *loop;
+
+	/* The view list and clips are valid now; benchmark outside of the
+	 * repaint, as the renderer emits this signal itself and the
+	 * backend has not finished the frame yet. */
+	wl_list_remove(&scene->frame_listener.link);
+	loop = wl_display_get_event_loop(scene->compositor->wl_display);
+	wl_event_loop_add_idle(loop, run_idle, scene);
+}
+
+/** Call run once the output has repainted
+ *
+ * Schedules a repaint of the scene's output; run is called from an idle
+ * callback after it.
+ */
+void
+bench_scene_run_after_frame(struct bench_scene *scene,
+			    void (*run)(struct bench_scene *scene))
+{
+	scene->run = run;
+	scene->frame_listener.notify = frame_handler;
+	wl_signal_add(&scene->output->frame_signal, &scene->frame_listener);
+	weston_output_schedule_repaint(scene->output);
+}
+
+static void
+setup_scene(void *data)
+{
+	struct bench_scene *scene = data;
+	struct weston_output *output;
+
+	assert(!wl_list_empty(&scene->compositor->output_list));
+	output = container_of(scene->compositor->output_list.next,
+			      struct weston_output, link);
+	scene->output = output;
+
+	weston_layer_init(&scene->layer, scene->compositor);
+	weston_layer_set_position(&scene->layer, WESTON_LAYER_POSITION_UI);
+
+	/* The window covers both copying and blending, and the top left
+	 * quarter of the output but not the bottom left one. */
+	add_view(scene, BENCH_SCENE_BACKGROUND,
+		 output->x, output->y, output->width, output->height, 1.0);
+	add_view(scene, BENCH_SCENE_WINDOW,
+		 output->x + output->width / 8,
+		 output->y + output->height / 8,
+		 output->width / 2, output->height / 2, 0.5);
+
+	bench_scene_run_after_frame(scene, scene->run);
+}
+
+/** Set up the scene once the compositor runs
+ *
+ * run is called after the first frame with the scene was drawn.
+ */
+void
+bench_scene_init(struct bench_scene *scene,
+		 struct weston_compositor *compositor,
+		 void (*run)(struct bench_scene *scene))
+{
+	struct wl_event_loop *loop;
+
+	scene->compositor = compositor;
+	scene->run = run;
+
+	loop = wl_display_get_event_loop(compositor->wl_display);
+	wl_event_loop_add_idle(loop, setup_scene, scene);
+}
@@ -0,0 +1,60 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#ifndef WESTON_BENCH_SCENE_H
+#define WESTON_BENCH_SCENE_H
+
+#include "compositor.h"
+
+/* The scene the renderer benchmark modules draw on the first output: an
+ * opaque background and a translucent window, placed off centre so a
+ * flipped picture is caught.
+ */
+
+#define BENCH_SCENE_BACKGROUND 0
+#define BENCH_SCENE_WINDOW 1
+
+struct bench_scene {
+	struct weston_compositor *compositor;
+	struct weston_output *output;
+	struct weston_layer layer;
+	struct weston_surface *surface[2];
+	struct weston_view *view[2];
+	struct wl_listener frame_listener;
+
+	/* Called from an idle callback after the scene was first drawn */
+	void (*run)(struct bench_scene *scene);
+};
+
+void
+bench_scene_init(struct bench_scene *scene,
+		 struct weston_compositor *compositor,
+		 void (*run)(struct bench_scene *scene));
+
+void
+bench_scene_run_after_frame(struct bench_scene *scene,
+			    void (*run)(struct bench_scene *scene));
+
+#endif
@@ -0,0 +1,146 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pixman.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "drm-damage.h"
+
+/* The layout of struct drm_mode_rect, which is only in newer kernel
+ * headers; the FB_DAMAGE_CLIPS blob is an array of these. */
+struct mode_rect {
+	int32_t x1, y1, x2, y2;
+};
+
+static void
+fb_clips_blob(pixman_region32_t *damage, bool reused,
+	      struct mode_rect *blob, int max, int *n)
+{
+	const pixman_box32_t *rects;
+
+	rects = drm_damage_fb_clips(damage, reused, n);
+	if (!rects) {
+		*n = 0;
+		return;
+	}
+
+	assert(*n <= max);
+	memcpy(blob, rects, *n * sizeof *rects);
+}
+
+TEST(fb_clips_follow_damage)
+{
+	static const pixman_box32_t boxes[] = {
+		{ 10, 20, 110, 70 },
+		{ 300, 400, 1920, 1080 },
+	};
+	pixman_region32_t damage;
+	struct mode_rect blob[4];
+	int n, i;
+
+	assert(sizeof(pixman_box32_t) == sizeof(struct mode_rect));
+
+	pixman_region32_init_rects(&damage, boxes, ARRAY_LENGTH(boxes));
+
+	/* Damage is sent as is, whether the framebuffer is new or not. */
+	fb_clips_blob(&damage, false, blob, ARRAY_LENGTH(blob), &n);
+	assert(n == (int) ARRAY_LENGTH(boxes));
+	for (i = 0; i < n; i++) {
+		assert(blob[i].x1 == boxes[i].x1);
+		assert(blob[i].y1 == boxes[i].y1);
+		assert(blob[i].x2 == boxes[i].x2);
+		assert(blob[i].y2 == boxes[i].y2);
+	}
+
+	fb_clips_blob(&damage, true, blob, ARRAY_LENGTH(blob), &n);
+	assert(n == (int) ARRAY_LENGTH(boxes));
+
+	pixman_region32_fini(&damage);
+}
+
+TEST(fb_clips_without_damage)
+{
+	pixman_region32_t damage;
+	struct mode_rect blob[4];
+	int n;
+
+	pixman_region32_init(&damage);
+
+	/* A new framebuffer gets no blob, and so is damaged entirely. */
+	assert(drm_damage_fb_clips(&damage, false, &n) == NULL);
+
+	/* A reused one gets a single empty rectangle. */
+	memset(blob, 0xff, sizeof blob);
+	fb_clips_blob(&damage, true, blob, ARRAY_LENGTH(blob), &n);
+	assert(n == 1);
+	assert(blob[0].x1 == 0 && blob[0].y1 == 0);
+	assert(blob[0].x2 == 0 && blob[0].y2 == 0);
+
+	pixman_region32_fini(&damage);
+}
+
+TEST(dirty_clips_follow_damage)
+{
+	static const pixman_box32_t boxes[] = {
+		{ 0, 0, 64, 32 },
+		{ 100, 50, 200, 60 },
+		{ 5000, 70000, 70000, 80000 },
+	};
+	pixman_region32_t damage;
+	drmModeClip *clips;
+	int n;
+
+	pixman_region32_init(&damage);
+	assert(drm_damage_dirty_clips(&damage, &n) == NULL);
+	assert(n == 0);
+	pixman_region32_fini(&damage);
+
+	pixman_region32_init_rects(&damage, boxes, ARRAY_LENGTH(boxes));
+	clips = drm_damage_dirty_clips(&damage, &n);
+	assert(clips);
+	assert(n == (int) ARRAY_LENGTH(boxes));
+
+	assert(clips[0].x1 == 0 && clips[0].y1 == 0);
+	assert(clips[0].x2 == 64 && clips[0].y2 == 32);
+	assert(clips[1].x1 == 100 && clips[1].y1 == 50);
+	assert(clips[1].x2 == 200 && clips[1].y2 == 60);
+
+	/* Clamped to the 16 bits of drmModeClip. */
+	assert(clips[2].x1 == 5000 && clips[2].y1 == UINT16_MAX);
+	assert(clips[2].x2 == UINT16_MAX && clips[2].y2 == UINT16_MAX);
+
+	free(clips);
+	pixman_region32_fini(&damage);
+}
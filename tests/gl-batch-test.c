@@ -0,0 +1,246 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+#include "compositor-headless.h"
+#include "bench-scene.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Draws a grid of small opaque views over the bench scene with the GL
+ * renderer on the headless backend, as an icon grid or a stack of
+ * notifications would be. With all tiles of one colour the renderer
+ * draws them with one call; with alternating colours every tile needs
+ * its own call and uniform update. The tiles are checked to land where
+ * they should both ways, then the time of a full-output repaint is
+ * printed for each.
+ */
+
+#define BENCH_FRAMES 60
+
+#define TILE_SIZE 32
+#define TILE_STEP 40
+#define TILE_COLUMNS 40
+#define TILE_ROWS 24
+#define TILE_COUNT (TILE_COLUMNS * TILE_ROWS)
+
+/* The colour bench_scene gives the background, and the tile colours. */
+#define BACKGROUND_COLOR 0x0066cc
+#define TILE_COLOR_A 0xffcc00
+#define TILE_COLOR_B 0x00cc66
+
+static struct bench_scene bench;
+static struct weston_view *tiles[TILE_COUNT];
+static double one_color_msec;
+
+/* Pixel at (x, y) counted from the top of the output image. */
+static uint32_t
+pixel_at(pixman_image_t *image, int x, int y)
+{
+	uint32_t *data = pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image) / 4;
+
+	return data[y * stride + x] & 0xffffff;
+}
+
+/* GL may round each channel either way. */
+static void
+assert_pixel(pixman_image_t *image, int x, int y, uint32_t color)
+{
+	uint32_t pixel = pixel_at(image, x, y);
+	int shift, diff;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		diff = (int)((pixel >> shift) & 0xff) -
+		       (int)((color >> shift) & 0xff);
+		assert(abs(diff) <= 1);
+	}
+}
+
+static void
+set_tile_color(struct weston_view *tile, uint32_t color)
+{
+	weston_surface_set_color(tile->surface,
+				 ((color >> 16) & 0xff) / 255.0,
+				 ((color >> 8) & 0xff) / 255.0,
+				 (color & 0xff) / 255.0, 1.0);
+	weston_surface_damage(tile->surface);
+}
+
+static void
+check_tiles(struct bench_scene *scene, uint32_t color_a, uint32_t color_b)
+{
+	const struct weston_headless_output_api *api =
+		weston_headless_output_get_api(scene->compositor);
+	pixman_image_t *image;
+	int i, x, y;
+
+	assert(api);
+	image = api->get_image(scene->output);
+	assert(image);
+
+	for (i = 0; i < TILE_COUNT; i += TILE_COUNT / 7) {
+		x = tiles[i]->geometry.x - scene->output->x;
+		y = tiles[i]->geometry.y - scene->output->y;
+
+		assert_pixel(image, x, y, i % 2 ? color_b : color_a);
+		assert_pixel(image, x + TILE_SIZE - 1, y + TILE_SIZE - 1,
+			     i % 2 ? color_b : color_a);
+	}
+
+	/* Right of and below the last tile, clear of the window. */
+	x = TILE_STEP * (TILE_COLUMNS - 1) + TILE_SIZE;
+	y = TILE_STEP * (TILE_ROWS - 1) + TILE_SIZE;
+	assert_pixel(image, x, y - 1, BACKGROUND_COLOR);
+	assert_pixel(image, x - 1, y, BACKGROUND_COLOR);
+}
+
+/* Full-output repaints, each waited for by reading a pixel back. */
+static double
+time_frames(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	struct weston_renderer *renderer = scene->compositor->renderer;
+	pixman_region32_t damage;
+	struct timespec begin, end;
+	uint32_t pixel;
+	int i, ret;
+
+	pixman_region32_init_rect(&damage, output->x, output->y,
+				  output->width, output->height);
+
+	/* The first frame fills the renderer's caches. */
+	renderer->repaint_output(output, &damage);
+	ret = renderer->read_pixels(output, PIXMAN_a8r8g8b8, &pixel,
+				    0, 0, 1, 1);
+	assert(ret == 0);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		renderer->repaint_output(output, &damage);
+		renderer->read_pixels(output, PIXMAN_a8r8g8b8, &pixel,
+				      0, 0, 1, 1);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pixman_region32_fini(&damage);
+
+	return timespec_sub_to_nsec(&end, &begin) / (1000000.0 * BENCH_FRAMES);
+}
+
+static void
+check_alternating(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	double alternating_msec;
+
+	check_tiles(scene, TILE_COLOR_A, TILE_COLOR_B);
+	alternating_msec = time_frames(scene);
+
+	fprintf(stderr, "%d tiles of %dx%d on %dx%d, full repaint, "
+		"%d frames:\n", TILE_COUNT, TILE_SIZE, TILE_SIZE,
+		output->current_mode->width, output->current_mode->height,
+		BENCH_FRAMES);
+	fprintf(stderr, "  one colour:          %.3f ms/frame\n",
+		one_color_msec);
+	fprintf(stderr, "  alternating colours: %.3f ms/frame\n",
+		alternating_msec);
+
+	wl_display_terminate(scene->compositor->wl_display);
+}
+
+static void
+check_one_color(struct bench_scene *scene)
+{
+	int i;
+
+	check_tiles(scene, TILE_COLOR_A, TILE_COLOR_A);
+	one_color_msec = time_frames(scene);
+
+	/* Neighbours in the view list no longer share their state. */
+	for (i = 1; i < TILE_COUNT; i += 2)
+		set_tile_color(tiles[i], TILE_COLOR_B);
+
+	bench_scene_run_after_frame(scene, check_alternating);
+}
+
+static void
+add_tiles(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	struct weston_surface *surface;
+	struct weston_view *view;
+	int i;
+
+	assert(output->width >= TILE_STEP * TILE_COLUMNS);
+	assert(output->height >= TILE_STEP * TILE_ROWS);
+
+	/* Inserted at the top of the layer, so the last one created is
+	 * the first drawn. */
+	for (i = 0; i < TILE_COUNT; i++) {
+		surface = weston_surface_create(scene->compositor);
+		assert(surface);
+		view = weston_view_create(surface);
+		assert(view);
+
+		weston_surface_set_size(surface, TILE_SIZE, TILE_SIZE);
+		pixman_region32_fini(&surface->opaque);
+		pixman_region32_init_rect(&surface->opaque,
+					  0, 0, TILE_SIZE, TILE_SIZE);
+		weston_view_set_position(view,
+					 output->x +
+					 TILE_STEP * (i % TILE_COLUMNS),
+					 output->y +
+					 TILE_STEP * (i / TILE_COLUMNS));
+		weston_layer_entry_insert(&scene->layer.view_list,
+					  &view->layer_link);
+		weston_view_update_transform(view);
+		surface->is_mapped = true;
+		view->is_mapped = true;
+
+		tiles[i] = view;
+		set_tile_color(view, TILE_COLOR_A);
+	}
+
+	bench_scene_run_after_frame(scene, check_one_color);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	bench_scene_init(&bench, compositor, add_tiles);
+
+	return 0;
+}
@@ -0,0 +1,205 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+#include "compositor-headless.h"
+#include "bench-scene.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Renders a scene on the headless backend with the GL renderer drawing
+ * into a pbuffer and checks that the backend reads the frames back the
+ * right side up, both whole and in bands of damaged rows. Then prints
+ * how long a full-output repaint and readback take. pixman-shadow-test
+ * prints the figures of the pixman renderer for the same scene and
+ * output size.
+ */
+
+#define BENCH_FRAMES 60
+
+/* The colours bench_scene gives the background, and this test the
+ * window once it is made opaque. */
+#define BACKGROUND_COLOR 0x0066cc
+#define WINDOW_COLOR 0xff0000
+
+static struct bench_scene bench;
+
+/* Pixel at (x, y) counted from the top of the output image. */
+static uint32_t
+pixel_at(pixman_image_t *image, int x, int y)
+{
+	uint32_t *data = pixman_image_get_data(image);
+	int stride = pixman_image_get_stride(image) / 4;
+
+	return data[y * stride + x] & 0xffffff;
+}
+
+/* GL may round each channel either way. */
+static void
+assert_pixel(pixman_image_t *image, int x, int y, uint32_t color)
+{
+	uint32_t pixel = pixel_at(image, x, y);
+	int shift, diff;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		diff = (int)((pixel >> shift) & 0xff) -
+		       (int)((color >> shift) & 0xff);
+		assert(abs(diff) <= 1);
+	}
+}
+
+static pixman_image_t *
+get_output_image(struct bench_scene *scene)
+{
+	const struct weston_headless_output_api *api =
+		weston_headless_output_get_api(scene->compositor);
+	pixman_image_t *image;
+
+	assert(api);
+	image = api->get_image(scene->output);
+	assert(image);
+	assert(pixman_image_get_width(image) ==
+	       scene->output->current_mode->width);
+	assert(pixman_image_get_height(image) ==
+	       scene->output->current_mode->height);
+
+	return image;
+}
+
+static void
+run_bench(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	struct weston_compositor *compositor = scene->compositor;
+	struct weston_renderer *renderer = compositor->renderer;
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+	pixman_region32_t damage;
+	struct timespec begin, end;
+	double render_msec, readback_msec;
+	uint64_t render_nsec = 0, readback_nsec = 0;
+	uint32_t *pixels;
+	int i, ret;
+
+	pixels = malloc(width * height * 4);
+	assert(pixels);
+
+	pixman_region32_init_rect(&damage, output->x, output->y,
+				  output->width, output->height);
+
+	/* The first frame faults in the buffers. */
+	renderer->repaint_output(output, &damage);
+	ret = renderer->read_pixels(output, PIXMAN_a8r8g8b8, pixels,
+				    0, 0, width, height);
+	assert(ret == 0);
+
+	for (i = 0; i < BENCH_FRAMES; i++) {
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		renderer->repaint_output(output, &damage);
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		render_nsec += timespec_sub_to_nsec(&end, &begin);
+
+		renderer->read_pixels(output, PIXMAN_a8r8g8b8, pixels,
+				      0, 0, width, height);
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		readback_nsec += timespec_sub_to_nsec(&begin, &end);
+	}
+
+	pixman_region32_fini(&damage);
+
+	render_msec = render_nsec / (1000000.0 * BENCH_FRAMES);
+	readback_msec = readback_nsec / (1000000.0 * BENCH_FRAMES);
+
+	fprintf(stderr, "%dx%d full repaint, %d frames:\n",
+		width, height, BENCH_FRAMES);
+	fprintf(stderr, "  gl render:   %.3f ms/frame\n", render_msec);
+	fprintf(stderr, "  gl readback: %.3f ms/frame\n", readback_msec);
+	fprintf(stderr, "  total:       %.3f ms/frame\n",
+		render_msec + readback_msec);
+
+	free(pixels);
+
+	wl_display_terminate(compositor->wl_display);
+}
+
+/* Only the window's rows were damaged, so the backend read back just
+ * that band; it has to land on the same rows, top row first. */
+static void
+check_band_frame(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	struct weston_view *window = scene->view[BENCH_SCENE_WINDOW];
+	pixman_image_t *image = get_output_image(scene);
+	int x1 = window->geometry.x - output->x;
+	int y1 = window->geometry.y - output->y;
+	int x2 = x1 + window->surface->width;
+	int y2 = y1 + window->surface->height;
+
+	assert_pixel(image, x1, y1, WINDOW_COLOR);
+	assert_pixel(image, x2 - 1, y2 - 1, WINDOW_COLOR);
+	assert_pixel(image, x1, y1 - 1, BACKGROUND_COLOR);
+	assert_pixel(image, x1, y2, BACKGROUND_COLOR);
+	assert_pixel(image, x2, y1, BACKGROUND_COLOR);
+
+	run_bench(scene);
+}
+
+static void
+check_full_frame(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	struct weston_surface *window = scene->surface[BENCH_SCENE_WINDOW];
+	pixman_image_t *image = get_output_image(scene);
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+
+	/* The translucent window covers the top left quarter only. */
+	assert(pixel_at(image, width / 4, height / 4) != BACKGROUND_COLOR);
+	assert_pixel(image, width / 4, height * 3 / 4, BACKGROUND_COLOR);
+	assert_pixel(image, width * 3 / 4, height / 4, BACKGROUND_COLOR);
+	assert_pixel(image, width * 3 / 4, height * 3 / 4, BACKGROUND_COLOR);
+
+	weston_surface_set_color(window, 1.0, 0.0, 0.0, 1.0);
+	weston_surface_damage(window);
+	bench_scene_run_after_frame(scene, check_band_frame);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	bench_scene_init(&bench, compositor, check_full_frame);
+
+	return 0;
+}
@@ -0,0 +1,200 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "pick-grid.h"
+
+struct box {
+	int32_t x1, y1, x2, y2;
+};
+
+/* What weston_compositor_pick_view() did before the grid: the first box
+ * in stacking order containing the point. */
+static struct box *
+pick_linear(struct box *boxes, int count, int32_t x, int32_t y)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		if (x >= boxes[i].x1 && x < boxes[i].x2 &&
+		    y >= boxes[i].y1 && y < boxes[i].y2)
+			return &boxes[i];
+	}
+
+	return NULL;
+}
+
+static struct box *
+pick_grid(struct weston_pick_grid *grid, int32_t x, int32_t y)
+{
+	int pos = 0;
+
+	return weston_pick_grid_next(grid, x, y, &pos);
+}
+
+static void
+random_boxes(struct box *boxes, int count, int32_t width, int32_t height)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		boxes[i].x1 = rand() % width - 100;
+		boxes[i].y1 = rand() % height - 100;
+		boxes[i].x2 = boxes[i].x1 + 1 + rand() % 800;
+		boxes[i].y2 = boxes[i].y1 + 1 + rand() % 600;
+	}
+}
+
+static struct weston_pick_grid *
+build_grid(struct box *boxes, int count)
+{
+	struct weston_pick_grid *grid;
+	int i;
+
+	grid = weston_pick_grid_create();
+	assert(grid);
+
+	weston_pick_grid_clear(grid);
+	for (i = 0; i < count; i++)
+		assert(weston_pick_grid_add(grid, boxes[i].x1, boxes[i].y1,
+					    boxes[i].x2, boxes[i].y2,
+					    &boxes[i]) == 0);
+	assert(weston_pick_grid_finish(grid) == 0);
+
+	return grid;
+}
+
+static double
+elapsed(const struct timespec *begin)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin->tv_sec) +
+	       1e-9 * (t.tv_nsec - begin->tv_nsec);
+}
+
+TEST(empty_grid)
+{
+	struct weston_pick_grid *grid;
+
+	grid = weston_pick_grid_create();
+	assert(grid);
+
+	weston_pick_grid_clear(grid);
+	assert(weston_pick_grid_add(grid, 10, 10, 10, 20, NULL) == 0);
+	assert(weston_pick_grid_finish(grid) == 0);
+	assert(pick_grid(grid, 10, 10) == NULL);
+
+	weston_pick_grid_destroy(grid);
+}
+
+TEST(stacking_order)
+{
+	struct box boxes[] = {
+		{ 100, 100, 200, 200 },
+		{ 0, 0, 1920, 1080 },
+		{ -5000, -5000, 5000, 5000 },
+	};
+	struct weston_pick_grid *grid;
+	int pos = 0;
+
+	grid = build_grid(boxes, ARRAY_LENGTH(boxes));
+
+	assert(weston_pick_grid_next(grid, 150, 150, &pos) == &boxes[0]);
+	assert(weston_pick_grid_next(grid, 150, 150, &pos) == &boxes[1]);
+	assert(weston_pick_grid_next(grid, 150, 150, &pos) == &boxes[2]);
+	assert(weston_pick_grid_next(grid, 150, 150, &pos) == NULL);
+
+	assert(pick_grid(grid, 200, 150) == &boxes[1]);
+	assert(pick_grid(grid, 1920, 0) == &boxes[2]);
+	assert(pick_grid(grid, 5000, 0) == NULL);
+	assert(pick_grid(grid, -5001, 0) == NULL);
+
+	weston_pick_grid_destroy(grid);
+}
+
+TEST(matches_linear_search)
+{
+	const int count = 500;
+	const int queries = 200000;
+	struct box *boxes;
+	struct weston_pick_grid *grid;
+	struct timespec begin;
+	double t_linear, t_grid;
+	int32_t *points;
+	int i, hits = 0;
+
+	srand(0);
+
+	boxes = calloc(count, sizeof *boxes);
+	points = calloc(queries * 2, sizeof *points);
+	assert(boxes && points);
+
+	random_boxes(boxes, count, 3840 * 2, 2160);
+	for (i = 0; i < queries * 2; i += 2) {
+		points[i] = rand() % (3840 * 2 + 400) - 200;
+		points[i + 1] = rand() % (2160 + 400) - 200;
+	}
+
+	grid = build_grid(boxes, count);
+
+	for (i = 0; i < queries * 2; i += 2) {
+		struct box *b = pick_linear(boxes, count,
+					    points[i], points[i + 1]);
+
+		assert(pick_grid(grid, points[i], points[i + 1]) == b);
+		if (b)
+			hits++;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < queries * 2; i += 2)
+		hits += !!pick_linear(boxes, count, points[i], points[i + 1]);
+	t_linear = elapsed(&begin);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < queries * 2; i += 2)
+		hits -= !!pick_grid(grid, points[i], points[i + 1]);
+	t_grid = elapsed(&begin);
+
+	printf("%d boxes, %d picks: linear %.3f us/pick, grid %.3f us/pick\n",
+	       count, queries, t_linear * 1e6 / queries,
+	       t_grid * 1e6 / queries);
+
+	weston_pick_grid_destroy(grid);
+	free(points);
+	free(boxes);
+}
@@ -0,0 +1,128 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "compositor.h"
+#include "compositor/weston.h"
+#include "bench-scene.h"
+#include "pixman-renderer.h"
+#include "shared/helpers.h"
+#include "shared/timespec-util.h"
+
+/* Renders the same scene on the headless backend with and without the
+ * pixman renderer's shadow buffer, checks that both give the same
+ * picture and prints how long a full-output repaint takes in each mode.
+ */
+
+#define BENCH_FRAMES 60
+
+static struct bench_scene bench;
+
+static pixman_image_t *
+render_frames(uint32_t flags, double *msec_per_frame)
+{
+	struct weston_output *output = bench.output;
+	struct weston_compositor *compositor = bench.compositor;
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+	pixman_region32_t damage;
+	pixman_image_t *image;
+	struct timespec begin, end;
+	int i, ret;
+
+	pixman_renderer_output_destroy(output);
+	ret = pixman_renderer_output_create(output, flags);
+	assert(ret == 0);
+
+	image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+					 NULL, width * 4);
+	assert(image);
+	pixman_renderer_output_set_buffer(output, image);
+
+	pixman_region32_init_rect(&damage, output->x, output->y,
+				  output->width, output->height);
+
+	/* The first frame faults in the buffers. */
+	compositor->renderer->repaint_output(output, &damage);
+
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for (i = 0; i < BENCH_FRAMES; i++)
+		compositor->renderer->repaint_output(output, &damage);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	pixman_region32_fini(&damage);
+
+	*msec_per_frame = timespec_sub_to_nsec(&end, &begin) /
+			  (1000000.0 * BENCH_FRAMES);
+
+	return image;
+}
+
+static void
+run_bench(struct bench_scene *scene)
+{
+	struct weston_output *output = scene->output;
+	pixman_image_t *shadow, *direct;
+	double shadow_msec, direct_msec;
+	int width = output->current_mode->width;
+	int height = output->current_mode->height;
+
+	shadow = render_frames(PIXMAN_RENDERER_OUTPUT_USE_SHADOW,
+			       &shadow_msec);
+	direct = render_frames(0, &direct_msec);
+
+	assert(memcmp(pixman_image_get_data(shadow),
+		      pixman_image_get_data(direct),
+		      pixman_image_get_stride(direct) * height) == 0);
+
+	fprintf(stderr, "%dx%d full repaint, %d frames:\n",
+		width, height, BENCH_FRAMES);
+	fprintf(stderr, "  shadow buffer: %.3f ms/frame\n", shadow_msec);
+	fprintf(stderr, "  direct:        %.3f ms/frame\n", direct_msec);
+	fprintf(stderr, "  saved:         %.3f ms/frame (%.1f%%)\n",
+		shadow_msec - direct_msec,
+		100.0 * (shadow_msec - direct_msec) / shadow_msec);
+
+	pixman_image_unref(shadow);
+	pixman_image_unref(direct);
+
+	wl_display_terminate(scene->compositor->wl_display);
+}
+
+WL_EXPORT int
+wet_module_init(struct weston_compositor *compositor,
+		int *argc, char *argv[])
+{
+	bench_scene_init(&bench, compositor, run_bench);
+
+	return 0;
+}
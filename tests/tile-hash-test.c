@@ -0,0 +1,245 @@
+/*
+ * Copyright © 2026 agent <agent@local>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pixman.h>
+
+#include "weston-test-runner.h"
+
+#include "shared/helpers.h"
+#include "tile-hash.h"
+
+#define WIDTH 1280
+#define HEIGHT 720
+
+static pixman_image_t *
+random_image(int width, int height)
+{
+	pixman_image_t *image;
+	uint32_t *data;
+	int i;
+
+	image = pixman_image_create_bits(PIXMAN_x8r8g8b8, width, height,
+					 NULL, width * 4);
+	assert(image);
+
+	data = pixman_image_get_data(image);
+	for (i = 0; i < width * height; i++)
+		data[i] = rand() ^ ((uint32_t)rand() << 16);
+
+	return image;
+}
+
+static uint32_t *
+pixel(pixman_image_t *image, int x, int y)
+{
+	return pixman_image_get_data(image) +
+	       y * pixman_image_get_stride(image) / 4 + x;
+}
+
+static int
+region_area(pixman_region32_t *region)
+{
+	pixman_box32_t *boxes;
+	int i, n, area = 0;
+
+	boxes = pixman_region32_rectangles(region, &n);
+	for (i = 0; i < n; i++)
+		area += (boxes[i].x2 - boxes[i].x1) *
+			(boxes[i].y2 - boxes[i].y1);
+
+	return area;
+}
+
+static double
+elapsed(const struct timespec *begin)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return (double)(t.tv_sec - begin->tv_sec) +
+	       1e-9 * (t.tv_nsec - begin->tv_nsec);
+}
+
+TEST(hash_follows_content)
+{
+	pixman_image_t *a, *b;
+	uint32_t row[64];
+	uint64_t hash;
+	int y;
+
+	srand(0);
+
+	a = random_image(200, 100);
+	b = pixman_image_create_bits(PIXMAN_x8r8g8b8, 300, 100, NULL, 300 * 4);
+	assert(b);
+
+	/* The same pixels at another address and stride. */
+	for (y = 0; y < 64; y++)
+		memcpy(pixel(b, 7, y), pixel(a, 3, y), 64 * 4);
+
+	hash = weston_tile_hash_compute(pixel(a, 3, 0), 200 * 4, 64, 64);
+	assert(weston_tile_hash_compute(pixel(b, 7, 0), 300 * 4, 64, 64) ==
+	       hash);
+
+	/* Partial tiles, including rows not a multiple of 16 bytes. */
+	assert(weston_tile_hash_compute(pixel(a, 3, 0), 200 * 4, 37, 5) ==
+	       weston_tile_hash_compute(pixel(b, 7, 0), 300 * 4, 37, 5));
+	assert(weston_tile_hash_compute(pixel(a, 3, 0), 200 * 4, 37, 5) !=
+	       weston_tile_hash_compute(pixel(a, 3, 0), 200 * 4, 38, 5));
+
+	/* A single bit of a single pixel. */
+	*pixel(b, 7 + 50, 20) ^= 0x100;
+	assert(weston_tile_hash_compute(pixel(b, 7, 0), 300 * 4, 64, 64) !=
+	       hash);
+	*pixel(b, 7 + 50, 20) ^= 0x100;
+
+	/* Two rows trading places. */
+	memcpy(row, pixel(b, 7, 10), sizeof row);
+	memcpy(pixel(b, 7, 10), pixel(b, 7, 11), sizeof row);
+	memcpy(pixel(b, 7, 11), row, sizeof row);
+	assert(weston_tile_hash_compute(pixel(b, 7, 0), 300 * 4, 64, 64) !=
+	       hash);
+
+	pixman_image_unref(a);
+	pixman_image_unref(b);
+}
+
+TEST(refine_keeps_every_change)
+{
+	struct weston_tile_hash *th;
+	pixman_image_t *image;
+	pixman_region32_t damage;
+	int i, x, y;
+
+	srand(0);
+
+	image = random_image(WIDTH, HEIGHT);
+	th = weston_tile_hash_create(WIDTH, HEIGHT);
+	assert(th);
+
+	/* Nothing is known yet, so nothing can be dropped. */
+	pixman_region32_init_rect(&damage, 0, 0, WIDTH, HEIGHT);
+	weston_tile_hash_refine(th, image, &damage);
+	assert(region_area(&damage) == WIDTH * HEIGHT);
+	pixman_region32_fini(&damage);
+
+	/* Nothing changed since. */
+	pixman_region32_init_rect(&damage, 0, 0, WIDTH, HEIGHT);
+	weston_tile_hash_refine(th, image, &damage);
+	assert(!pixman_region32_not_empty(&damage));
+	pixman_region32_fini(&damage);
+
+	for (i = 0; i < 100; i++) {
+		x = rand() % WIDTH;
+		y = rand() % HEIGHT;
+		*pixel(image, x, y) ^= 1u << (rand() % 32);
+
+		pixman_region32_init_rect(&damage, 0, 0, WIDTH, HEIGHT);
+		weston_tile_hash_refine(th, image, &damage);
+
+		assert(pixman_region32_contains_point(&damage, x, y, NULL));
+		assert(region_area(&damage) <=
+		       WESTON_TILE_HASH_TILE_SIZE * WESTON_TILE_HASH_TILE_SIZE);
+		pixman_region32_fini(&damage);
+	}
+
+	/* Damage is only ever clipped, not grown. */
+	*pixel(image, 10, 10) ^= 1;
+	pixman_region32_init_rect(&damage, 5, 5, 10, 10);
+	weston_tile_hash_refine(th, image, &damage);
+	assert(region_area(&damage) == 100);
+
+	pixman_region32_fini(&damage);
+	weston_tile_hash_destroy(th);
+	pixman_image_unref(image);
+}
+
+/* A terminal in a window that damages all of itself every frame: the
+ * cursor blinks, and now and then a line is printed and the text
+ * scrolls up by a line.
+ */
+TEST(terminal_workload)
+{
+	const int frames = 240;
+	const int win_x = 100, win_y = 60, win_w = 800, win_h = 600;
+	const int line = 16;
+	struct weston_tile_hash *th;
+	pixman_image_t *image;
+	pixman_region32_t damage;
+	struct timespec begin;
+	double t = 0.0;
+	int64_t damaged = 0, kept = 0;
+	int i, x, y;
+
+	srand(0);
+
+	image = random_image(WIDTH, HEIGHT);
+	th = weston_tile_hash_create(WIDTH, HEIGHT);
+	assert(th);
+
+	for (i = 0; i < frames; i++) {
+		if (i % 8 == 7) {
+			for (y = win_y; y < win_y + win_h - line; y++)
+				memcpy(pixel(image, win_x, y),
+				       pixel(image, win_x, y + line), win_w * 4);
+			for (; y < win_y + win_h; y++)
+				for (x = win_x; x < win_x + win_w; x++)
+					*pixel(image, x, y) = rand();
+		} else {
+			for (y = win_y + win_h - line; y < win_y + win_h; y++)
+				for (x = win_x + 8; x < win_x + 16; x++)
+					*pixel(image, x, y) ^= 0xffffff;
+		}
+
+		pixman_region32_init_rect(&damage, win_x, win_y, win_w, win_h);
+		damaged += region_area(&damage);
+
+		clock_gettime(CLOCK_MONOTONIC, &begin);
+		weston_tile_hash_refine(th, image, &damage);
+		t += elapsed(&begin);
+
+		kept += region_area(&damage);
+		pixman_region32_fini(&damage);
+	}
+
+	assert(kept < damaged / 4);
+
+	printf("%d frames: %.1f%% of damaged pixels sent, "
+	       "hashing %.0f MB/s, %.3f ms/frame\n",
+	       frames, 100.0 * kept / damaged,
+	       damaged * 4 / t / 1e6, t * 1e3 / frames);
+
+	weston_tile_hash_destroy(th);
+	pixman_image_unref(image);
+}